@@ -0,0 +1,276 @@
+// Copyright Rob Cusimano
+
+// Throughput benchmarks over large generated files. Every backend reads every dataset with a cold
+// and a warm page cache and prints one result per line as JSON or CSV.
+//
+//   bench [--size-mb N] [--dir PATH] [--format json|csv] [--keep]
+
+#include "../file.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+struct dataset {
+    std::string name;
+    // Returns the length of the next line, not counting its newline
+    std::function<size_t(std::mt19937_64&)> line_length;
+    std::string path;
+};
+
+struct result {
+    uint64_t bytes = 0;
+    uint64_t lines = 0;
+};
+
+struct backend {
+    std::string name;
+    std::function<result(const std::string&)> run;
+};
+
+// Returns a counter from /proc/self/io, or -1 where there isn't one
+int64_t io_counter(const std::string& name) {
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    int64_t value = 0;
+    while (io >> key >> value) {
+        if (key == name) {
+            return value;
+        }
+    }
+    return -1;
+}
+
+// Resets the peak resident set size so each run reports its own, where the OS allows it
+void reset_peak_rss() {
+    std::ofstream clear("/proc/self/clear_refs");
+    clear << "5";
+}
+
+// Returns the peak resident set size in KiB, or -1 if unknown
+int64_t peak_rss_kb() {
+    std::ifstream status("/proc/self/status");
+    for (std::string line; std::getline(status, line);) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return std::stoll(line.substr(6));
+        }
+    }
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+#endif
+    return -1;
+}
+
+void generate(const dataset& d, uint64_t size) {
+    std::mt19937_64 rng(42);
+    file::options opts;
+    opts.buffer_size = 1024 * 1024;
+    auto f = file::open(d.path, file::mode::write, opts);
+    std::string line;
+    uint64_t written = 0;
+    while (written < size) {
+        line.resize(d.line_length(rng));
+        for (char& c : line) {
+            c = static_cast<char>('a' + rng() % 26);
+        }
+        line.push_back('\n');
+        written += f.write(line);
+    }
+}
+
+// Drops the file from the page cache. Needs the pages to be clean, which they are once synced.
+void drop_cache(const std::string& path) {
+    auto f = file::open<file::raw>(path, file::mode::read);
+    f.advise(file::advice::dontneed);
+}
+
+void warm_cache(const std::string& path) {
+    auto f = file::open<file::raw>(path, file::mode::read);
+    std::vector<char> buf(1024 * 1024);
+    while (f.read(buf.data(), buf.size()) > 0) {
+    }
+}
+
+uint64_t count_lines(std::string_view data) {
+    uint64_t count = 0;
+    const char* p = data.data();
+    const char* end = p + data.size();
+    while ((p = file::detail::find_byte(p, end, '\n')) != end) {
+        count++;
+        p++;
+    }
+    return count;
+}
+
+std::vector<backend> backends() {
+    std::vector<backend> b;
+    b.push_back({"raw", [](const std::string& path) {
+        auto f = file::open<file::raw>(path, file::mode::read);
+        std::vector<char> buf(1024 * 1024);
+        result r;
+        size_t n;
+        while ((n = f.read(buf.data(), buf.size())) > 0) {
+            r.bytes += n;
+            r.lines += count_lines({buf.data(), n});
+        }
+        return r;
+    }});
+    b.push_back({"file", [](const std::string& path) {
+        auto f = file::open(path);
+        result r;
+        for (std::string_view line : f.lines_view()) {
+            r.bytes += line.size() + 1;
+            r.lines++;
+        }
+        return r;
+    }});
+    b.push_back({"file_1mib", [](const std::string& path) {
+        file::options opts;
+        opts.buffer_size = 1024 * 1024;
+        opts.access = file::advice::sequential;
+        auto f = file::open(path, file::mode::read, opts);
+        result r;
+        for (std::string_view line : f.lines_view()) {
+            r.bytes += line.size() + 1;
+            r.lines++;
+        }
+        return r;
+    }});
+    b.push_back({"mapped", [](const std::string& path) {
+        file::options opts;
+        opts.access = file::advice::sequential;
+        auto m = file::open<file::mapped>(path, file::mode::read, opts);
+        return result{static_cast<uint64_t>(m.size()), count_lines(m.view())};
+    }});
+    b.push_back({"direct", [](const std::string& path) {
+        file::options opts;
+        opts.direct = true;
+        opts.buffer_size = 1024 * 1024;
+        auto f = file::open(path, file::mode::read, opts);
+        result r;
+        for (std::string_view line : f.lines_view()) {
+            r.bytes += line.size() + 1;
+            r.lines++;
+        }
+        return r;
+    }});
+    b.push_back({"parallel", [](const std::string& path) {
+        auto f = file::open(path);
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> lines{0};
+        f.parallel_lines(0, [&](std::string_view line) {
+            bytes.fetch_add(line.size() + 1, std::memory_order_relaxed);
+            lines.fetch_add(1, std::memory_order_relaxed);
+        });
+        return result{bytes.load(), lines.load()};
+    }});
+    return b;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    uint64_t size_mb = 1024;
+    std::string dir = ".";
+    std::string format = "json";
+    bool keep = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--size-mb" && i + 1 < argc) {
+            size_mb = std::stoull(argv[++i]);
+        } else if (arg == "--dir" && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (arg == "--format" && i + 1 < argc) {
+            format = argv[++i];
+        } else if (arg == "--keep") {
+            keep = true;
+        } else {
+            std::cerr << "usage: bench [--size-mb N] [--dir PATH] [--format json|csv] [--keep]\n";
+            return 2;
+        }
+    }
+
+    std::vector<dataset> datasets = {
+        {"short", [](std::mt19937_64& rng) { return static_cast<size_t>(rng() % 16 + 1); }, ""},
+        {"medium", [](std::mt19937_64& rng) {
+            return static_cast<size_t>(std::exponential_distribution<>(1.0 / 80)(rng));
+        }, ""},
+        {"long", [](std::mt19937_64& rng) { return static_cast<size_t>(rng() % 7168 + 1024); }, ""},
+    };
+
+    if (format == "csv") {
+        std::cout << "dataset,backend,cache,bytes,lines,seconds,mb_per_s,lines_per_s,syscalls_per_mb,peak_rss_kb\n";
+    }
+    for (auto& d : datasets) {
+        d.path = dir + "/bench_" + d.name + ".txt";
+        generate(d, size_mb * 1024 * 1024);
+        file::open<file::raw>(d.path, file::mode::append).sync();
+
+        for (const auto& b : backends()) {
+            for (bool cold : {true, false}) {
+                if (cold) {
+                    drop_cache(d.path);
+                } else {
+                    warm_cache(d.path);
+                }
+                reset_peak_rss();
+                int64_t syscalls = io_counter("syscr:");
+                auto start = std::chrono::steady_clock::now();
+                result r;
+                try {
+                    r = b.run(d.path);
+                } catch (const std::exception& e) {
+                    // e.g. direct I/O on a filesystem without it
+                    std::cerr << b.name << " on " << d.name << " skipped: " << e.what() << "\n";
+                    break;
+                }
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (syscalls >= 0) {
+                    syscalls = io_counter("syscr:") - syscalls;
+                }
+
+                double mb = static_cast<double>(r.bytes) / (1024 * 1024);
+                double mb_per_s = mb / seconds;
+                double lines_per_s = static_cast<double>(r.lines) / seconds;
+                double syscalls_per_mb = (syscalls >= 0 && mb > 0) ? static_cast<double>(syscalls) / mb : -1;
+                int64_t rss = peak_rss_kb();
+                const char* cache = cold ? "cold" : "warm";
+                if (format == "csv") {
+                    std::cout << d.name << "," << b.name << "," << cache << "," << r.bytes << "," << r.lines
+                              << "," << seconds << "," << mb_per_s << "," << lines_per_s << ","
+                              << syscalls_per_mb << "," << rss << "\n";
+                } else {
+                    std::cout << "{\"dataset\":\"" << d.name << "\",\"backend\":\"" << b.name
+                              << "\",\"cache\":\"" << cache << "\",\"bytes\":" << r.bytes
+                              << ",\"lines\":" << r.lines << ",\"seconds\":" << seconds
+                              << ",\"mb_per_s\":" << mb_per_s << ",\"lines_per_s\":" << lines_per_s
+                              << ",\"syscalls_per_mb\":" << syscalls_per_mb
+                              << ",\"peak_rss_kb\":" << rss << "}\n";
+                }
+                std::cout.flush();
+            }
+        }
+        if (!keep) {
+            ::remove(d.path.c_str());
+        }
+    }
+    return 0;
+}
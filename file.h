@@ -5,8 +5,11 @@
 #ifdef _WIN32
 #include <windows.h> // For FlushFileBuffers
 #include <io.h>
+#include <process.h> // For _getpid
 #else
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #endif
 
 #include <fcntl.h>
@@ -14,11 +17,91 @@
 #include <sys/stat.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
+// Vectorized byte search kernels are picked at compile time. Define FILE_NO_SIMD to fall back to memchr.
+#if !defined(FILE_NO_SIMD)
+#if defined(__AVX2__)
+#define FILE_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FILE_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define FILE_NEON 1
+#include <arm_neon.h>
+#endif
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h> // For _BitScanForward
+#endif
+
+// Decompression for options.decompress. Define FILE_ZLIB, FILE_ZSTD or FILE_LZ4 and link the library 
+// to read that format.
+#ifdef FILE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef FILE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef FILE_LZ4
+#include <lz4frame.h>
+#endif
+
+// In kernel copies for raw::transfer_to and copy
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h> // For FICLONE
+#endif
+
+// Change notifications for file::follower
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#include <poll.h>
+#include <sys/event.h>
+#define FILE_KQUEUE 1
+#elif !defined(_WIN32)
+#include <poll.h>
+#endif
+
+// io_uring is used by file::async where the kernel headers have it. Define FILE_NO_IO_URING to always 
+// use the thread pool.
+#if defined(__linux__) && !defined(FILE_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#define FILE_IO_URING 1
+#endif
+#endif
+#endif
+
+#include <algorithm>
 #include <string>
 #include <string_view>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <exception>
+#include <functional>
+#include <future>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 //#include <iostream>
@@ -27,9 +110,34 @@
 namespace file {
 class raw;
 class file;
+class mapped;
 class lines_iterator;
+class lines_view_iterator;
+class reverse_lines_iterator;
+class records_iterator;
+class records_until_iterator;
+class records_fixed_iterator;
+class mapped_lines_iterator;
+class async;
+class async_writer;
+class shared_appender;
+class follower;
+class line_index;
+class group_sync;
 struct eof_sentinel {};
 
+// A caller owned buffer for scatter reads
+struct mutable_buffer {
+    void* data;
+    size_t size;
+};
+
+// A range of bytes in a file
+struct extent {
+    int64_t offset;
+    int64_t length;
+};
+
 enum class mode {
     read,
     write,
@@ -40,19 +148,669 @@ enum class seek_mode {
     set,
     cur,
     end,
+    // The first offset at or after offset holding data, or the size if there's none (SEEK_DATA).
+    // Without SEEK_DATA the whole file is data.
+    data,
+    // The first offset at or after offset starting a hole, counting the end of the file as one (SEEK_HOLE)
+    hole,
+};
+
+enum class advice {
+    normal, // No particular access pattern
+    sequential, // Bytes will be read in order, read ahead aggressively
+    random, // Bytes will be read in no particular order, don't read ahead
+    willneed, // Bytes will be needed soon, start reading them into the page cache
+    dontneed, // Bytes won't be needed again, drop them from the page cache
+};
+
+enum class backpressure {
+    block, // Wait for a buffer to be written out
+    drop, // Drop the write and count it as dropped
+};
+
+enum class quoting {
+    none, // Delimiters and newlines always end fields
+    double_quotes, // Fields may be wrapped in double quotes holding delimiters, newlines and "" escapes
+};
+
+enum class compression {
+    none,
+    detect, // Pick gzip, zstd or lz4 from the first bytes of the file, or none
+    gzip, // gzip or zlib, needs FILE_ZLIB
+    zstd, // needs FILE_ZSTD
+    lz4, // lz4 frames, needs FILE_LZ4
+};
+
+enum class byte_order {
+    native, // The byte order of this machine, no conversion
+    little,
+    big,
+};
+
+enum class line_order {
+    unordered, // Lines are handed to the callback from many threads at once
+    ordered, // Lines are handed to the callback one at a time, in file order
+};
+
+class buffer_pool;
+
+/*
+ * Options used when opening a file. Options that don't apply to the opened type are ignored.
+ */
+struct options {
+    // Size in bytes of the internal buffer of file. 0 uses the filesystem block size.
+    size_t buffer_size = 0;
+    // A caller owned buffer of buffer_size bytes used by file instead of allocating one.
+    // It must outlive the file.
+    char* buffer = nullptr;
+    // A pool file takes its internal buffer from and gives it back to when destroyed, instead of 
+    // allocating and freeing one. It must outlive the file.
+    buffer_pool* pool = nullptr;
+    // Double the internal buffer of file, up to max_buffer_size, each time a full buffer is used 
+    // up by sequential reads or writes. Has no effect on a caller owned buffer.
+    bool adaptive_buffer = false;
+    size_t max_buffer_size = 4 * 1024 * 1024;
+    // How the file will be accessed. Only normal, sequential or random make sense here.
+    advice access = advice::normal;
+    // Start reading the whole file into the page cache when opened
+    bool willneed = false;
+    // Drop bytes read by file from the page cache as it goes so one pass reads don't evict hot data
+    bool dontneed_after_read = false;
+    // Bypass the OS page cache: O_DIRECT on Linux, F_NOCACHE on macOS and FILE_FLAG_NO_BUFFERING on 
+    // Windows, where it only applies to mode::read. Ignored for mode::append. Reads and writes on a 
+    // direct raw must use buffers, sizes and offsets aligned to block_size(). file takes care of that
+    // itself with an aligned buffer. async_writer doesn't support it.
+    bool direct = false;
+    // The size a file opened for writing is expected to grow to. Disk space for it is reserved up 
+    // front with raw::preallocate so growing the file doesn't fragment it. 0 reserves nothing.
+    int64_t expected_size = 0;
+    // In mode::write write to a new file next to path that replaces it when closed: its data is 
+    // synced, it's renamed over path and the directory is synced. Readers see the old or the new 
+    // contents and never a mix, even after a crash. The new file keeps the permissions of the one it
+    // replaces. If the file is destroyed by an exception unwinding the stack, or the replacement 
+    // fails, path is left as it was.
+    bool atomic_replace = false;
+    // Decompress the file as file reads it. Only applies to file in mode::read. Compressed files can
+    // only seek within the buffer, can't read_at or parallel_lines, and size() is the compressed size.
+    compression decompress = compression::none;
+    // Decompress on a background thread so decoding overlaps reading
+    bool decompress_ahead = true;
+    // Number of buffer_size buffers async_writer cycles through, at least 2. Bounds its memory.
+    size_t write_buffers = 2;
+    // What async_writer does with a write when all of its buffers are waiting to be written out
+    backpressure on_full = backpressure::block;
 };
 
 template <class T = file>
-T open(const std::string& path, mode mode = mode::read) {
-    return T(path, mode);
+T open(const std::string& path, mode mode = mode::read, const options& opts = {}) {
+    return T(path, mode, opts);
+}
+
+// Copies the file at src to dst, replacing dst. Shares the blocks with a reflink where the 
+// filesystem can, otherwise copies in the kernel where the OS can. Returns the number of bytes copied.
+// Throws if src and dst are the same file.
+inline int64_t copy(const std::string& src, const std::string& dst);
+
+// Durably replaces the contents of the file at path with contents, as options::atomic_replace does
+inline void replace(const std::string& path, std::string_view contents, const options& opts = {});
+
+/*
+ * The contents of many files read at once by read_all
+ */
+struct batch {
+    // The contents of every file that was read, back to back in path order. Moving a batch keeps 
+    // views into it valid.
+    std::vector<char> data;
+    // contents[i] is a view into data of the contents of paths[i], empty if it couldn't be read
+    std::vector<std::string_view> contents;
+    // errors[i] is why paths[i] couldn't be read, empty if it was
+    std::vector<std::string> errors;
+
+    // Returns true if the file at index i was read
+    bool ok(size_t i) const { return errors[i].empty(); }
+};
+
+// Reads every file in paths on nthreads threads with an open, fstat, usually a single read and a 
+// close each. A file that can't be read gets an error instead of throwing. opts are passed to 
+// each raw, except direct. nthreads of 0 uses the hardware concurrency.
+inline batch read_all(const std::vector<std::string>& paths, size_t nthreads = 0, const options& opts = {});
+
+/*
+ * I/O counters of a raw, a file or the whole process. Only counted when FILE_STATS is defined, 
+ * otherwise they're always 0 and counting costs nothing.
+ */
+struct io_stats {
+    uint64_t read_calls = 0; // read, readv and pread system calls
+    uint64_t write_calls = 0; // write, writev and pwrite system calls
+    uint64_t seek_calls = 0;
+    uint64_t sync_calls = 0;
+    uint64_t bytes_read = 0;
+    uint64_t bytes_written = 0;
+    uint64_t read_ns = 0; // time spent in read system calls
+    uint64_t write_ns = 0;
+    uint64_t sync_ns = 0;
+    uint64_t refills = 0; // file buffer refills
+    uint64_t bytes_copied = 0; // bytes file copied out of its buffer
+    uint64_t lines = 0; // lines and records file handed out
+};
+
+// Returns the counters summed over every raw and file in the process
+inline io_stats global_stats();
+
+#ifdef FILE_STATS
+#define FILE_STAT(...) __VA_ARGS__
+#else
+#define FILE_STAT(...)
+#endif
+
+#ifdef FILE_STATS
+namespace detail {
+
+enum class stat : size_t {
+    read_calls, write_calls, seek_calls, sync_calls, bytes_read, bytes_written, 
+    read_ns, write_ns, sync_ns, refills, bytes_copied, lines, count
+};
+
+// Counters that can be bumped from many threads, like raw::read_at callers, and copied with their owner
+struct stat_counters {
+    std::atomic<uint64_t> values[static_cast<size_t>(stat::count)];
+
+    stat_counters() {
+        for (auto& v : values) {
+            v.store(0, std::memory_order_relaxed);
+        }
+    }
+    stat_counters(const stat_counters& other) {
+        *this = other;
+    }
+    stat_counters& operator=(const stat_counters& other) {
+        for (size_t i = 0; i < static_cast<size_t>(stat::count); i++) {
+            values[i].store(other.values[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        return *this;
+    }
+
+    uint64_t get(stat s) const {
+        return values[static_cast<size_t>(s)].load(std::memory_order_relaxed);
+    }
+
+    io_stats snapshot() const {
+        io_stats st;
+        st.read_calls = get(stat::read_calls);
+        st.write_calls = get(stat::write_calls);
+        st.seek_calls = get(stat::seek_calls);
+        st.sync_calls = get(stat::sync_calls);
+        st.bytes_read = get(stat::bytes_read);
+        st.bytes_written = get(stat::bytes_written);
+        st.read_ns = get(stat::read_ns);
+        st.write_ns = get(stat::write_ns);
+        st.sync_ns = get(stat::sync_ns);
+        st.refills = get(stat::refills);
+        st.bytes_copied = get(stat::bytes_copied);
+        st.lines = get(stat::lines);
+        return st;
+    }
+};
+
+inline stat_counters& global_counters() {
+    static stat_counters counters;
+    return counters;
+}
+
+// Adds n to a counter of an object and of the process
+inline void count(stat_counters& c, stat s, uint64_t n = 1) {
+    c.values[static_cast<size_t>(s)].fetch_add(n, std::memory_order_relaxed);
+    global_counters().values[static_cast<size_t>(s)].fetch_add(n, std::memory_order_relaxed);
+}
+
+// Counts the nanoseconds until it goes out of scope
+class stat_timer {
+public:
+    stat_timer(stat_counters& c, stat s) : c_(c), s_(s), start_(std::chrono::steady_clock::now()) {}
+    ~stat_timer() {
+        auto elapsed = std::chrono::steady_clock::now() - start_;
+        count(c_, s_, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+    }
+
+private:
+    stat_counters& c_;
+    stat s_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace detail
+#endif
+
+inline io_stats global_stats() {
+#ifdef FILE_STATS
+    return detail::global_counters().snapshot();
+#else
+    return {};
+#endif
+}
+
+namespace detail {
+
+inline unsigned count_trailing_zeros(uint64_t x) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return static_cast<unsigned>(i);
+#else
+    return static_cast<unsigned>(__builtin_ctzll(x));
+#endif
+}
+
+// Returns a pointer to the first occurrence of c in [begin, end), or end if c is not found
+inline const char* find_byte(const char* begin, const char* end, char c) {
+    const char* p = begin;
+#if defined(FILE_AVX2)
+    const __m256i needle = _mm256_set1_epi8(c);
+    for (; end - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle)));
+        if (mask) {
+            return p + count_trailing_zeros(mask);
+        }
+    }
+#elif defined(FILE_SSE2)
+    const __m128i needle = _mm_set1_epi8(c);
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)));
+        if (mask) {
+            return p + count_trailing_zeros(mask);
+        }
+    }
+#elif defined(FILE_NEON)
+    const uint8x16_t needle = vdupq_n_u8(static_cast<uint8_t>(c));
+    for (; end - p >= 16; p += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(p)), needle);
+        // Narrow each byte of the comparison to 4 bits so the result fits in a 64 bit mask
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        if (mask) {
+            return p + (count_trailing_zeros(mask) >> 2);
+        }
+    }
+#endif
+    if (p == end) {
+        return end;
+    }
+    const void* ret = memchr(p, c, static_cast<size_t>(end - p));
+    return ret ? static_cast<const char*>(ret) : end;
+}
+
+// Returns the index of the highest set bit of x, which must not be 0
+inline unsigned highest_set_bit(uint64_t x) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanReverse64(&i, x);
+    return static_cast<unsigned>(i);
+#else
+    return 63 - static_cast<unsigned>(__builtin_clzll(x));
+#endif
+}
+
+// Returns a pointer to the last occurrence of c in [begin, end), or end if c is not found
+inline const char* find_last_byte(const char* begin, const char* end, char c) {
+    const char* p = end;
+#if defined(FILE_AVX2)
+    const __m256i needle = _mm256_set1_epi8(c);
+    for (; p - begin >= 32; p -= 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p - 32));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle)));
+        if (mask) {
+            return p - 32 + highest_set_bit(mask);
+        }
+    }
+#elif defined(FILE_SSE2)
+    const __m128i needle = _mm_set1_epi8(c);
+    for (; p - begin >= 16; p -= 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p - 16));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)));
+        if (mask) {
+            return p - 16 + highest_set_bit(mask);
+        }
+    }
+#elif defined(FILE_NEON)
+    const uint8x16_t needle = vdupq_n_u8(static_cast<uint8_t>(c));
+    for (; p - begin >= 16; p -= 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(p - 16)), needle);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        if (mask) {
+            return p - 16 + (highest_set_bit(mask) >> 2);
+        }
+    }
+#elif defined(__GLIBC__)
+    const void* ret = (p == begin) ? nullptr : memrchr(begin, c, static_cast<size_t>(p - begin));
+    return ret ? static_cast<const char*>(ret) : end;
+#endif
+    while (p != begin) {
+        if (*--p == c) {
+            return p;
+        }
+    }
+    return end;
+}
+
+// Returns a pointer to the first occurrence of needle in [begin, end), or end if it is not found
+inline const char* find_bytes(const char* begin, const char* end, std::string_view needle) {
+    if (needle.size() == 1) {
+        return find_byte(begin, end, needle[0]);
+    }
+    if (needle.empty() || static_cast<size_t>(end - begin) < needle.size()) {
+        return needle.empty() ? begin : end;
+    }
+    const char* last = end - needle.size() + 1;
+    for (const char* p = begin;; p++) {
+        p = find_byte(p, last, needle[0]);
+        if (p == last) {
+            return end;
+        }
+        if (memcmp(p + 1, needle.data() + 1, needle.size() - 1) == 0) {
+            return p;
+        }
+    }
+}
+
+// Returns a pointer to the first occurrence of a or b in [begin, end), or end if neither is found
+inline const char* find_either_byte(const char* begin, const char* end, char a, char b) {
+    const char* p = begin;
+#if defined(FILE_AVX2)
+    const __m256i needle_a = _mm256_set1_epi8(a);
+    const __m256i needle_b = _mm256_set1_epi8(b);
+    for (; end - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, needle_a), _mm256_cmpeq_epi8(chunk, needle_b));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(eq));
+        if (mask) {
+            return p + count_trailing_zeros(mask);
+        }
+    }
+#elif defined(FILE_SSE2)
+    const __m128i needle_a = _mm_set1_epi8(a);
+    const __m128i needle_b = _mm_set1_epi8(b);
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(chunk, needle_a), _mm_cmpeq_epi8(chunk, needle_b));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(eq));
+        if (mask) {
+            return p + count_trailing_zeros(mask);
+        }
+    }
+#elif defined(FILE_NEON)
+    const uint8x16_t needle_a = vdupq_n_u8(static_cast<uint8_t>(a));
+    const uint8x16_t needle_b = vdupq_n_u8(static_cast<uint8_t>(b));
+    for (; end - p >= 16; p += 16) {
+        uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+        uint8x16_t eq = vorrq_u8(vceqq_u8(chunk, needle_a), vceqq_u8(chunk, needle_b));
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        if (mask) {
+            return p + (count_trailing_zeros(mask) >> 2);
+        }
+    }
+#endif
+    for (; p != end; p++) {
+        if (*p == a || *p == b) {
+            return p;
+        }
+    }
+    return end;
+}
+
+// Returns a pointer to the newline ('\n') ending the record that continues in [begin, end), or end
+// if it doesn't end there. in_quotes carries whether a quoted field is open across calls.
+inline const char* find_record_end(const char* begin, const char* end, quoting q, bool& in_quotes) {
+    if (q == quoting::none) {
+        return find_byte(begin, end, '\n');
+    }
+    for (const char* p = begin;; p++) {
+        p = in_quotes ? find_byte(p, end, '"') : find_either_byte(p, end, '"', '\n');
+        if (p == end || *p == '\n') {
+            return p;
+        }
+        // An escaped "" toggles twice
+        in_quotes = !in_quotes;
+    }
+}
+
+// Splits the record [begin, end), which doesn't include its newline or a '\r' before it, into 
+// fields. Quoted fields are unescaped in place so every field is a view into [begin, end).
+inline void split_record(char* begin, char* end, char delim, quoting q, std::vector<std::string_view>& fields) {
+    fields.clear();
+    char* p = begin;
+    while (true) {
+        char* next;
+        if (q == quoting::double_quotes && p != end && *p == '"') {
+            // Shift the unescaped text left over the quotes
+            char* out = p;
+            char* r = p + 1;
+            while (true) {
+                char* quote = const_cast<char*>(find_byte(r, end, '"'));
+                memmove(out, r, quote - r);
+                out += quote - r;
+                if (quote == end) {
+                    r = end;
+                    break;
+                }
+                if (quote + 1 != end && quote[1] == '"') {
+                    *out++ = '"';
+                    r = quote + 2;
+                    continue;
+                }
+                r = quote + 1;
+                break;
+            }
+            // Keep anything between the closing quote and the delimiter
+            next = const_cast<char*>(find_byte(r, end, delim));
+            memmove(out, r, next - r);
+            out += next - r;
+            fields.emplace_back(p, out - p);
+        } else {
+            next = const_cast<char*>(find_byte(p, end, delim));
+            fields.emplace_back(p, next - p);
+        }
+        if (next == end) {
+            return;
+        }
+        p = next + 1;
+    }
+}
+
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+constexpr bool native_little_endian = true;
+#else
+constexpr bool native_little_endian = false;
+#endif
+
+// Returns true if values stored in order need their bytes reversed on this machine
+inline bool needs_swap(byte_order order) {
+    return order != byte_order::native && (order == byte_order::little) != native_little_endian;
+}
+
+inline uint16_t byte_swap(uint16_t x) {
+#ifdef _MSC_VER
+    return _byteswap_ushort(x);
+#else
+    return __builtin_bswap16(x);
+#endif
+}
+
+inline uint32_t byte_swap(uint32_t x) {
+#ifdef _MSC_VER
+    return _byteswap_ulong(x);
+#else
+    return __builtin_bswap32(x);
+#endif
+}
+
+inline uint64_t byte_swap(uint64_t x) {
+#ifdef _MSC_VER
+    return _byteswap_uint64(x);
+#else
+    return __builtin_bswap64(x);
+#endif
+}
+
+template <class U>
+inline void byte_swap_scalar(char* dst, const char* src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        U x;
+        memcpy(&x, src + i * sizeof(U), sizeof(U));
+        x = byte_swap(x);
+        memcpy(dst + i * sizeof(U), &x, sizeof(U));
+    }
+}
+
+// Copies count values of size bytes, 1, 2, 4 or 8, from src to dst reversing the bytes of each.
+// dst may be src.
+inline void byte_swap(char* dst, const char* src, size_t count, size_t size) {
+    if (size == 1) {
+        if (dst != src) {
+            memmove(dst, src, count);
+        }
+        return;
+    }
+    size_t done = 0;
+#if defined(FILE_AVX2)
+    // Reverse each value's bytes within 128 bit lanes with one shuffle per 32 bytes
+    alignas(32) char mask[32];
+    for (size_t i = 0; i < 32; i++) {
+        mask[i] = static_cast<char>(((i / size) * size + (size - 1 - i % size)) & 15);
+    }
+    const __m256i shuffle = _mm256_load_si256(reinterpret_cast<const __m256i*>(mask));
+    size_t per_chunk = 32 / size;
+    for (; count - done >= per_chunk; done += per_chunk) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + done * size));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + done * size), _mm256_shuffle_epi8(chunk, shuffle));
+    }
+#elif defined(FILE_NEON)
+    size_t per_chunk = 16 / size;
+    for (; count - done >= per_chunk; done += per_chunk) {
+        uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(src + done * size));
+        chunk = (size == 2) ? vrev16q_u8(chunk) : (size == 4) ? vrev32q_u8(chunk) : vrev64q_u8(chunk);
+        vst1q_u8(reinterpret_cast<uint8_t*>(dst + done * size), chunk);
+    }
+#endif
+    // Compilers vectorize these loops themselves where they can
+    src += done * size;
+    dst += done * size;
+    switch (size) {
+    case 2: byte_swap_scalar<uint16_t>(dst, src, count - done); break;
+    case 4: byte_swap_scalar<uint32_t>(dst, src, count - done); break;
+    case 8: byte_swap_scalar<uint64_t>(dst, src, count - done); break;
+    default: throw std::runtime_error("Can only swap the bytes of 1, 2, 4 or 8 byte values");
+    }
+}
+
+// Throws if values of T can't have their byte order converted
+template <class T>
+void check_byte_order(byte_order order) {
+    if (!std::is_arithmetic<T>::value && !std::is_enum<T>::value && needs_swap(order)) {
+        throw std::runtime_error("Can only convert the byte order of arithmetic and enum types");
+    }
+}
+
+// Values file::write(const T&) accepts. Excludes strings and pointers, which have their own overloads.
+template <class T>
+using enable_if_value = std::enable_if_t<std::is_trivially_copyable<T>::value && 
+    !std::is_array<T>::value && !std::is_pointer<T>::value && !std::is_same<T, std::string_view>::value>;
+
+// Resizes c to n elements. Where the standard library allows it new elements are left
+// uninitialized since they're about to be overwritten.
+inline void resize_uninitialized(std::string& c, size_t n) {
+#if defined(__cpp_lib_string_resize_and_overwrite)
+    c.resize_and_overwrite(n, [](char*, size_t size) { return size; });
+#else
+    c.resize(n);
+#endif
+}
+
+inline void resize_uninitialized(std::vector<uint8_t>& c, size_t n) {
+    c.resize(n);
+}
+
+// Allocates size bytes aligned to align, a power of two. Returns nullptr on failure.
+inline void* alloc_aligned(size_t size, size_t align) {
+#ifdef _WIN32
+    return _aligned_malloc(size, align);
+#else
+    void* p = nullptr;
+    return (::posix_memalign(&p, align, size) == 0) ? p : nullptr;
+#endif
+}
+
+inline void free_aligned(void* p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+// Calls fn with each line in data. Lines don't include their trailing newline ('\n') or a '\r' 
+// before it. A final line without a trailing newline is included if it isn't empty.
+template <class Fn>
+void for_each_line(std::string_view data, Fn& fn) {
+    const char* p = data.data();
+    const char* end = p + data.size();
+    while (p != end) {
+        const char* nl = find_byte(p, end, '\n');
+        size_t len = nl - p;
+        if (nl != end && len > 0 && p[len - 1] == '\r') {
+            len--;
+        }
+        fn(std::string_view(p, len));
+        p = (nl == end) ? end : nl + 1;
+    }
 }
 
+} // namespace detail
+
+/*
+ * Recycles the internal buffers of files that are opened and closed often, so each open doesn't
+ * allocate. Safe to share between threads.
+ */
+class buffer_pool {
+public:
+    // Keeps up to max_buffers free buffers, freeing any given back beyond that
+    explicit buffer_pool(size_t max_buffers = 64);
+    buffer_pool(const buffer_pool& other) = delete;
+    buffer_pool& operator=(const buffer_pool& other) = delete;
+    ~buffer_pool();
+
+    // Returns a buffer of size bytes aligned to at least align, a power of two, reusing a free one
+    // if there is one. Returns nullptr on failure.
+    char* acquire(size_t size, size_t align);
+    // Gives back a buffer returned by acquire with the same size and align
+    void release(char* buffer, size_t size, size_t align);
+    // Frees all free buffers
+    void clear();
+    // Returns the number of free buffers
+    size_t free_buffers() const;
+
+    // A pool for the calling thread, destroyed when the thread exits. Files using it must be 
+    // destroyed on the same thread.
+    static buffer_pool& local();
+
+private:
+    struct entry {
+        char* data;
+        size_t size;
+        size_t align;
+    };
+
+    size_t max_buffers_;
+    mutable std::mutex m_;
+    std::vector<entry> free_;
+};
+
 /*
  * An unbuffered file. All reads and writes are sent directly to the OS via system calls.
  */
 class raw {
 public:
-    raw(const std::string& path, mode mode);
+    raw(const std::string& path, mode mode, const options& opts = {});
     raw(const raw& other) = delete;
     raw& operator=(const raw& other) = delete;
     raw(raw&& other);
@@ -71,9 +829,36 @@ public:
     // Writes count bytes to the file from buffer
     // Returns the number of bytes written
     size_t write(const void* buffer, size_t count) const;
+    // Writes count fragments to the file in order with one system call (writev)
+    // Returns the number of bytes written, which like write may be less than the total
+    size_t writev(const std::string_view* fragments, size_t count) const;
+    size_t writev(std::initializer_list<std::string_view> fragments) const;
+    // Fills count buffers in order with one system call (readv)
+    // Returns the number of bytes read, which like read may be less than the total
+    size_t readv(const mutable_buffer* buffers, size_t count) const;
+    size_t readv(std::initializer_list<mutable_buffer> buffers) const;
+    // Reads count bytes starting at byte offset into buffer without using or moving the shared file 
+    // offset, so it can be called from many threads at once. Windows moves the offset and puts it 
+    // back, so there these calls take turns. Returns the number of bytes read.
+    size_t read_at(int64_t offset, void* buffer, size_t count) const;
+    // Writes count bytes from buffer starting at byte offset without using or moving the shared 
+    // file offset, so it can be called from many threads at once. Takes turns on Windows like 
+    // read_at. Not supported in append mode. Returns the number of bytes written.
+    size_t write_at(int64_t offset, const void* buffer, size_t count) const;
+    // Copies count bytes starting at byte offset of this file to the current position of dst, 
+    // without moving this file's offset. Copies in the kernel with copy_file_range or sendfile 
+    // where the OS has them, otherwise through a user space buffer.
+    // Returns the number of bytes copied, which is less than count only at the end of the file.
+    size_t transfer_to(const raw& dst, int64_t offset, size_t count) const;
+    // Like transfer_to(raw&) but to any writable file descriptor, such as a socket or pipe
+    size_t transfer_to(int fd, int64_t offset, size_t count) const;
 
-    // Closes the file.
+    // Closes the file. With options::atomic_replace this replaces the path it was opened with, 
+    // throwing if that fails.
     void close();
+    // Closes the file. With options::atomic_replace this removes the temporary file and leaves the 
+    // path it was opened with as it was.
+    void discard();
     // Returns true if the file is closed
     bool closed() const;
 
@@ -83,82 +868,560 @@ public:
     int64_t tell() const;
     // If in write or append mode tell the OS to sync its caches to the underlying storage device 
     void sync() const;
+    // Like sync but only syncs the data and the metadata needed to read it back, like the size, with
+    // fdatasync where there is one. Uses F_FULLFSYNC on macOS where fsync stops at the drive's cache.
+    void sync_data() const;
+    // Tells the OS how bytes [offset, offset + len) will be accessed. A len of 0 extends to the end 
+    // of the file. Does nothing where the OS has no equivalent.
+    void advise(advice advice, int64_t offset = 0, int64_t len = 0) const;
 
-    // Returns the size of the opened file
+    // Returns the size of the opened file. The file is only stat'ed the first time this or 
+    // block_size() is called.
     int64_t size() const;
     // Returns the filesystem block size of the opened file
     int64_t block_size() const;
+    // Reserves disk space for the file to grow to size bytes without changing its size, with 
+    // fallocate, F_PREALLOCATE or the allocation size on Windows. Returns false if the OS or 
+    // filesystem can't.
+    bool preallocate(int64_t size) const;
+    // Sets the size of the file, cutting it short or extending it with a hole
+    void resize(int64_t size);
+    // Deallocates bytes [offset, offset + len) so they read back as zeros without taking up disk 
+    // space, keeping the size. Writes zeros over them where the filesystem can't.
+    void punch_hole(int64_t offset, int64_t len) const;
+    // Returns the ranges of the file holding data in order, skipping holes, found with 
+    // seek_mode::data and seek_mode::hole. Doesn't change the current position.
+    std::vector<extent> data_extents() const;
+    // Returns the underlying OS file descriptor, or -1 if closed
+    int fd() const;
+    // Returns true if the file was opened for direct I/O
+    bool direct() const;
+    // Turns direct I/O on or off for the open file, e.g. to write an unaligned tail. 
+    // Throws where the OS can't change it after opening.
+    void set_direct(bool direct);
+    // Returns the I/O counters of this file, all 0 unless FILE_STATS is defined
+    io_stats stats() const;
 
 private:
-    void run_stat();
+    void run_stat() const;
+    // Returns the size of the file now rather than when first asked
+    int64_t current_size() const;
+    void close_fd();
 
     int fd_;
     enum mode mode_;
-    int64_t size_;
-    int64_t block_size_;
+    bool direct_ = false;
+    // Set when opened with options::atomic_replace
+    std::string replace_path_;
+    std::string temp_path_;
+    int uncaught_ = 0; // exceptions in flight when opened
+    // Filled in by run_stat when first needed, -1 until then
+    mutable int64_t size_ = -1;
+    mutable int64_t block_size_ = -1;
+    FILE_STAT(mutable detail::stat_counters stats_;)
 };
 
-/*
- * A buffered file. All reads and writes are buffered and flushed automatically when the buffer 
- * if full or the file is closed.
- */
-class file {
-public:
-    file(const std::string& path, mode mode);
-    file(const raw& other) = delete;
-    file& operator=(const file& other) = delete;
-    file(file&& other);
-    file& operator=(file&& other);
-    ~file();
-    
-    // Returns true if the file is open and in read mode
-    bool can_read() const;
-    // Returns true if the file is open and in write or append mode
-    bool can_write() const;
-    // Returns the mode of the file
-    enum mode mode() const;
+inline void throw_errno_exception(int err);
 
-    // Reads count bytes into buffer. Returns the number of bytes read
-    size_t read(void* buffer, size_t count);
-    // Reads count bytes and returns then as a std::string. 
-    // If count is less than 0 reads all remaining bytes in file.
-    std::string read(int64_t count = -1);
-    // Reads count bytes and returns them as a std::vector.
-    // If count is less than 0 reads all remaining bytes in file.
-    std::vector<uint8_t> read_bytes(int64_t count = -1);
-    // Reads bytes until a newline ('\n') is read or end of file is reached.
-    // line is filled in with all read bytes *except* the trailing newline, if any.
-    // Returns true if any bytes were read.
-    bool read_line(std::string& line);
-    // Reads bytes until the provided vec is at capacity or end of file is reached.
-    // Returns the number of bytes read.
-    size_t read_into_capacity(std::vector<uint8_t>& vec);
+namespace detail {
 
-    // Writes count bytes to the file from buffer
-    // Returns the number of bytes written
-    size_t write(const void* buffer, size_t count);
-    // Writes the provided string_view sv to the file
-    // Returns the number of bytes written
-    size_t write(std::string_view sv);
-    // Flushes the internal buffer to the underlying file
-    void flush();
+#ifdef _WIN32
+// Held by raw::read_at and raw::write_at while they restore the file pointer, so concurrent calls 
+// don't put back each other's moved pointers
+inline std::mutex& positional_mutex() {
+    static std::mutex m;
+    return m;
+}
 
-    // Flushes the internal buffer to the underlying file, if applicable. and closes the file.
+// Returns the file pointer of h, for putting it back with SetFilePointerEx
+inline LARGE_INTEGER file_pointer(HANDLE h) {
+    LARGE_INTEGER zero = {};
+    LARGE_INTEGER pos = {};
+    if (!SetFilePointerEx(h, zero, &pos, FILE_CURRENT)) {
+        throw std::runtime_error("Couldn't get the file position");
+    }
+    return pos;
+}
+#endif
+
+// Reads up to count bytes from fd. Returns the number of bytes read, 0 at end of file.
+inline size_t read_fd(int fd, void* buffer, size_t count) {
+#ifdef _WIN32
+    int bytes_read = ::_read(fd, buffer, static_cast<unsigned int>((std::min)(count, static_cast<size_t>(0x7FFFFFFF))));
+#else
+    ssize_t bytes_read = ::read(fd, buffer, count);
+#endif
+    if (bytes_read < 0) {
+        throw_errno_exception(errno);
+    }
+    return static_cast<size_t>(bytes_read);
+}
+
+// Decompresses the rest of a file a chunk at a time. Reads the file descriptor rather than a raw so 
+// the file owning both can be moved.
+class decoder {
+public:
+    virtual ~decoder() = default;
+    // Decompresses up to count bytes into out. Returns fewer only at the end of the data, 0 after it.
+    virtual size_t decode(char* out, size_t count) = 0;
+};
+
+constexpr size_t decoder_input_size = 128 * 1024;
+
+#ifdef FILE_ZLIB
+class gzip_decoder : public decoder {
+public:
+    explicit gzip_decoder(int fd) : fd_(fd), in_(decoder_input_size) {
+        // 32 detects gzip or zlib headers
+        if (inflateInit2(&zs_, 15 + 32) != Z_OK) {
+            throw std::runtime_error("Couldn't start gzip decompression");
+        }
+    }
+    ~gzip_decoder() override {
+        inflateEnd(&zs_);
+    }
+
+    size_t decode(char* out, size_t count) override {
+        zs_.next_out = reinterpret_cast<Bytef*>(out);
+        zs_.avail_out = static_cast<uInt>((std::min)(count, static_cast<size_t>(UINT32_MAX)));
+        size_t want = zs_.avail_out;
+        while (zs_.avail_out > 0) {
+            if (zs_.avail_in == 0) {
+                size_t n = read_fd(fd_, in_.data(), in_.size());
+                if (n == 0) {
+                    if (mid_stream_) {
+                        throw std::runtime_error("Unexpected end of gzip data");
+                    }
+                    break;
+                }
+                zs_.next_in = reinterpret_cast<Bytef*>(in_.data());
+                zs_.avail_in = static_cast<uInt>(n);
+            }
+            if (!mid_stream_ && members_ > 0) {
+                // Zero padding after a member is ignored, like gunzip. No member starts with one.
+                while (zs_.avail_in > 0 && *zs_.next_in == 0) {
+                    zs_.next_in++;
+                    zs_.avail_in--;
+                }
+                if (zs_.avail_in == 0) {
+                    continue;
+                }
+            }
+            mid_stream_ = true;
+            int ret = inflate(&zs_, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                // Concatenated members read as one stream, like gunzip
+                inflateReset(&zs_);
+                mid_stream_ = false;
+                members_++;
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                throw std::runtime_error(zs_.msg ? zs_.msg : "Couldn't decompress gzip data");
+            }
+        }
+        return want - zs_.avail_out;
+    }
+
+private:
+    int fd_;
+    std::vector<char> in_;
+    z_stream zs_ = {};
+    bool mid_stream_ = false;
+    size_t members_ = 0;
+};
+#endif
+
+#ifdef FILE_ZSTD
+class zstd_decoder : public decoder {
+public:
+    explicit zstd_decoder(int fd) : fd_(fd), in_(decoder_input_size), ds_(ZSTD_createDStream()) {
+        if (!ds_ || ZSTD_isError(ZSTD_initDStream(ds_))) {
+            ZSTD_freeDStream(ds_);
+            throw std::runtime_error("Couldn't start zstd decompression");
+        }
+    }
+    ~zstd_decoder() override {
+        ZSTD_freeDStream(ds_);
+    }
+
+    size_t decode(char* out, size_t count) override {
+        ZSTD_outBuffer output = {out, count, 0};
+        while (output.pos < output.size) {
+            if (input_.pos == input_.size && !eof_) {
+                size_t n = read_fd(fd_, in_.data(), in_.size());
+                eof_ = (n == 0);
+                input_ = {in_.data(), n, 0};
+            }
+            size_t in_before = input_.pos;
+            size_t out_before = output.pos;
+            size_t ret = ZSTD_decompressStream(ds_, &output, &input_);
+            if (ZSTD_isError(ret)) {
+                throw std::runtime_error(ZSTD_getErrorName(ret));
+            }
+            // Concatenated frames read as one stream. A frame is done when the call that finishes it
+            // returns 0, calls without input after that only return the size of the next header.
+            if (input_.pos != in_before || output.pos != out_before) {
+                mid_frame_ = (ret != 0);
+            } else if (eof_) {
+                if (mid_frame_) {
+                    throw std::runtime_error("Unexpected end of zstd data");
+                }
+                break;
+            }
+        }
+        return output.pos;
+    }
+
+private:
+    int fd_;
+    std::vector<char> in_;
+    ZSTD_DStream* ds_;
+    ZSTD_inBuffer input_ = {nullptr, 0, 0};
+    bool eof_ = false;
+    bool mid_frame_ = false;
+};
+#endif
+
+#ifdef FILE_LZ4
+class lz4_decoder : public decoder {
+public:
+    explicit lz4_decoder(int fd) : fd_(fd), in_(decoder_input_size) {
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx_, LZ4F_VERSION))) {
+            throw std::runtime_error("Couldn't start lz4 decompression");
+        }
+    }
+    ~lz4_decoder() override {
+        LZ4F_freeDecompressionContext(ctx_);
+    }
+
+    size_t decode(char* out, size_t count) override {
+        size_t produced = 0;
+        while (produced < count) {
+            if (in_pos_ == in_size_ && !eof_) {
+                in_size_ = read_fd(fd_, in_.data(), in_.size());
+                in_pos_ = 0;
+                eof_ = (in_size_ == 0);
+            }
+            size_t dst_size = count - produced;
+            size_t src_size = in_size_ - in_pos_;
+            size_t ret = LZ4F_decompress(ctx_, out + produced, &dst_size, in_.data() + in_pos_, &src_size, nullptr);
+            if (LZ4F_isError(ret)) {
+                throw std::runtime_error(LZ4F_getErrorName(ret));
+            }
+            in_pos_ += src_size;
+            produced += dst_size;
+            // Concatenated frames read as one stream. A frame is done when the call that finishes it
+            // returns 0, calls without input after that only return the size of the next header.
+            if (src_size != 0 || dst_size != 0) {
+                mid_frame_ = (ret != 0);
+            } else if (eof_) {
+                if (mid_frame_) {
+                    throw std::runtime_error("Unexpected end of lz4 data");
+                }
+                break;
+            }
+        }
+        return produced;
+    }
+
+private:
+    int fd_;
+    std::vector<char> in_;
+    size_t in_pos_ = 0;
+    size_t in_size_ = 0;
+    LZ4F_dctx* ctx_ = nullptr;
+    bool eof_ = false;
+    bool mid_frame_ = false;
+};
+#endif
+
+// Runs another decoder on a background thread, double buffering its output in chunk_size chunks
+class decode_ahead : public decoder {
+public:
+    decode_ahead(std::unique_ptr<decoder> inner, size_t chunk_size) : 
+    inner_(std::move(inner)), chunk_size_(chunk_size) {
+        for (size_t i = 0; i < 2; i++) {
+            chunks_.emplace_back(chunk_size_);
+            free_.push_back(i);
+        }
+        thread_ = std::thread([this] { run(); });
+    }
+    ~decode_ahead() override {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+
+    size_t decode(char* out, size_t count) override {
+        size_t copied = 0;
+        while (copied < count) {
+            if (cur_i_ == cur_size_) {
+                std::unique_lock<std::mutex> lock(m_);
+                if (has_cur_) {
+                    free_.push_back(cur_);
+                    has_cur_ = false;
+                    cv_.notify_all();
+                }
+                cv_.wait(lock, [&] { return !ready_.empty() || error_ || done_; });
+                if (ready_.empty()) {
+                    if (error_) {
+                        std::rethrow_exception(error_);
+                    }
+                    return copied;
+                }
+                cur_ = ready_.front().first;
+                cur_size_ = ready_.front().second;
+                cur_i_ = 0;
+                has_cur_ = true;
+                ready_.pop_front();
+            }
+            size_t n = (std::min)(count - copied, cur_size_ - cur_i_);
+            memcpy(out + copied, chunks_[cur_].data() + cur_i_, n);
+            cur_i_ += n;
+            copied += n;
+        }
+        return copied;
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(m_);
+        while (true) {
+            cv_.wait(lock, [&] { return stop_ || !free_.empty(); });
+            if (stop_) {
+                return;
+            }
+            size_t idx = free_.front();
+            free_.pop_front();
+            lock.unlock();
+
+            size_t n = 0;
+            std::exception_ptr error;
+            try {
+                while (n < chunk_size_) {
+                    size_t r = inner_->decode(chunks_[idx].data() + n, chunk_size_ - n);
+                    if (r == 0) {
+                        break;
+                    }
+                    n += r;
+                }
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            lock.lock();
+            if (n > 0) {
+                ready_.emplace_back(idx, n);
+            } else {
+                free_.push_back(idx);
+            }
+            error_ = error;
+            done_ = (n < chunk_size_);
+            cv_.notify_all();
+            if (error_ || done_) {
+                return;
+            }
+        }
+    }
+
+    std::unique_ptr<decoder> inner_;
+    size_t chunk_size_;
+    std::vector<std::vector<char>> chunks_;
+    // The chunk being copied out of, only touched by the reading thread
+    size_t cur_ = 0;
+    size_t cur_size_ = 0;
+    size_t cur_i_ = 0;
+    bool has_cur_ = false;
+
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::deque<size_t> free_;
+    std::deque<std::pair<size_t, size_t>> ready_; // chunks and sizes
+    bool stop_ = false;
+    bool done_ = false;
+    std::exception_ptr error_;
+    std::thread thread_;
+};
+
+// Makes a decoder for in, or returns nullptr if it isn't compressed
+inline std::unique_ptr<decoder> make_decoder(const raw& in, compression format, bool ahead, size_t chunk_size) {
+    if (format == compression::detect) {
+        unsigned char magic[4] = {};
+        size_t n = in.read_at(0, magic, sizeof(magic));
+        format = compression::none;
+        if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+            format = compression::gzip;
+        } else if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+            format = compression::zstd;
+        } else if (n == 4 && magic[0] == 0x04 && magic[1] == 0x22 && magic[2] == 0x4d && magic[3] == 0x18) {
+            format = compression::lz4;
+        }
+    }
+
+    std::unique_ptr<decoder> d;
+    switch (format) {
+    case compression::none:
+    case compression::detect:
+        return nullptr;
+    case compression::gzip:
+#ifdef FILE_ZLIB
+        d = std::make_unique<gzip_decoder>(in.fd());
+        break;
+#else
+        throw std::runtime_error("Reading gzip needs FILE_ZLIB");
+#endif
+    case compression::zstd:
+#ifdef FILE_ZSTD
+        d = std::make_unique<zstd_decoder>(in.fd());
+        break;
+#else
+        throw std::runtime_error("Reading zstd needs FILE_ZSTD");
+#endif
+    case compression::lz4:
+#ifdef FILE_LZ4
+        d = std::make_unique<lz4_decoder>(in.fd());
+        break;
+#else
+        throw std::runtime_error("Reading lz4 needs FILE_LZ4");
+#endif
+    }
+    if (ahead) {
+        d = std::make_unique<decode_ahead>(std::move(d), chunk_size);
+    }
+    return d;
+}
+
+} // namespace detail
+
+/*
+ * A buffered file. All reads and writes are buffered and flushed automatically when the buffer 
+ * if full or the file is closed.
+ */
+class file {
+public:
+    file(const std::string& path, mode mode, const options& opts = {});
+    file(const raw& other) = delete;
+    file& operator=(const file& other) = delete;
+    file(file&& other);
+    file& operator=(file&& other);
+    ~file();
+    
+    // Returns true if the file is open and in read mode
+    bool can_read() const;
+    // Returns true if the file is open and in write or append mode
+    bool can_write() const;
+    // Returns the mode of the file
+    enum mode mode() const;
+
+    // Reads count bytes into buffer. Returns the number of bytes read
+    size_t read(void* buffer, size_t count);
+    // Reads count bytes and returns then as a std::string. 
+    // If count is less than 0 reads all remaining bytes in file.
+    std::string read(int64_t count = -1);
+    // Reads count bytes and returns them as a std::vector.
+    // If count is less than 0 reads all remaining bytes in file.
+    std::vector<uint8_t> read_bytes(int64_t count = -1);
+    // Reads bytes until a newline ('\n') is read or end of file is reached.
+    // line is filled in with all read bytes *except* the trailing newline, if any.
+    // Returns true if any bytes were read.
+    bool read_line(std::string& line);
+    // Reads bytes until a newline ('\n') is read or end of file is reached.
+    // line is set to a view of all read bytes *except* the trailing newline, if any.
+    // The view points into internal storage and is only valid until the next read.
+    // Returns true if any bytes were read.
+    bool read_line_view(std::string_view& line);
+    // Reads bytes until delim is read or end of file is reached. record is set to a view of all 
+    // read bytes *except* the delimiter. The view points into internal storage and is only valid 
+    // until the next read. Returns true if any bytes were read.
+    bool read_until(std::string_view& record, std::string_view delim);
+    // Reads count bytes, or what's left before end of file. record is set to a view of them that
+    // points into internal storage and is only valid until the next read.
+    // Returns true if any bytes were read.
+    bool read_fixed(std::string_view& record, size_t count);
+    // Reads the next record, a line split on delim, into fields, replacing its contents. Fields are
+    // views into internal storage and are only valid until the next read. With 
+    // quoting::double_quotes quoted fields may span lines and are unescaped. Reusing one fields 
+    // vector across records doesn't allocate. Returns true if a record was read.
+    bool read_record(std::vector<std::string_view>& fields, char delim = ',', quoting q = quoting::none);
+    // Reads all remaining bytes in the file into str, replacing its contents. The existing capacity
+    // of str is reused, so one string can be read into across many files without reallocating.
+    // Returns the number of bytes read.
+    size_t read_into(std::string& str);
+    // Reads all remaining bytes in the file into vec, replacing its contents. The existing capacity
+    // of vec is reused. Returns the number of bytes read.
+    size_t read_into(std::vector<uint8_t>& vec);
+    // Fills count buffers in order, reading large amounts straight into them with one system call.
+    // Returns the number of bytes read
+    size_t readv(const mutable_buffer* buffers, size_t count);
+    size_t readv(std::initializer_list<mutable_buffer> buffers);
+    // Reads count bytes starting at byte offset into buffer. Doesn't use or change the current
+    // position or the internal buffer, so it's safe to call from many threads at once.
+    // Returns the number of bytes read.
+    size_t read_at(int64_t offset, void* buffer, size_t count) const;
+    // Reads bytes until the provided vec is at capacity or end of file is reached.
+    // Returns the number of bytes read.
+    size_t read_into_capacity(std::vector<uint8_t>& vec);
+
+    // Writes count bytes to the file from buffer
+    // Returns the number of bytes written
+    size_t write(const void* buffer, size_t count);
+    // Writes the provided string_view sv to the file
+    // Returns the number of bytes written
+    size_t write(std::string_view sv);
+    // Writes count fragments to the file in order. Fragments that don't fit in the buffer are 
+    // written together with the buffered bytes in one system call instead of being copied.
+    // Returns the number of bytes written
+    size_t write(const std::string_view* fragments, size_t count);
+    size_t write(std::initializer_list<std::string_view> fragments);
+    // Reads one trivially copyable value stored in order. Throws at end of file.
+    template <class T>
+    T read(byte_order order = byte_order::native);
+    // Reads up to count trivially copyable values stored in order into data. Large arrays are
+    // read straight into data and byte swapped in place. 
+    // Returns the number of whole values read.
+    template <class T>
+    size_t read_array(T* data, size_t count, byte_order order = byte_order::native);
+    // Writes one trivially copyable value in order. Returns the number of bytes written
+    template <class T, class = detail::enable_if_value<T>>
+    size_t write(const T& value, byte_order order = byte_order::native);
+    // Writes count trivially copyable values from data in order. Large native order arrays are
+    // written straight to the file, others are byte swapped straight into the buffer.
+    // Returns the number of bytes written
+    template <class T>
+    size_t write_array(const T* data, size_t count, byte_order order = byte_order::native);
+    // Flushes the internal buffer to the underlying file
+    void flush();
+
+    // Flushes the internal buffer to the underlying file, if applicable. and closes the file. The
+    // file is closed even if flushing throws, and an atomic_replace is then abandoned.
     void close();
     // Returns true if the file is closed
     bool closed() const;
+    // Closes the file and opens path in mode with the options this file was opened with, keeping
+    // the internal buffer. Left closed if path can't be opened.
+    void reopen(const std::string& path, enum mode mode = mode::read);
 
-    // Seek to a specific byte offset in the file
+    // Seek to a specific byte offset in the file. Seeking within the buffered data doesn't make a
+    // system call. Buffered writes are flushed first.
     int64_t seek(int64_t offset, seek_mode mode);
-    // Return the current byte offset in the file 
+    // Return the current byte offset in the file, accounting for buffered data. Doesn't make a
+    // system call, except in mode::append where other writers can move the end of the file.
     int64_t tell() const;
     // If in write or append mode tell the OS to sync its caches to the underlying storage device 
     void sync() const;
+    // Like sync but only syncs the data and the metadata needed to read it back, see raw::sync_data
+    void sync_data() const;
 
     // Returns the size of the opened file
     int64_t size() const;
     // Returns the filesystem block size of the opened file
     int64_t block_size() const;
+    // Returns the current capacity of the internal buffer
+    size_t buffer_size() const;
+    // Returns the I/O counters of this file and its underlying raw, all 0 unless FILE_STATS is defined
+    io_stats stats() const;
 
     struct lines_range {
         lines_iterator begin();
@@ -167,16 +1430,127 @@ public:
         file& f_;
     };
 
+    struct lines_view_range {
+        lines_view_iterator begin();
+        eof_sentinel end();
+
+        file& f_;
+    };
+
+    struct records_until_range {
+        records_until_iterator begin();
+        eof_sentinel end();
+
+        file& f_;
+        std::string delim_;
+    };
+
+    struct records_fixed_range {
+        records_fixed_iterator begin();
+        eof_sentinel end();
+
+        file& f_;
+        size_t count_;
+    };
+
+    struct records_range {
+        records_iterator begin();
+        eof_sentinel end();
+
+        file& f_;
+        char delim_;
+        quoting quoting_;
+    };
+
+    struct reverse_lines_range {
+        reverse_lines_iterator begin();
+        eof_sentinel end();
+
+        file& f_;
+        size_t chunk_size_;
+    };
+
     // An input range over the lines of this file
     lines_range lines();
+    // An input range over views of the lines of this file. Each view is only valid until the 
+    // iterator is incremented.
+    lines_view_range lines_view();
+    // An input range over views of the lines of this file from last to first, split the same way
+    // read_line splits them. Reads backward from the end chunk_size bytes at a time with read_at, 
+    // so the cost follows the bytes iterated over rather than the size of the file. Doesn't use 
+    // or change the current position. Each view is only valid until the iterator is incremented.
+    reverse_lines_range reverse_lines(size_t chunk_size = 64 * 1024);
+    // Returns the last count lines of this file in file order, read with reverse_lines
+    std::vector<std::string> tail(size_t count);
+    // An input range over the records of this file as read by read_record. Each record is a vector
+    // of field views that is reused, and only valid until the iterator is incremented.
+    records_range records(char delim = ',', quoting q = quoting::none);
+    // An input range over views of the records of this file as read by read_until, e.g. 
+    // records_until({"\0", 1}) for find -print0 output. Each view is only valid until the 
+    // iterator is incremented.
+    records_until_range records_until(std::string_view delim);
+    // An input range over views of the count byte records of this file as read by read_fixed. 
+    // Each view is only valid until the iterator is incremented.
+    records_fixed_range records_fixed(size_t count);
+
+    // Splits the whole file into chunks of about chunk_size bytes aligned to line boundaries and
+    // calls fn(std::string_view line) for each line, reading chunks on nthreads threads with read_at.
+    // Lines are split the same way read_line splits them. With line_order::unordered fn is called 
+    // concurrently from the worker threads. With line_order::ordered fn is called on this thread in 
+    // file order while workers read ahead. nthreads of 0 uses the hardware concurrency.
+    // Doesn't use or change the current position. The first exception thrown is rethrown here.
+    template <class Fn>
+    void parallel_lines(size_t nthreads, Fn fn, line_order order = line_order::unordered, 
+                        size_t chunk_size = 4 * 1024 * 1024) const;
 
 private:
+    // Resets the position and per file state for the just opened file_
+    void start(enum mode mode);
+    // Sets up the caller owned buffer from the options or allocates one
+    void init_buffer();
+    // Refills the buffer from the underlying file. Everything in the buffer must have been consumed.
+    void refill();
+    // Grows an owned buffer for adaptive buffering. Drops the buffer's contents.
+    void grow_buffer();
+    // Writes all count bytes straight to the underlying file, bypassing the buffer
+    void write_direct(const char* data, size_t count);
+    // With dontneed_after_read drops bytes already read from the page cache, a chunk at a time 
+    // or everything left at end of file
+    void drop_behind(bool eof);
+    // Allocates and frees owned buffers, aligned for direct I/O if needed
+    char* alloc_buffer(size_t size) const;
+    void free_buffer();
+    // Flushes the buffer of a direct file keeping writes aligned
+    void flush_direct();
+    // Returns true if ptr and offset are aligned for direct I/O
+    bool aligned(const void* ptr, int64_t offset) const;
+    template <class Container>
+    size_t read_remaining_into(Container& c);
+    // Reads bytes until a delim_size byte delimiter found by find(begin, end) is read or end of
+    // file is reached. Instantiated per finder so single byte delimiters get their own loop.
+    template <class Find>
+    bool read_delimited(std::string_view& record, size_t delim_size, Find find);
+    // Reads the lines that start within [begin, end) into out and returns a view over them
+    std::string_view read_lines_at(int64_t begin, int64_t end, std::string& out) const;
+
     raw file_;
+    options opts_; // kept for reopen
 
     char* buffer_ = nullptr;
+    bool owns_buffer_ = true;
+    buffer_pool* pool_ = nullptr; // owned buffers come from here if set
+    bool adaptive_ = false;
+    size_t max_buf_cap_ = 0;
     size_t buf_cap_ = 0; // capacity of buffer
     size_t buf_size_ = 0; // read size 
     size_t buf_i_ = 0; // current "pointer" for reading/writing
+    int64_t pos_ = 0; // offset of the underlying file, kept here to save lseek calls
+    bool dontneed_ = false;
+    int64_t dropped_ = 0; // bytes before this offset were dropped from the page cache
+    size_t align_ = 1; // alignment of buffers, offsets and sizes for direct I/O
+    std::string line_; // scratch space for lines that cross a buffer refill
+    std::unique_ptr<detail::decoder> decoder_; // decompresses the file into the buffer if set
+    FILE_STAT(mutable detail::stat_counters stats_;)
 };
 
 class lines_iterator {
@@ -218,559 +1592,4881 @@ private:
     bool eof_ = false;
 };
 
-inline void strerror_r_thrower(int, const char* buf) {
-    throw std::runtime_error(buf);
-}
+class lines_view_iterator {
+public:
+    using value_type = const std::string_view;
+    using pointer = const std::string_view*;
+    using reference = const std::string_view&;
+    using difference_type = ptrdiff_t;
+    using iterator_category = std::input_iterator_tag;
 
-inline void strerror_r_thrower(char* ret, const char*) {
-    throw std::runtime_error(ret);
-}
+    explicit lines_view_iterator(file& f) : f_(f) {
+        eof_ = !f_.read_line_view(line_);
+    }
 
-inline void throw_errno_exception(int err) {
-    char errorstr[256] = "";
-#ifdef _WIN32
-    strerror_s(errorstr, 256, err);
-    throw std::runtime_error(errorstr);
-#else
-    // Depending on compiler strerror_r either returns an int or a char* error message, ignoring the buffer
-    auto ret = strerror_r(err, errorstr, 256);
-    strerror_r_thrower(ret, errorstr);
-#endif
-}
+    bool operator==(eof_sentinel) {
+        return eof_;
+    }
 
-raw::raw(const std::string& path, enum mode mode) : mode_(mode) {
-    int flags = 0;
-#ifdef _WIN32
-    int p_mode = 0;
-    switch (mode) {
-        case mode::read:
-            flags |= _O_RDONLY | _O_BINARY;
-            p_mode = _S_IREAD;
-            break;
-        case mode::write:
-            flags |= _O_WRONLY | _O_TRUNC | _O_CREAT | _O_BINARY;
-            p_mode = _S_IWRITE;
-            break;
-        case mode::append:
-            flags |= _O_WRONLY | _O_APPEND | _O_CREAT | _O_BINARY;
-            p_mode = _S_IWRITE;
-            break;
+    bool operator!=(eof_sentinel) {
+        return !eof_;
     }
+
+    reference operator*() { return line_; }
     
-#pragma warning(push)
-#pragma warning(disable: 4996) // Disable deprecation warnings for _open
-    fd_ = ::_open(path.c_str(), flags, p_mode);
-#pragma warning(pop)
-#else
-    mode_t p_mode = 0;
-    switch (mode) {
-        case mode::read:
-            flags |= O_RDONLY;
-            break;
-        case mode::write:
-            flags |= O_WRONLY | O_TRUNC | O_CREAT;
-            p_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-            break;
-        case mode::append:
-            flags |= O_WRONLY | O_APPEND | O_CREAT;
-            p_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-            break;
+    lines_view_iterator& operator++() {
+        eof_ = !f_.read_line_view(line_);
+        return *this;
     }
-    
-    fd_ = ::open(path.c_str(), flags, p_mode);
-#endif
-    if (fd_ < 0) {
-        throw_errno_exception(errno);
+
+    lines_view_iterator operator++(int) { 
+        auto old = *this; 
+        eof_ = !f_.read_line_view(line_);
+        return old;
     }
-    run_stat();
-}
 
-raw::raw(raw&& other) : 
-fd_(other.fd_),
-mode_(other.mode_),
-size_(other.size_),
+private:
+    file& f_;
+    std::string_view line_;
+    bool eof_ = false;
+};
+
+class reverse_lines_iterator {
+public:
+    using value_type = const std::string_view;
+    using pointer = const std::string_view*;
+    using reference = const std::string_view&;
+    using difference_type = ptrdiff_t;
+    using iterator_category = std::input_iterator_tag;
+
+    reverse_lines_iterator(const file& f, size_t chunk_size);
+
+    bool operator==(eof_sentinel) {
+        return eof_;
+    }
+
+    bool operator!=(eof_sentinel) {
+        return !eof_;
+    }
+
+    reference operator*() { return line_; }
+    
+    reverse_lines_iterator& operator++() {
+        eof_ = !next();
+        return *this;
+    }
+
+    reverse_lines_iterator operator++(int) { 
+        auto old = *this; 
+        eof_ = !next();
+        return old;
+    }
+
+private:
+    // Finds the line before the last one returned. Returns false if there isn't one.
+    bool next();
+    // Reads the chunk before the buffer in front of it, keeping the buffer up to end_
+    void read_back();
+
+    const file& f_;
+    size_t chunk_size_;
+    std::string buf_; // bytes of the file starting at buf_start_
+    std::string spare_;
+    int64_t buf_start_ = 0;
+    int64_t end_ = 0; // end of the next line, before its newline
+    bool terminated_ = true; // the next line is followed by a newline
+    bool done_ = false; // the first line of the file was returned
+    std::string_view line_;
+    bool eof_ = false;
+};
+
+class records_iterator {
+public:
+    using value_type = const std::vector<std::string_view>;
+    using pointer = const std::vector<std::string_view>*;
+    using reference = const std::vector<std::string_view>&;
+    using difference_type = ptrdiff_t;
+    using iterator_category = std::input_iterator_tag;
+
+    records_iterator(file& f, char delim, quoting q) : f_(f), delim_(delim), quoting_(q) {
+        eof_ = !f_.read_record(fields_, delim_, quoting_);
+    }
+
+    bool operator==(eof_sentinel) {
+        return eof_;
+    }
+
+    bool operator!=(eof_sentinel) {
+        return !eof_;
+    }
+
+    reference operator*() { return fields_; }
+    
+    records_iterator& operator++() {
+        eof_ = !f_.read_record(fields_, delim_, quoting_);
+        return *this;
+    }
+
+    records_iterator operator++(int) { 
+        auto old = *this; 
+        eof_ = !f_.read_record(fields_, delim_, quoting_);
+        return old;
+    }
+
+private:
+    file& f_;
+    char delim_;
+    quoting quoting_;
+    std::vector<std::string_view> fields_;
+    bool eof_ = false;
+};
+
+class records_until_iterator {
+public:
+    using value_type = const std::string_view;
+    using pointer = const std::string_view*;
+    using reference = const std::string_view&;
+    using difference_type = ptrdiff_t;
+    using iterator_category = std::input_iterator_tag;
+
+    records_until_iterator(file& f, std::string_view delim) : f_(f), delim_(delim) {
+        eof_ = !f_.read_until(record_, delim_);
+    }
+
+    bool operator==(eof_sentinel) {
+        return eof_;
+    }
+
+    bool operator!=(eof_sentinel) {
+        return !eof_;
+    }
+
+    reference operator*() { return record_; }
+    
+    records_until_iterator& operator++() {
+        eof_ = !f_.read_until(record_, delim_);
+        return *this;
+    }
+
+    records_until_iterator operator++(int) { 
+        auto old = *this; 
+        eof_ = !f_.read_until(record_, delim_);
+        return old;
+    }
+
+private:
+    file& f_;
+    std::string delim_;
+    std::string_view record_;
+    bool eof_ = false;
+};
+
+class records_fixed_iterator {
+public:
+    using value_type = const std::string_view;
+    using pointer = const std::string_view*;
+    using reference = const std::string_view&;
+    using difference_type = ptrdiff_t;
+    using iterator_category = std::input_iterator_tag;
+
+    records_fixed_iterator(file& f, size_t count) : f_(f), count_(count) {
+        eof_ = !f_.read_fixed(record_, count_);
+    }
+
+    bool operator==(eof_sentinel) {
+        return eof_;
+    }
+
+    bool operator!=(eof_sentinel) {
+        return !eof_;
+    }
+
+    reference operator*() { return record_; }
+    
+    records_fixed_iterator& operator++() {
+        eof_ = !f_.read_fixed(record_, count_);
+        return *this;
+    }
+
+    records_fixed_iterator operator++(int) { 
+        auto old = *this; 
+        eof_ = !f_.read_fixed(record_, count_);
+        return old;
+    }
+
+private:
+    file& f_;
+    size_t count_;
+    std::string_view record_;
+    bool eof_ = false;
+};
+
+/*
+ * A memory mapped file. The whole file is mapped into memory when opened and its contents are
+ * accessed in place without any copying. Only mode::read is supported.
+ */
+class mapped {
+public:
+    mapped(const std::string& path, mode mode, const options& opts = {});
+    mapped(const mapped& other) = delete;
+    mapped& operator=(const mapped& other) = delete;
+    mapped(mapped&& other);
+    mapped& operator=(mapped&& other);
+    ~mapped();
+
+    // Returns true if the file is open and in read mode
+    bool can_read() const;
+    // Returns true if the file is open and in write or append mode
+    bool can_write() const;
+    // Returns the mode of the file
+    enum mode mode() const;
+
+    // Returns a pointer to the first byte of the mapped file, or nullptr if empty or closed
+    const char* data() const;
+    // Returns a view over the whole file
+    std::string_view view() const;
+    // Returns a view over count bytes starting at offset.
+    // If count is less than 0 or runs past the end of the file the view ends at end of file.
+    std::string_view view(int64_t offset, int64_t count = -1) const;
+
+    // Unmaps and closes the file.
+    void close();
+    // Returns true if the file is closed
+    bool closed() const;
+
+    // Returns the size of the opened file
+    int64_t size() const;
+    // Returns the filesystem block size of the opened file
+    int64_t block_size() const;
+
+    struct lines_range {
+        mapped_lines_iterator begin();
+        eof_sentinel end();
+
+        const mapped& m_;
+    };
+
+    // An input range over the lines of this file. Lines are views into the mapping.
+    lines_range lines() const;
+
+private:
+    void unmap();
+
+    raw file_;
+    const char* data_ = nullptr;
+#ifdef _WIN32
+    HANDLE mapping_ = nullptr;
+#endif
+};
+
+class mapped_lines_iterator {
+public:
+    using value_type = const std::string_view;
+    using pointer = const std::string_view*;
+    using reference = const std::string_view&;
+    using difference_type = ptrdiff_t;
+    using iterator_category = std::input_iterator_tag;
+
+    explicit mapped_lines_iterator(std::string_view contents) : rest_(contents) {
+        next();
+    }
+
+    bool operator==(eof_sentinel) {
+        return eof_;
+    }
+
+    bool operator!=(eof_sentinel) {
+        return !eof_;
+    }
+
+    reference operator*() { return line_; }
+
+    mapped_lines_iterator& operator++() {
+        next();
+        return *this;
+    }
+
+    mapped_lines_iterator operator++(int) {
+        auto old = *this;
+        next();
+        return old;
+    }
+
+private:
+    void next() {
+        if (rest_.empty()) {
+            eof_ = true;
+            return;
+        }
+        const char* end_p = rest_.data() + rest_.size();
+        size_t nl = detail::find_byte(rest_.data(), end_p, '\n') - rest_.data();
+        if (nl == rest_.size()) {
+            line_ = rest_;
+            rest_ = {};
+            return;
+        }
+        size_t end = (nl > 0 && rest_[nl - 1] == '\r') ? nl - 1 : nl;
+        line_ = rest_.substr(0, end);
+        rest_.remove_prefix(nl + 1);
+    }
+
+    std::string_view rest_;
+    std::string_view line_;
+    bool eof_ = false;
+};
+
+/*
+ * An index of where the lines of a file start, for reading line n or binary searching a file of 
+ * sorted lines without scanning it. Keeps the offset of every sample'th line, 8 / sample bytes per 
+ * line, so finding a line scans at most sample - 1 others. Can be saved to a sidecar file and 
+ * loaded again by mapping it. Lines are split the same way read_line splits them and are views 
+ * into a mapping of the file.
+ */
+class line_index {
+public:
+    // Maps the file at path and indexes it in one pass, on nthreads threads. nthreads of 0 uses 
+    // the hardware concurrency.
+    explicit line_index(const std::string& path, size_t sample = 64, size_t nthreads = 1);
+    // Maps the index of path saved at index_path if it's up to date with the file, otherwise 
+    // builds the index and saves it there
+    static line_index load(const std::string& path, const std::string& index_path, size_t sample = 64, 
+                           size_t nthreads = 1);
+
+    // Returns the number of lines in the file
+    size_t size() const;
+    // Returns how many lines there are per kept offset
+    size_t sample() const;
+    // Returns line n. Throws std::out_of_range if there's no line n.
+    std::string_view line_at(size_t n) const;
+    // Returns the byte offset line n starts at. Throws std::out_of_range if there's no line n.
+    int64_t offset_of(size_t n) const;
+    // Returns the number of the first line not less than value, or size() if there isn't one. 
+    // The lines of the file must be sorted by less.
+    template <class Compare = std::less<std::string_view>>
+    size_t lower_bound(std::string_view value, Compare less = Compare()) const;
+    // Saves the index to index_path, replacing it
+    void save(const std::string& index_path) const;
+    // Returns the mapping of the indexed file
+    const mapped& mapping() const;
+
+private:
+    struct unbuilt {};
+    // Maps the file without indexing it
+    line_index(const std::string& path, unbuilt);
+    void build(size_t sample, size_t nthreads);
+    // Maps a saved index. Returns false if there isn't a usable one.
+    bool map_index(const std::string& index_path);
+    // Returns a pointer to the start of line n, which must exist
+    const char* start_of(size_t n) const;
+    // Returns the line starting at p and sets next to the start of the line after it
+    std::string_view line_from(const char* p, const char** next = nullptr) const;
+
+    mapped file_;
+    int64_t modified_; // of the file in ns, to tell if a saved index is stale
+    size_t sample_ = 1;
+    uint64_t lines_ = 0;
+    std::vector<uint64_t> samples_; // line start offsets when built here
+    std::unique_ptr<mapped> index_; // when loaded
+    const uint64_t* offsets_ = nullptr; // into one of the above
+};
+
+/*
+ * A buffered writer that writes its buffers out on a background thread. Writes are copied into one 
+ * buffer while the background thread writes out the others, so the writing thread doesn't wait on 
+ * the disk unless every buffer is full. Writes are either wholly kept or wholly dropped, and kept 
+ * writes reach the file in order. Only one thread may write at a time.
+ */
+class async_writer {
+public:
+    async_writer(const std::string& path, mode mode, const options& opts = {});
+    async_writer(const async_writer& other) = delete;
+    async_writer& operator=(const async_writer& other) = delete;
+    // Flushes and closes the file
+    ~async_writer();
+
+    // Returns true if the file is open and in write or append mode
+    bool can_write() const;
+    // Returns the mode of the file
+    enum mode mode() const;
+
+    // Writes count bytes to the file from buffer. With backpressure::drop a write that doesn't fit 
+    // in the free buffers is dropped. Returns the number of bytes written, 0 if dropped.
+    // Errors from writing earlier buffers out are rethrown here.
+    size_t write(const void* buffer, size_t count);
+    // Writes the provided string_view sv to the file
+    // Returns the number of bytes written, 0 if dropped.
+    size_t write(std::string_view sv);
+    // Blocks until everything written so far is in the file
+    void flush();
+    // Flushes then tells the OS to sync its caches to the underlying storage device
+    void sync();
+
+    // Flushes, stops the background thread and closes the file
+    void close();
+    // Returns true if the file is closed
+    bool closed() const;
+
+    // Returns the number of bytes dropped with backpressure::drop
+    uint64_t dropped() const;
+
+private:
+    // Queues the current buffer to be written out and takes a free one. m_ must be held.
+    void hand_off(std::unique_lock<std::mutex>& lock);
+    void rethrow_error();
+    void run_writer();
+
+    raw file_;
+    size_t buf_cap_ = 0;
+    std::vector<char*> buffers_;
+    size_t current_ = 0; // buffer being written into
+    size_t cur_size_ = 0;
+    backpressure on_full_;
+    uint64_t dropped_ = 0;
+
+    mutable std::mutex m_;
+    std::condition_variable cv_;
+    std::deque<size_t> free_; // buffers ready to be written into
+    std::deque<std::pair<size_t, size_t>> queue_; // buffers and sizes waiting to be written out
+    bool busy_ = false; // the background thread is writing a buffer out
+    bool stop_ = false;
+    std::exception_ptr error_;
+    std::thread thread_;
+};
+
+/*
+ * Combines the syncs of many threads writing to one file into fewer system calls (group commit). 
+ * While one sync runs, the threads that ask for one wait and are all covered by the next, so a 
+ * burst of writers costs two syncs rather than one each. The file must outlive it.
+ */
+class group_sync {
+public:
+    // Syncs with raw::sync_data, or raw::sync if not data_only
+    explicit group_sync(const raw& file, bool data_only = true);
+    group_sync(const group_sync& other) = delete;
+    group_sync& operator=(const group_sync& other) = delete;
+
+    // Returns once everything written to the file before the call has been synced. Safe to call 
+    // from many threads. Once a sync fails every later call throws its error, since what it was 
+    // meant to sync may be lost.
+    void sync();
+    // Returns the number of syncs made
+    uint64_t syncs() const;
+
+private:
+    const raw& file_;
+    bool data_only_;
+    mutable std::mutex m_;
+    std::condition_variable cv_;
+    uint64_t requested_ = 0; // calls so far, each takes the next number
+    uint64_t synced_ = 0; // calls up to this number are covered by a finished sync
+    bool running_ = false;
+    uint64_t syncs_ = 0;
+    std::exception_ptr error_;
+};
+
+/*
+ * A writer many threads can write records to at once. Each thread copies its records into its own 
+ * buffer, so threads don't contend until a buffer is full and written out. Every record is 
+ * written whole without interleaving with other records. Records from one thread reach the file 
+ * in the order that thread wrote them, records from different threads in no particular order.
+ */
+class shared_appender {
+public:
+    shared_appender(const std::string& path, mode mode = mode::append, const options& opts = {});
+    shared_appender(const shared_appender& other) = delete;
+    shared_appender& operator=(const shared_appender& other) = delete;
+    // Flushes and closes the file
+    ~shared_appender();
+
+    // Returns true if the file is open and in write or append mode
+    bool can_write() const;
+    // Returns the mode of the file
+    enum mode mode() const;
+
+    // Writes a record of count bytes from buffer to the file. Safe to call from many threads.
+    // Returns the number of bytes written
+    size_t write(const void* buffer, size_t count);
+    // Writes the provided string_view sv to the file as one record
+    // Returns the number of bytes written
+    size_t write(std::string_view sv);
+    // Writes every thread's buffered records to the file
+    void flush();
+    // Flushes then syncs the file's data. Syncs asked for by many threads at once are combined 
+    // with group_sync.
+    void sync();
+
+    // Flushes and closes the file. No thread may be writing.
+    void close();
+    // Returns true if the file is closed
+    bool closed() const;
+
+private:
+    struct slot {
+        std::mutex m; // Only contended while the slot is being flushed
+        char* data = nullptr;
+        size_t size = 0;
+        ~slot() { free(data); }
+    };
+
+    slot& local_slot();
+    // Writes out the slot's records. The slot's mutex must be held.
+    void flush_slot(slot& s);
+    void write_all(const char* data, size_t count);
+
+    raw file_;
+    group_sync syncer_;
+    size_t buf_cap_ = 0;
+    uint64_t id_; // Tells appenders apart in each thread's slots
+    std::mutex slots_m_;
+    std::vector<std::shared_ptr<slot>> slots_;
+    std::mutex io_m_; // Keeps each buffer's records together in the file
+};
+
+/*
+ * Follows a file that's being appended to, like tail -f. Hands out whole lines as they're written, 
+ * sleeping on inotify (Linux), kqueue (macOS and FreeBSD) or change notifications (Windows) in 
+ * between and waking as soon as the file changes. A partial last line is held back until its 
+ * newline is written. Reads from the start again when the file is truncated, and reopens the path 
+ * when the file is rotated, i.e. renamed or removed and another created in its place, once the old 
+ * file has been read to its end. Only one thread may read at a time.
+ */
+class follower {
+public:
+    // Opens path to follow from its start, or from its end if from_end
+    follower(const std::string& path, bool from_end = false, const options& opts = {});
+    follower(const follower& other) = delete;
+    follower& operator=(const follower& other) = delete;
+    ~follower();
+
+    // Waits up to timeout for the next line, split the same way read_line splits them. A negative
+    // timeout waits until there is one or stop() is called. Returns false on timeout or stop.
+    bool read_line(std::string& line, std::chrono::milliseconds timeout = std::chrono::milliseconds(-1));
+    // Like read_line but line is set to a view into internal storage that is only valid until the 
+    // next read
+    bool read_line_view(std::string_view& line, std::chrono::milliseconds timeout = std::chrono::milliseconds(-1));
+    // Makes a read waiting on another thread, and every read after it, return false. 
+    // Safe to call from any thread.
+    void stop();
+
+    // Returns the number of times the file was truncated
+    uint64_t truncations() const;
+    // Returns the number of times the file was rotated
+    uint64_t rotations() const;
+
+private:
+    // Sets line to the next whole line in pending_. Returns false if there isn't one.
+    bool next_line(std::string_view& line);
+    // Reads what's been appended into pending_. Returns false at end of file.
+    bool fill();
+    // At end of file handles a truncated or rotated file. Returns true if there may be more to read.
+    bool check_file();
+    // Waits for the file or its directory to change, the timeout or stop()
+    void wait(std::chrono::milliseconds timeout);
+    // Watches the currently open file for changes
+    void watch();
+    void close_watches();
+
+    std::string path_;
+    options opts_;
+    raw file_;
+    int64_t pos_ = 0;
+    size_t chunk_size_;
+    std::string pending_; // read bytes that haven't been handed out start at pending_i_
+    size_t pending_i_ = 0;
+    size_t scanned_ = 0; // bytes after pending_i_ known not to hold a newline
+    bool last_line_ = false; // hand out a partial line before moving to a rotated file
+    std::atomic<bool> stopped_{false};
+    uint64_t truncations_ = 0;
+    uint64_t rotations_ = 0;
+#ifdef _WIN32
+    HANDLE change_ = INVALID_HANDLE_VALUE;
+    HANDLE stop_event_ = nullptr;
+#else
+    int stop_pipe_[2] = {-1, -1};
+#if defined(__linux__)
+    int inotify_ = -1;
+    int file_watch_ = -1;
+#elif defined(FILE_KQUEUE)
+    int kqueue_ = -1;
+    int dir_fd_ = -1;
+#endif
+#endif
+};
+
+/*
+ * An asynchronous engine for positional reads and writes across many raw files. Operations are 
+ * queued and sent to the OS in batches by submit(). Uses io_uring on Linux and falls back to a pool 
+ * of threads elsewhere or when io_uring isn't allowed. Completions are handled on internal threads.
+ * Files and buffers must outlive the operations using them.
+ */
+class async {
+public:
+    // Called on a completion thread with the number of bytes transferred or the error. Must not throw.
+    // May queue more operations, but must not call wait() since that waits on the completion thread.
+    using callback = std::function<void(size_t bytes, std::exception_ptr error)>;
+
+    // Sends queued operations automatically once queue_depth are waiting. The thread pool fallback 
+    // uses nthreads threads, 0 for the hardware concurrency.
+    explicit async(unsigned queue_depth = 256, size_t nthreads = 0);
+    async(const async& other) = delete;
+    async& operator=(const async& other) = delete;
+    // Waits for all queued operations to complete
+    ~async();
+
+    // Queues a read of count bytes starting at byte offset of f into buffer.
+    // The future holds the number of bytes read.
+    std::future<size_t> read_at(const raw& f, int64_t offset, void* buffer, size_t count);
+    // Queues a write of count bytes from buffer starting at byte offset of f.
+    // The future holds the number of bytes written.
+    std::future<size_t> write_at(const raw& f, int64_t offset, const void* buffer, size_t count);
+    // Queues a read and calls done when it completes
+    void read_at(const raw& f, int64_t offset, void* buffer, size_t count, callback done);
+    // Queues a write and calls done when it completes
+    void write_at(const raw& f, int64_t offset, const void* buffer, size_t count, callback done);
+
+    // Sends all queued operations to the OS in one batch
+    void submit();
+    // Submits queued operations and blocks until all of them have completed
+    void wait();
+
+    // Registers files with io_uring so operations on them skip the per operation file lookup.
+    // Replaces previously registered files. Call while nothing is in flight. No-op without io_uring.
+    void register_files(const std::vector<const raw*>& files);
+    // Registers buffers with io_uring so operations within them skip mapping pages per operation.
+    // Replaces previously registered buffers. Call while nothing is in flight. No-op without io_uring.
+    void register_buffers(const std::vector<std::pair<void*, size_t>>& buffers);
+
+    // Returns true if operations go through io_uring
+    bool uring() const;
+
+private:
+    struct op {
+        const raw* f;
+        int64_t offset;
+        char* buffer;
+        size_t count;
+        bool write;
+        std::promise<size_t> promise;
+        callback done;
+    };
+
+    void queue(op* o);
+    void complete(op* o, size_t bytes, std::exception_ptr error);
+    void run_worker();
+    static std::exception_ptr errno_error(int err);
+
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::vector<op*> pending_; // queued but not yet submitted
+    size_t inflight_ = 0; // submitted but not yet completed
+    unsigned depth_;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+    std::deque<op*> work_; // submitted operations waiting for a pool thread
+
+#ifdef FILE_IO_URING
+    bool uring_setup(unsigned entries);
+    void uring_teardown();
+    // Sends pending_ to the kernel, or from the reaper only as much as fits without waiting. m_ must 
+    // be held. Operations that can't be sent are moved to failed and the error is returned.
+    std::exception_ptr uring_submit(std::unique_lock<std::mutex>& lock, std::vector<op*>& failed);
+    // Writes o into the next submission queue entry
+    void uring_push(op* o);
+    // Submits to_submit entries, counting it down as the kernel takes them. Returns 0 or the error.
+    int uring_enter(unsigned& to_submit);
+    void run_reaper();
+
+    int ring_fd_ = -1;
+    int event_fd_ = -1; // counts completions, the reaper blocks reading it
+    std::unordered_set<op*> submitted_; // sent to the kernel but not yet completed
+    bool deferred_ = false; // the reaper left operations in pending_ to send once there's room
+    std::exception_ptr uring_error_; // the reaper can't wait for completions anymore
+    unsigned sq_entries_ = 0;
+    unsigned cq_entries_ = 0;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_mask_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    io_uring_sqe* sqes_ = nullptr;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned* cq_mask_ = nullptr;
+    io_uring_cqe* cqes_ = nullptr;
+    void* sq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    void* cq_ring_ = nullptr;
+    size_t cq_ring_size_ = 0;
+    size_t sqes_size_ = 0;
+    std::unordered_map<int, unsigned> fixed_files_; // fd to registered index
+    std::vector<std::pair<void*, size_t>> fixed_buffers_;
+#endif
+};
+
+inline void strerror_r_thrower(int, const char* buf) {
+    throw std::runtime_error(buf);
+}
+
+inline void strerror_r_thrower(char* ret, const char*) {
+    throw std::runtime_error(ret);
+}
+
+inline void throw_errno_exception(int err) {
+    char errorstr[256] = "";
+#ifdef _WIN32
+    strerror_s(errorstr, 256, err);
+    throw std::runtime_error(errorstr);
+#else
+    // Depending on compiler strerror_r either returns an int or a char* error message, ignoring the buffer
+    auto ret = strerror_r(err, errorstr, 256);
+    strerror_r_thrower(ret, errorstr);
+#endif
+}
+
+buffer_pool::buffer_pool(size_t max_buffers) : max_buffers_(max_buffers) {}
+
+buffer_pool::~buffer_pool() {
+    clear();
+}
+
+char* buffer_pool::acquire(size_t size, size_t align) {
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        // Most recently released first, it's the most likely to still be in cache
+        for (size_t i = free_.size(); i-- > 0;) {
+            if (free_[i].size == size && free_[i].align >= align) {
+                char* data = free_[i].data;
+                free_[i] = free_.back();
+                free_.pop_back();
+                return data;
+            }
+        }
+    }
+    // Cache line aligned at least, which posix_memalign also needs to be a multiple of sizeof(void*)
+    return static_cast<char*>(detail::alloc_aligned(size, (std::max)(align, static_cast<size_t>(64))));
+}
+
+void buffer_pool::release(char* buffer, size_t size, size_t align) {
+    if (!buffer) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        if (free_.size() < max_buffers_) {
+            free_.push_back({buffer, size, (std::max)(align, static_cast<size_t>(64))});
+            return;
+        }
+    }
+    detail::free_aligned(buffer);
+}
+
+void buffer_pool::clear() {
+    std::vector<entry> free;
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        free.swap(free_);
+    }
+    for (const entry& e : free) {
+        detail::free_aligned(e.data);
+    }
+}
+
+size_t buffer_pool::free_buffers() const {
+    std::lock_guard<std::mutex> lock(m_);
+    return free_.size();
+}
+
+buffer_pool& buffer_pool::local() {
+    thread_local buffer_pool pool;
+    return pool;
+}
+
+namespace detail {
+
+// Syncs the directory holding path so a rename or create in it is durable. Does nothing on Windows.
+inline void sync_directory(const std::string& path) {
+#ifndef _WIN32
+    size_t slash = path.find_last_of('/');
+    std::string dir = (slash == std::string::npos) ? "." : (slash == 0) ? "/" : path.substr(0, slash);
+    int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw_errno_exception(errno);
+    }
+    int ret = ::fsync(fd);
+    int err = errno;
+    ::close(fd);
+    // Some filesystems can't sync a directory, there's nothing more to do there
+    if (ret < 0 && err != EINVAL && err != EBADF) {
+        throw_errno_exception(err);
+    }
+#else
+    (void)path;
+#endif
+}
+
+} // namespace detail
+
+raw::raw(const std::string& path, enum mode mode, const options& opts) : 
+mode_(mode),
+direct_(opts.direct && mode != mode::append) {
+    if (opts.atomic_replace && mode != mode::write) {
+        throw std::runtime_error("atomic_replace needs mode::write");
+    }
+    // Opens path, or with atomic_replace a new temporary file next to it
+    auto open_unique = [&](const std::string& path, auto open) {
+        if (!opts.atomic_replace) {
+            return open(path);
+        }
+        static std::atomic<uint64_t> next{0};
+        while (true) {
+#ifdef _WIN32
+            std::string temp = path + ".tmp" + std::to_string(::_getpid()) + "." + std::to_string(next++);
+#else
+            std::string temp = path + ".tmp" + std::to_string(::getpid()) + "." + std::to_string(next++);
+#endif
+            int fd = open(temp);
+            if (fd >= 0) {
+                replace_path_ = path;
+                temp_path_ = temp;
+                uncaught_ = std::uncaught_exceptions();
+                return fd;
+            }
+            if (errno != EEXIST) {
+                return fd;
+            }
+            // Left behind by a process that had this pid
+        }
+    };
+    int flags = 0;
+#ifdef _WIN32
+    int p_mode = 0;
+    // Maps to FILE_FLAG_SEQUENTIAL_SCAN and FILE_FLAG_RANDOM_ACCESS
+    if (opts.access == advice::sequential) {
+        flags |= _O_SEQUENTIAL;
+    } else if (opts.access == advice::random) {
+        flags |= _O_RANDOM;
+    }
+    switch (mode) {
+        case mode::read:
+            flags |= _O_RDONLY | _O_BINARY;
+            p_mode = _S_IREAD;
+            break;
+        case mode::write:
+            flags |= _O_WRONLY | _O_CREAT | _O_BINARY;
+            flags |= opts.atomic_replace ? _O_EXCL : _O_TRUNC;
+            p_mode = _S_IWRITE;
+            break;
+        case mode::append:
+            flags |= _O_WRONLY | _O_APPEND | _O_CREAT | _O_BINARY;
+            p_mode = _S_IWRITE;
+            break;
+    }
+    
+    direct_ = direct_ && mode == mode::read;
+    if (direct_) {
+        // _open can't ask for FILE_FLAG_NO_BUFFERING so open the handle directly
+        DWORD attrs = FILE_FLAG_NO_BUFFERING;
+        attrs |= (opts.access == advice::sequential) ? FILE_FLAG_SEQUENTIAL_SCAN : 0;
+        attrs |= (opts.access == advice::random) ? FILE_FLAG_RANDOM_ACCESS : 0;
+        HANDLE h = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, 
+                               OPEN_EXISTING, attrs, nullptr);
+        if (h == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Couldn't open file");
+        }
+        fd_ = ::_open_osfhandle(reinterpret_cast<intptr_t>(h), flags);
+        if (fd_ < 0) {
+            CloseHandle(h);
+        }
+    } else {
+        fd_ = open_unique(path, [&](const std::string& p) {
+#pragma warning(push)
+#pragma warning(disable: 4996) // Disable deprecation warnings for _open
+            return ::_open(p.c_str(), flags, p_mode);
+#pragma warning(pop)
+        });
+    }
+#else
+    mode_t p_mode = 0;
+    switch (mode) {
+        case mode::read:
+            flags |= O_RDONLY;
+            break;
+        case mode::write:
+            flags |= O_WRONLY | O_CREAT;
+            flags |= opts.atomic_replace ? O_EXCL : O_TRUNC;
+            p_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+            break;
+        case mode::append:
+            flags |= O_WRONLY | O_APPEND | O_CREAT;
+            p_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+            break;
+    }
+#ifdef O_DIRECT
+    if (direct_) {
+        flags |= O_DIRECT;
+    }
+#endif
+    
+    fd_ = open_unique(path, [&](const std::string& p) { return ::open(p.c_str(), flags, p_mode); });
+#endif
+    if (fd_ < 0) {
+        throw_errno_exception(errno);
+    }
+#if defined(__APPLE__)
+    if (direct_ && ::fcntl(fd_, F_NOCACHE, 1) < 0) {
+        int err = errno;
+        discard();
+        throw_errno_exception(err);
+    }
+#endif
+#ifndef _WIN32
+    struct stat replaced;
+    if (!temp_path_.empty() && ::stat(path.c_str(), &replaced) == 0 && S_ISREG(replaced.st_mode)) {
+        // Give the replacement the permissions of the file it replaces before anything is written
+        if (::fchmod(fd_, replaced.st_mode & 07777) < 0) {
+            int err = errno;
+            discard();
+            throw_errno_exception(err);
+        }
+        // Only privileged processes can give a file away, otherwise try to keep just the group
+        if (::fchown(fd_, replaced.st_uid, replaced.st_gid) < 0 && ::fchown(fd_, -1, replaced.st_gid) < 0) {
+            // The replacement is owned by this process
+        }
+    }
+#endif
+    if (mode == mode::write) {
+        // Just truncated, no need to ask
+        size_ = 0;
+    }
+
+    if (opts.expected_size > 0 && mode != mode::read) {
+        try {
+            preallocate(opts.expected_size);
+        } catch (const std::exception&) {
+            // Only a hint, so doesn't matter where it can't, like on devices and full disks
+        }
+    }
+
+    try {
+        if (opts.access != advice::normal) {
+            advise(opts.access);
+        }
+        if (opts.willneed) {
+            advise(advice::willneed);
+        }
+    } catch (const std::exception&) {
+        // Only hints, and some files like pipes can't take them
+    }
+}
+
+raw::raw(raw&& other) : 
+fd_(other.fd_),
+mode_(other.mode_),
+direct_(other.direct_),
+replace_path_(std::move(other.replace_path_)),
+temp_path_(std::move(other.temp_path_)),
+uncaught_(other.uncaught_),
+size_(other.size_),
 block_size_(other.block_size_)  {
+    FILE_STAT(stats_ = other.stats_;)
     other.fd_ = -1;
+    other.replace_path_.clear();
+}
+
+raw& raw::operator=(raw&& other) {
+    if (this != &other) {
+        this->close();
+        fd_ = other.fd_;
+        mode_ = other.mode_;
+        direct_ = other.direct_;
+        replace_path_ = std::move(other.replace_path_);
+        temp_path_ = std::move(other.temp_path_);
+        uncaught_ = other.uncaught_;
+        size_ = other.size_;
+        block_size_ = other.block_size_;
+        FILE_STAT(stats_ = other.stats_;)
+        other.fd_ = -1;
+        other.replace_path_.clear();
+    }
+    return *this;
+}
+
+raw::~raw() {
+    try {
+        close();
+    } catch (const std::exception&) {
+        // Only a failed atomic_replace throws, and it leaves path as it was
+    }
+}
+
+bool raw::can_read() const {
+    return !closed() && mode_ == mode::read;
+}
+
+bool raw::can_write() const {
+    return !closed() && (mode_ == mode::write || mode_ == mode::append);
+}
+
+mode raw::mode() const {
+    return mode_;
+}
+
+size_t raw::read(void* buffer, size_t count) const {
+    FILE_STAT(detail::stat_timer timer(stats_, detail::stat::read_ns);)
+#ifdef _WIN32
+    int bytes_read = ::_read(fd_, buffer, static_cast<unsigned int>(count));
+#else
+    ssize_t bytes_read = ::read(fd_, buffer, count);
+#endif
+    if (bytes_read < 0) {
+        throw_errno_exception(errno);
+    }
+    FILE_STAT(detail::count(stats_, detail::stat::read_calls);)
+    FILE_STAT(detail::count(stats_, detail::stat::bytes_read, static_cast<uint64_t>(bytes_read));)
+
+    return static_cast<size_t>(bytes_read);
+}
+
+size_t raw::write(const void* buffer, size_t count) const {
+    FILE_STAT(detail::stat_timer timer(stats_, detail::stat::write_ns);)
+#ifdef _WIN32
+    int bytes_written = ::_write(fd_, buffer, static_cast<unsigned int>(count));
+#else
+    ssize_t bytes_written = ::write(fd_, buffer, count);
+#endif
+    if (bytes_written < 0) {
+        throw_errno_exception(errno);
+    }
+    FILE_STAT(detail::count(stats_, detail::stat::write_calls);)
+    FILE_STAT(detail::count(stats_, detail::stat::bytes_written, static_cast<uint64_t>(bytes_written));)
+
+    return static_cast<size_t>(bytes_written);
+}
+
+size_t raw::writev(const std::string_view* fragments, size_t count) const {
+    if (closed()) {
+        throw std::runtime_error("Can't write to closed file");
+    }
+
+#ifdef _WIN32
+    size_t written = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t n = write(fragments[i].data(), fragments[i].size());
+        written += n;
+        if (n < fragments[i].size()) {
+            break;
+        }
+    }
+    return written;
+#else
+    // Callers loop over anything past max_iov like any other short write
+    constexpr size_t max_iov = 64;
+    iovec iov[max_iov];
+    int n = static_cast<int>((std::min)(count, max_iov));
+    for (int i = 0; i < n; i++) {
+        iov[i].iov_base = const_cast<char*>(fragments[i].data());
+        iov[i].iov_len = fragments[i].size();
+    }
+    FILE_STAT(detail::stat_timer timer(stats_, detail::stat::write_ns);)
+    ssize_t bytes_written = ::writev(fd_, iov, n);
+    if (bytes_written < 0) {
+        throw_errno_exception(errno);
+    }
+    FILE_STAT(detail::count(stats_, detail::stat::write_calls);)
+    FILE_STAT(detail::count(stats_, detail::stat::bytes_written, static_cast<uint64_t>(bytes_written));)
+    return static_cast<size_t>(bytes_written);
+#endif
+}
+
+size_t raw::writev(std::initializer_list<std::string_view> fragments) const {
+    return writev(fragments.begin(), fragments.size());
+}
+
+size_t raw::readv(const mutable_buffer* buffers, size_t count) const {
+    if (closed()) {
+        throw std::runtime_error("Can't read from closed file");
+    }
+
+#ifdef _WIN32
+    size_t bytes_read = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t n = read(buffers[i].data, buffers[i].size);
+        bytes_read += n;
+        if (n < buffers[i].size) {
+            break;
+        }
+    }
+    return bytes_read;
+#else
+    constexpr size_t max_iov = 64;
+    iovec iov[max_iov];
+    int n = static_cast<int>((std::min)(count, max_iov));
+    for (int i = 0; i < n; i++) {
+        iov[i].iov_base = buffers[i].data;
+        iov[i].iov_len = buffers[i].size;
+    }
+    FILE_STAT(detail::stat_timer timer(stats_, detail::stat::read_ns);)
+    ssize_t bytes_read = ::readv(fd_, iov, n);
+    if (bytes_read < 0) {
+        throw_errno_exception(errno);
+    }
+    FILE_STAT(detail::count(stats_, detail::stat::read_calls);)
+    FILE_STAT(detail::count(stats_, detail::stat::bytes_read, static_cast<uint64_t>(bytes_read));)
+    return static_cast<size_t>(bytes_read);
+#endif
+}
+
+size_t raw::readv(std::initializer_list<mutable_buffer> buffers) const {
+    return readv(buffers.begin(), buffers.size());
+}
+
+size_t raw::read_at(int64_t offset, void* buffer, size_t count) const {
+    if (closed()) {
+        throw std::runtime_error("Can't read from closed file");
+    }
+    if (offset < 0) {
+        throw std::runtime_error("Can't read at a negative offset");
+    }
+
+    FILE_STAT(detail::stat_timer timer(stats_, detail::stat::read_ns);)
+#ifdef _WIN32
+    // ReadFile with an OVERLAPPED offset on a synchronous handle reads from the offset but leaves 
+    // the file pointer after what it read, so put it back
+    HANDLE h = (HANDLE)_get_osfhandle(fd_);
+    std::lock_guard<std::mutex> lock(detail::positional_mutex());
+    LARGE_INTEGER pos = detail::file_pointer(h);
+    OVERLAPPED ov = {};
+    ov.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+    ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD bytes_read = 0;
+    DWORD to_read = static_cast<DWORD>((std::min)(count, static_cast<size_t>(0xFFFFFFFF)));
+    BOOL ok = ReadFile(h, buffer, to_read, &bytes_read, &ov);
+    DWORD err = ok ? ERROR_SUCCESS : GetLastError();
+    SetFilePointerEx(h, pos, nullptr, FILE_BEGIN);
+    if (!ok && err != ERROR_HANDLE_EOF) {
+        throw std::runtime_error("Couldn't read from file");
+    }
+#else
+    ssize_t bytes_read = ::pread(fd_, buffer, count, static_cast<off_t>(offset));
+    if (bytes_read < 0) {
+        throw_errno_exception(errno);
+    }
+#endif
+    FILE_STAT(detail::count(stats_, detail::stat::read_calls);)
+    FILE_STAT(detail::count(stats_, detail::stat::bytes_read, static_cast<uint64_t>(bytes_read));)
+
+    return static_cast<size_t>(bytes_read);
+}
+
+size_t raw::write_at(int64_t offset, const void* buffer, size_t count) const {
+    if (closed()) {
+        throw std::runtime_error("Can't write to closed file");
+    }
+    if (mode_ == mode::append) {
+        // POSIX appends pwrite data in append mode no matter the offset
+        throw std::runtime_error("Can't write at an offset in append mode");
+    }
+    if (offset < 0) {
+        throw std::runtime_error("Can't write at a negative offset");
+    }
+
+    FILE_STAT(detail::stat_timer timer(stats_, detail::stat::write_ns);)
+#ifdef _WIN32
+    // Moves the file pointer like ReadFile does in read_at
+    HANDLE h = (HANDLE)_get_osfhandle(fd_);
+    std::lock_guard<std::mutex> lock(detail::positional_mutex());
+    LARGE_INTEGER pos = detail::file_pointer(h);
+    OVERLAPPED ov = {};
+    ov.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+    ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD bytes_written = 0;
+    DWORD to_write = static_cast<DWORD>((std::min)(count, static_cast<size_t>(0xFFFFFFFF)));
+    BOOL ok = WriteFile(h, buffer, to_write, &bytes_written, &ov);
+    SetFilePointerEx(h, pos, nullptr, FILE_BEGIN);
+    if (!ok) {
+        throw std::runtime_error("Couldn't write to file");
+    }
+#else
+    ssize_t bytes_written = ::pwrite(fd_, buffer, count, static_cast<off_t>(offset));
+    if (bytes_written < 0) {
+        throw_errno_exception(errno);
+    }
+#endif
+    FILE_STAT(detail::count(stats_, detail::stat::write_calls);)
+    FILE_STAT(detail::count(stats_, detail::stat::bytes_written, static_cast<uint64_t>(bytes_written));)
+
+    return static_cast<size_t>(bytes_written);
+}
+
+size_t raw::transfer_to(const raw& dst, int64_t offset, size_t count) const {
+    if (!dst.can_write()) {
+        throw std::runtime_error("Can't transfer to a file that isn't writable");
+    }
+    return transfer_to(dst.fd(), offset, count);
+}
+
+size_t raw::transfer_to(int fd, int64_t offset, size_t count) const {
+    if (closed()) {
+        throw std::runtime_error("Can't read from closed file");
+    }
+    if (offset < 0) {
+        throw std::runtime_error("Can't read at a negative offset");
+    }
+
+    size_t copied = 0;
+#ifdef __linux__
+    // Each method falls through to the next when it can't handle these files, e.g. copy_file_range 
+    // across filesystems on older kernels or to a socket, and sendfile to an O_APPEND file
+    auto unsupported = [](int err) {
+        return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP || err == EBADF;
+    };
+#ifdef __NR_copy_file_range
+    while (copied < count) {
+        loff_t off = static_cast<loff_t>(offset + copied);
+        long n = ::syscall(__NR_copy_file_range, fd_, &off, fd, nullptr, count - copied, 0u);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (unsupported(errno)) {
+                break;
+            }
+            throw_errno_exception(errno);
+        }
+        if (n == 0) {
+            return copied;
+        }
+        copied += static_cast<size_t>(n);
+    }
+#endif
+    while (copied < count) {
+        off_t off = static_cast<off_t>(offset + copied);
+        ssize_t n = ::sendfile(fd, fd_, &off, count - copied);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (unsupported(errno)) {
+                break;
+            }
+            throw_errno_exception(errno);
+        }
+        if (n == 0) {
+            return copied;
+        }
+        copied += static_cast<size_t>(n);
+    }
+#endif
+
+    // Copy through memory. The buffer is aligned in case this file is direct.
+    const size_t buf_size = 1024 * 1024;
+    size_t align = static_cast<size_t>((std::max)(block_size(), static_cast<int64_t>(64)));
+    char* buf = static_cast<char*>(detail::alloc_aligned(buf_size, align));
+    if (!buf) {
+        throw std::bad_alloc();
+    }
+    try {
+        while (copied < count) {
+            size_t n = read_at(offset + copied, buf, (std::min)(count - copied, buf_size));
+            if (n == 0) {
+                break;
+            }
+            size_t written = 0;
+            while (written != n) {
+#ifdef _WIN32
+                int w = ::_write(fd, buf + written, static_cast<unsigned int>(n - written));
+#else
+                ssize_t w = ::write(fd, buf + written, n - written);
+#endif
+                if (w < 0) {
+                    throw_errno_exception(errno);
+                }
+                if (w == 0) {
+                    throw std::runtime_error("Couldn't write to file");
+                }
+                written += static_cast<size_t>(w);
+            }
+            copied += n;
+        }
+    } catch (...) {
+        detail::free_aligned(buf);
+        throw;
+    }
+    detail::free_aligned(buf);
+    return copied;
+}
+
+void raw::close() {
+    if (fd_ < 0 || replace_path_.empty()) {
+        close_fd();
+        return;
+    }
+    std::string path = std::move(replace_path_);
+    std::string temp = std::move(temp_path_);
+    replace_path_.clear();
+    if (std::uncaught_exceptions() > uncaught_) {
+        // Closed by a destructor on the way out of a failed write, keep the old file
+        close_fd();
+        ::remove(temp.c_str());
+        return;
+    }
+    try {
+        sync_data();
+        close_fd();
+#ifdef _WIN32
+        if (!::MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+            throw std::runtime_error("Couldn't replace " + path);
+        }
+#else
+        if (::rename(temp.c_str(), path.c_str()) < 0) {
+            throw_errno_exception(errno);
+        }
+#endif
+    } catch (...) {
+        close_fd();
+        ::remove(temp.c_str());
+        throw;
+    }
+    detail::sync_directory(path);
+}
+
+void raw::discard() {
+    close_fd();
+    if (!replace_path_.empty()) {
+        replace_path_.clear();
+        ::remove(temp_path_.c_str());
+        temp_path_.clear();
+    }
+}
+
+void raw::close_fd() {
+    if (fd_ >= 0) {
+#ifdef _WIN32
+        ::_close(fd_);
+#else
+        ::close(fd_);
+#endif
+    }
+    fd_ = -1; 
+    size_ = 0;
+    block_size_ = 0;
+}
+
+bool raw::closed() const {
+    return fd_ == -1;
+}
+
+int64_t raw::tell() const {
+    return seek(0, seek_mode::cur);
+}
+
+int64_t raw::seek(int64_t offset, seek_mode mode) const {
+    if (closed()) {
+        throw std::runtime_error("Can't seek closed file.");
+    }
+
+    int whence = 0;
+    switch (mode) {
+        case seek_mode::set:
+            whence = SEEK_SET;
+            break;
+        case seek_mode::cur:
+            whence = SEEK_CUR;
+            break;
+        case seek_mode::end:
+            whence = SEEK_END;
+            break;
+        case seek_mode::data:
+#ifdef SEEK_DATA
+            whence = SEEK_DATA;
+#else
+            whence = SEEK_SET;
+#endif
+            break;
+        case seek_mode::hole:
+#ifdef SEEK_HOLE
+            whence = SEEK_HOLE;
+#else
+            whence = SEEK_END;
+            offset = 0;
+#endif
+            break;
+    }
+#ifdef _WIN32
+    int64_t ret = ::_lseeki64(fd_, offset, whence);
+#else
+    int64_t ret = ::lseek(fd_, offset, whence);
+    if (ret == -1 && errno == ENXIO && (mode == seek_mode::data || mode == seek_mode::hole)) {
+        // No data after offset, or offset is past the end
+        ret = ::lseek(fd_, 0, SEEK_END);
+    }
+#endif
+
+    if (ret == -1) {
+        throw_errno_exception(errno);
+    }
+    FILE_STAT(detail::count(stats_, detail::stat::seek_calls);)
+    return ret;
+} 
+
+void raw::sync() const {
+    if (closed()) {
+        throw std::runtime_error("Can't sync closed file.");
+    }
+
+    if (!can_write()) {
+        throw std::runtime_error("File not opened for writing cannot be synced.");
+    }
+
+    FILE_STAT(detail::stat_timer timer(stats_, detail::stat::sync_ns);)
+    FILE_STAT(detail::count(stats_, detail::stat::sync_calls);)
+#ifdef _WIN32
+    bool ret = FlushFileBuffers((HANDLE)_get_osfhandle(fd_));
+    if (!ret) {
+        throw std::runtime_error("Couldn't sync file");
+    }
+#else
+    int ret = ::fsync(fd_);
+    if (ret < 0) {
+        throw_errno_exception(errno);
+    }
+#endif
+}
+
+bool raw::preallocate(int64_t size) const {
+    if (closed()) {
+        throw std::runtime_error("Can't preallocate closed file.");
+    }
+    if (!can_write()) {
+        throw std::runtime_error("File not opened for writing cannot be preallocated.");
+    }
+    if (size <= 0) {
+        return true;
+    }
+#if defined(__linux__)
+    if (::fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size)) == 0) {
+        return true;
+    }
+    if (errno == EOPNOTSUPP || errno == ENOSYS) {
+        return false;
+    }
+    throw_errno_exception(errno);
+    return false;
+#elif defined(__APPLE__)
+    // Allocates past the allocated end, so only ask for what the file doesn't have yet
+    int64_t more = size - current_size();
+    if (more <= 0) {
+        return true;
+    }
+    fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, static_cast<off_t>(more), 0};
+    if (::fcntl(fd_, F_PREALLOCATE, &store) == 0) {
+        return true;
+    }
+    store.fst_flags = F_ALLOCATEALL;
+    return ::fcntl(fd_, F_PREALLOCATE, &store) == 0;
+#elif defined(_WIN32)
+    // A smaller allocation size would cut the file short
+    if (size <= current_size()) {
+        return true;
+    }
+    FILE_ALLOCATION_INFO info;
+    info.AllocationSize.QuadPart = size;
+    return SetFileInformationByHandle((HANDLE)_get_osfhandle(fd_), FileAllocationInfo, &info, sizeof(info)) != 0;
+#else
+    // posix_fallocate would change the size
+    return false;
+#endif
+}
+
+void raw::resize(int64_t size) {
+    if (closed()) {
+        throw std::runtime_error("Can't resize closed file.");
+    }
+#ifdef _WIN32
+    int ret = ::_chsize_s(fd_, size);
+    if (ret != 0) {
+        throw_errno_exception(ret);
+    }
+#else
+    if (::ftruncate(fd_, static_cast<off_t>(size)) < 0) {
+        throw_errno_exception(errno);
+    }
+#endif
+    size_ = size;
+}
+
+void raw::punch_hole(int64_t offset, int64_t len) const {
+    if (closed()) {
+        throw std::runtime_error("Can't punch a hole in closed file.");
+    }
+    if (!can_write()) {
+        throw std::runtime_error("File not opened for writing");
+    }
+    if (len <= 0) {
+        return;
+    }
+#if defined(__linux__)
+    if (::fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(len)) == 0) {
+        return;
+    }
+    if (errno != EOPNOTSUPP && errno != ENOSYS) {
+        throw_errno_exception(errno);
+    }
+#elif defined(F_PUNCHHOLE)
+    fpunchhole_t hole = {0, 0, static_cast<off_t>(offset), static_cast<off_t>(len)};
+    if (::fcntl(fd_, F_PUNCHHOLE, &hole) == 0) {
+        return;
+    }
+#endif
+    // Within the file only, so the size is kept
+    len = (std::min)(len, current_size() - offset);
+    if (len <= 0) {
+        return;
+    }
+    if (mode_ == mode::append) {
+        throw std::runtime_error("Can't write zeros for a hole in append mode");
+    }
+    const size_t zeros_size = 64 * 1024;
+    std::vector<char> zeros(static_cast<size_t>((std::min)(len, static_cast<int64_t>(zeros_size))));
+    for (int64_t done = 0; done < len;) {
+        size_t n = static_cast<size_t>((std::min)(len - done, static_cast<int64_t>(zeros.size())));
+        done += static_cast<int64_t>(write_at(offset + done, zeros.data(), n));
+    }
+}
+
+std::vector<extent> raw::data_extents() const {
+    if (closed()) {
+        throw std::runtime_error("Can't seek closed file.");
+    }
+    int64_t size = current_size();
+    std::vector<extent> extents;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    int64_t pos = tell();
+    for (int64_t offset = 0; offset < size;) {
+        int64_t data = seek(offset, seek_mode::data);
+        if (data >= size) {
+            break;
+        }
+        int64_t hole = (std::min)(seek(data, seek_mode::hole), size);
+        extents.push_back({data, hole - data});
+        offset = hole;
+    }
+    seek(pos, seek_mode::set);
+#else
+    if (size > 0) {
+        extents.push_back({0, size});
+    }
+#endif
+    return extents;
+}
+
+void raw::sync_data() const {
+    if (closed()) {
+        throw std::runtime_error("Can't sync closed file.");
+    }
+
+    if (!can_write()) {
+        throw std::runtime_error("File not opened for writing cannot be synced.");
+    }
+
+    FILE_STAT(detail::stat_timer timer(stats_, detail::stat::sync_ns);)
+    FILE_STAT(detail::count(stats_, detail::stat::sync_calls);)
+#ifdef _WIN32
+    bool ret = FlushFileBuffers((HANDLE)_get_osfhandle(fd_));
+    if (!ret) {
+        throw std::runtime_error("Couldn't sync file");
+    }
+#else
+#if defined(__APPLE__)
+    // Not every filesystem supports it
+    int ret = ::fcntl(fd_, F_FULLFSYNC);
+    if (ret < 0) {
+        ret = ::fsync(fd_);
+    }
+#elif defined(__linux__)
+    int ret = ::fdatasync(fd_);
+#else
+    int ret = ::fsync(fd_);
+#endif
+    if (ret < 0) {
+        throw_errno_exception(errno);
+    }
+#endif
+}
+
+void raw::advise(advice advice, int64_t offset, int64_t len) const {
+    if (closed()) {
+        throw std::runtime_error("Can't advise closed file.");
+    }
+
+#if defined(POSIX_FADV_NORMAL)
+    int adv = POSIX_FADV_NORMAL;
+    switch (advice) {
+        case advice::normal:
+            adv = POSIX_FADV_NORMAL;
+            break;
+        case advice::sequential:
+            adv = POSIX_FADV_SEQUENTIAL;
+            break;
+        case advice::random:
+            adv = POSIX_FADV_RANDOM;
+            break;
+        case advice::willneed:
+            adv = POSIX_FADV_WILLNEED;
+            break;
+        case advice::dontneed:
+            adv = POSIX_FADV_DONTNEED;
+            break;
+    }
+    // Returns the error rather than setting errno
+    int ret = ::posix_fadvise(fd_, static_cast<off_t>(offset), static_cast<off_t>(len), adv);
+    if (ret != 0) {
+        throw_errno_exception(ret);
+    }
+#elif defined(__APPLE__)
+    int ret = 0;
+    switch (advice) {
+        case advice::normal:
+        case advice::sequential:
+            ret = ::fcntl(fd_, F_RDAHEAD, 1);
+            break;
+        case advice::random:
+            ret = ::fcntl(fd_, F_RDAHEAD, 0);
+            break;
+        case advice::willneed: {
+            struct radvisory ra;
+            ra.ra_offset = static_cast<off_t>(offset);
+            int64_t count = (len > 0) ? len : size() - offset;
+            ra.ra_count = static_cast<int>((std::min)(count, static_cast<int64_t>(INT32_MAX)));
+            ret = ::fcntl(fd_, F_RDADVISE, &ra);
+            break;
+        }
+        case advice::dontneed:
+            break;
+    }
+    if (ret < 0) {
+        throw_errno_exception(errno);
+    }
+#else
+    (void)advice;
+    (void)offset;
+    (void)len;
+#endif
+}
+
+int64_t raw::size() const {
+    if (size_ < 0) {
+        run_stat();
+    }
+    return size_;
+}
+
+int64_t raw::block_size() const {
+    if (block_size_ < 0) {
+        run_stat();
+    }
+    return block_size_;
+}
+
+int raw::fd() const {
+    return fd_;
+}
+
+bool raw::direct() const {
+    return direct_;
+}
+
+void raw::set_direct(bool direct) {
+    if (closed()) {
+        throw std::runtime_error("Can't change direct I/O on closed file.");
+    }
+    if (direct == direct_) {
+        return;
+    }
+
+#if defined(O_DIRECT)
+    int flags = ::fcntl(fd_, F_GETFL);
+    flags = direct ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+    if (flags < 0 || ::fcntl(fd_, F_SETFL, flags) < 0) {
+        throw_errno_exception(errno);
+    }
+#elif defined(__APPLE__)
+    if (::fcntl(fd_, F_NOCACHE, direct ? 1 : 0) < 0) {
+        throw_errno_exception(errno);
+    }
+#else
+    throw std::runtime_error("Can't change direct I/O on an open file on this platform.");
+#endif
+    direct_ = direct;
+}
+
+io_stats raw::stats() const {
+#ifdef FILE_STATS
+    return stats_.snapshot();
+#else
+    return {};
+#endif
+}
+
+int64_t raw::current_size() const {
+#ifdef _WIN32 
+    struct _stat st;
+    int ret = ::_fstat(fd_, &st);
+#else
+    struct stat st;
+    int ret = ::fstat(fd_, &st);
+#endif
+    if (ret < 0) {
+        throw_errno_exception(errno);
+    }
+    return st.st_size;
+}
+
+void raw::run_stat() const {
+    if (fd_ < 0) {
+        throw std::runtime_error("Can't stat closed file.");
+    }
+
+#ifdef _WIN32 
+    struct _stat st;
+    int ret = ::_fstat(fd_, &st);
+#else
+    struct stat st;
+    int ret = ::fstat(fd_, &st);
+#endif
+    if (ret < 0) {
+        throw_errno_exception(errno);
+    }
+
+    if (size_ < 0) {
+        size_ = st.st_size;
+    }
+#ifdef _WIN32
+    block_size_ = 4096;
+#else
+    block_size_ = st.st_blksize;
+#endif
+}
+
+inline void replace(const std::string& path, std::string_view contents, const options& opts) {
+    options replace_opts = opts;
+    replace_opts.atomic_replace = true;
+    raw f(path, mode::write, replace_opts);
+    size_t written = 0;
+    while (written < contents.size()) {
+        written += f.write(contents.data() + written, contents.size() - written);
+    }
+    f.close();
+}
+
+inline int64_t copy(const std::string& src, const std::string& dst) {
+#ifdef _WIN32
+    if (!CopyFileA(src.c_str(), dst.c_str(), FALSE)) {
+        throw std::runtime_error("Couldn't copy file");
+    }
+    return raw(dst, mode::read).size();
+#else
+    raw in(src, mode::read);
+    // Opening dst truncates it, which would lose the data of src if they're the same file
+    struct stat src_st;
+    struct stat dst_st;
+    if (::fstat(in.fd(), &src_st) == 0 && ::stat(dst.c_str(), &dst_st) == 0 &&
+        src_st.st_dev == dst_st.st_dev && src_st.st_ino == dst_st.st_ino) {
+        throw std::runtime_error("Can't copy a file onto itself");
+    }
+    raw out(dst, mode::write);
+#ifdef FICLONE
+    if (::ioctl(out.fd(), FICLONE, in.fd()) == 0) {
+        return in.size();
+    }
+#endif
+    int64_t size = in.size();
+    // Only the extents holding data are copied so a sparse file stays sparse
+    std::vector<extent> extents = in.data_extents();
+    if (extents.size() == 1 && extents[0].offset == 0 && extents[0].length == size) {
+        out.preallocate(size);
+    }
+    for (const extent& e : extents) {
+        out.seek(e.offset, seek_mode::set);
+        for (int64_t done = 0; done < e.length;) {
+            size_t n = in.transfer_to(out, e.offset + done, static_cast<size_t>(e.length - done));
+            if (n == 0) {
+                // The file shrank while copying
+                return e.offset + done;
+            }
+            done += static_cast<int64_t>(n);
+        }
+    }
+    // Holes at the end aren't written
+    out.resize(size);
+    return size;
+#endif
+}
+
+inline batch read_all(const std::vector<std::string>& paths, size_t nthreads, const options& opts) {
+    options raw_opts = opts;
+    raw_opts.direct = false;
+
+    // Threads take runs of paths and read them back to back into a buffer per run, which are 
+    // joined in order at the end. Files are only open while being read, so any number fit.
+    const size_t run = 16;
+    const size_t nruns = (paths.size() + run - 1) / run;
+    std::vector<std::string> bufs(nruns);
+    std::vector<std::pair<size_t, size_t>> spans(paths.size()); // offset and size within its run
+    batch b;
+    b.errors.resize(paths.size());
+
+    auto read_run = [&](size_t r) {
+        std::string& buf = bufs[r];
+        for (size_t i = r * run; i < (std::min)((r + 1) * run, paths.size()); i++) {
+            size_t start = buf.size();
+            try {
+                raw f(paths[i], mode::read, raw_opts);
+                // One more than the size so a file that's still that size is read in one call
+                size_t want = (std::max)(static_cast<size_t>(f.size()) + 1, static_cast<size_t>(4096));
+                size_t n = 0;
+                while (true) {
+                    detail::resize_uninitialized(buf, start + n + want);
+                    size_t got = f.read(&buf[start + n], want);
+                    n += got;
+                    if (got < want) {
+                        break;
+                    }
+                    want *= 2;
+                }
+                buf.resize(start + n);
+                spans[i] = {start, n};
+            } catch (const std::exception& e) {
+                buf.resize(start);
+                b.errors[i] = e.what();
+                if (b.errors[i].empty()) {
+                    b.errors[i] = "Couldn't read file";
+                }
+            }
+        }
+    };
+
+    if (nthreads == 0) {
+        nthreads = (std::max)(std::thread::hardware_concurrency(), 1u);
+    }
+    nthreads = (std::min)(nthreads, nruns);
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < nthreads; t++) {
+        threads.emplace_back([&] {
+            for (size_t r = next++; r < nruns; r = next++) {
+                read_run(r);
+            }
+        });
+    }
+    for (size_t r = next++; r < nruns; r = next++) {
+        read_run(r);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    size_t total = 0;
+    for (const std::string& buf : bufs) {
+        total += buf.size();
+    }
+    b.data.resize(total);
+    std::vector<size_t> run_offsets(nruns);
+    size_t offset = 0;
+    for (size_t r = 0; r < nruns; r++) {
+        run_offsets[r] = offset;
+        if (!bufs[r].empty()) {
+            memcpy(b.data.data() + offset, bufs[r].data(), bufs[r].size());
+        }
+        offset += bufs[r].size();
+        std::string().swap(bufs[r]);
+    }
+    b.contents.resize(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (spans[i].second > 0) {
+            b.contents[i] = {b.data.data() + run_offsets[i / run] + spans[i].first, spans[i].second};
+        }
+    }
+    return b;
+}
+
+file::file(const std::string& path, enum mode mode, const options& opts) : 
+file_(path, mode, opts),
+opts_(opts),
+pool_(opts.pool),
+adaptive_(opts.adaptive_buffer),
+max_buf_cap_(opts.max_buffer_size) {
+    start(mode);
+    init_buffer();
+}
+
+void file::start(enum mode mode) {
+    pos_ = (mode == mode::append) ? file_.size() : 0;
+    buf_size_ = 0;
+    buf_i_ = 0;
+    dropped_ = 0;
+    line_.clear();
+    dontneed_ = opts_.dontneed_after_read && mode == mode::read;
+    align_ = 1;
+    if (file_.direct()) {
+        int64_t block_s = file_.block_size();
+        align_ = (block_s > 0) ? static_cast<size_t>(block_s) : 4096;
+    }
+    if (mode == mode::read && opts_.decompress != compression::none) {
+        if (file_.direct()) {
+            throw std::runtime_error("Can't decompress a direct file");
+        }
+        size_t chunk_size = (std::max)(opts_.buffer_size, static_cast<size_t>(256 * 1024));
+        decoder_ = detail::make_decoder(file_, opts_.decompress, opts_.decompress_ahead, chunk_size);
+        // Offsets count decompressed bytes so they can't be dropped from the page cache
+        dontneed_ = dontneed_ && !decoder_;
+    }
+}
+
+void file::init_buffer() {
+    if (opts_.buffer) {
+        if (opts_.buffer_size == 0) {
+            throw std::runtime_error("A caller owned buffer needs a buffer_size");
+        }
+        if (!aligned(opts_.buffer, 0) || opts_.buffer_size % align_ != 0) {
+            throw std::runtime_error("A caller owned buffer for direct I/O must be aligned to the block size");
+        }
+        buffer_ = opts_.buffer;
+        buf_cap_ = opts_.buffer_size;
+        owns_buffer_ = false;
+        return;
+    }
+
+    owns_buffer_ = true;
+    if (opts_.buffer_size > 0) {
+        buf_cap_ = opts_.buffer_size;
+    } else {
+        int64_t block_s = file_.block_size();
+        buf_cap_ = (block_s > 0) ? static_cast<size_t>(block_s) : 4096;
+    }
+    // Round up to whole blocks for direct I/O
+    buf_cap_ = (buf_cap_ + align_ - 1) / align_ * align_;
+    buffer_ = alloc_buffer(buf_cap_);
+    if (!buffer_) {
+        throw std::bad_alloc();
+    }
+}
+
+void file::reopen(const std::string& path, enum mode mode) {
+    close();
+    file_ = raw(path, mode, opts_);
+    size_t old_align = align_;
+    start(mode);
+    if (buffer_ && align_ != old_align) {
+        // A direct file on a filesystem with another block size
+        size_t new_align = align_;
+        align_ = old_align;
+        free_buffer();
+        align_ = new_align;
+    }
+    if (!buffer_) {
+        init_buffer();
+    }
+}
+
+file::file(file&& other) : 
+file_(std::move(other.file_)),
+opts_(other.opts_),
+buffer_(other.buffer_),
+owns_buffer_(other.owns_buffer_),
+pool_(other.pool_),
+adaptive_(other.adaptive_),
+max_buf_cap_(other.max_buf_cap_),
+buf_cap_(other.buf_cap_),
+buf_size_(other.buf_size_),
+buf_i_(other.buf_i_),
+pos_(other.pos_),
+dontneed_(other.dontneed_),
+dropped_(other.dropped_),
+align_(other.align_),
+line_(std::move(other.line_)),
+decoder_(std::move(other.decoder_)) {
+    FILE_STAT(stats_ = other.stats_;)
+    other.buffer_ = nullptr;
+    other.buf_cap_ = 0;
+    other.buf_size_ = 0;
+    other.buf_i_ = 0;
+}
+
+file& file::operator=(file&& other) {
+    if (this != &other) {
+        this->close();
+        free_buffer();
+
+        file_ = std::move(other.file_);
+        opts_ = other.opts_;
+        buffer_ = other.buffer_;
+        owns_buffer_ = other.owns_buffer_;
+        pool_ = other.pool_;
+        adaptive_ = other.adaptive_;
+        max_buf_cap_ = other.max_buf_cap_;
+        buf_cap_ = other.buf_cap_;
+        buf_size_ = other.buf_size_;
+        buf_i_ = other.buf_i_;
+        pos_ = other.pos_;
+        dontneed_ = other.dontneed_;
+        dropped_ = other.dropped_;
+        align_ = other.align_;
+        line_ = std::move(other.line_);
+        decoder_ = std::move(other.decoder_);
+        FILE_STAT(stats_ = other.stats_;)
+
+        other.buffer_ = nullptr;
+        other.buf_cap_ = 0;
+        other.buf_size_ = 0;
+        other.buf_i_ = 0;
+    }
+    return *this;
+}
+
+file::~file() {
+    try {
+        close();
+    } catch (const std::exception&) {
+        // Only a failed flush or atomic_replace throws, and close has closed the file either way
+    }
+    free_buffer();
+}
+
+bool file::can_read() const {
+    return file_.can_read();
+}
+
+bool file::can_write() const {
+    return file_.can_write();
+}
+
+mode file::mode() const {
+    return file_.mode();
+}
+
+size_t file::read(void* buffer, size_t count) {
+    if (closed()) {
+        throw std::runtime_error("Can't read from closed file");
+    }
+    if (mode() != mode::read) {
+        throw std::runtime_error("File not opened for reading");
+    }
+
+    char* out = static_cast<char*>(buffer);
+    size_t read = 0;
+    while (true) {
+        size_t available = buf_size_ - buf_i_;
+        size_t copy_size = (std::min)(count - read, available);
+
+        memcpy(out + read, buffer_ + buf_i_, copy_size);
+        FILE_STAT(detail::count(stats_, detail::stat::bytes_copied, copy_size);)
+        buf_i_ += copy_size;
+        read += copy_size;
+
+        if (read == count) {
+            return read;
+        }
+
+        // Requests at least as big as the buffer bypass it and go straight to the caller's memory
+        if (count - read >= buf_cap_ && aligned(out + read, pos_)) {
+            // The buffered window is used up and would no longer end at pos_, so seeks can't use it
+            buf_i_ = 0;
+            buf_size_ = 0;
+        }
+        while (count - read >= buf_cap_ && aligned(out + read, pos_)) {
+            size_t n = decoder_ ? decoder_->decode(out + read, count - read) : 
+                                  file_.read(out + read, (count - read) / align_ * align_);
+            if (n == 0) {
+                drop_behind(true);
+                return read;
+            }
+            pos_ += static_cast<int64_t>(n);
+            read += n;
+        }
+        drop_behind(false);
+        if (read == count) {
+            return read;
+        }
+
+        refill();
+
+        if (buf_size_ == 0) {
+            return read;
+        }
+    }
+}
+
+std::string file::read(int64_t count) {
+    if (closed()) {
+        throw std::runtime_error("Can't read from closed file");
+    }
+    if (mode() != mode::read) {
+        throw std::runtime_error("File not opened for reading");
+    }
+
+    std::string ret;
+    if (count < 0) {
+        read_into(ret);
+        return ret;
+    }
+
+    detail::resize_uninitialized(ret, static_cast<size_t>(count));
+    ret.resize(read(ret.data(), ret.size()));
+    return ret;
+}
+
+std::vector<uint8_t> file::read_bytes(int64_t count) {
+    if (closed()) {
+        throw std::runtime_error("Can't read from closed file");
+    }
+    if (mode() != mode::read) {
+        throw std::runtime_error("File not opened for reading");
+    }
+
+    std::vector<uint8_t> ret;
+    if (count < 0) {
+        read_into(ret);
+        return ret;
+    }
+
+    ret.resize(static_cast<size_t>(count));
+    ret.resize(read(ret.data(), ret.size()));
+    return ret;
+}
+
+size_t file::readv(const mutable_buffer* buffers, size_t count) {
+    if (closed()) {
+        throw std::runtime_error("Can't read from closed file");
+    }
+    if (mode() != mode::read) {
+        throw std::runtime_error("File not opened for reading");
+    }
+
+    // Use up buffered bytes first
+    size_t read = 0;
+    size_t i = 0;
+    size_t first_offset = 0;
+    size_t remaining = 0;
+    for (size_t j = 0; j < count; j++) {
+        remaining += buffers[j].size;
+    }
+    while (i < count && buf_i_ < buf_size_) {
+        size_t copy_size = (std::min)(buffers[i].size - first_offset, buf_size_ - buf_i_);
+        memcpy(static_cast<char*>(buffers[i].data) + first_offset, buffer_ + buf_i_, copy_size);
+        buf_i_ += copy_size;
+        first_offset += copy_size;
+        read += copy_size;
+        remaining -= copy_size;
+        if (first_offset == buffers[i].size) {
+            i++;
+            first_offset = 0;
+        }
+    }
+
+    if (remaining < buf_cap_ || align_ > 1 || decoder_) {
+        // Small reads go through the buffer
+        for (; i < count; i++) {
+            size_t want = buffers[i].size - first_offset;
+            size_t n = this->read(static_cast<char*>(buffers[i].data) + first_offset, want);
+            read += n;
+            first_offset = 0;
+            if (n < want) {
+                break;
+            }
+        }
+        return read;
+    }
+
+    std::vector<mutable_buffer> parts(buffers + i, buffers + count);
+    if (!parts.empty()) {
+        parts[0].data = static_cast<char*>(parts[0].data) + first_offset;
+        parts[0].size -= first_offset;
+        // Reading past the used up buffer leaves no window for seeks to move within
+        buf_i_ = 0;
+        buf_size_ = 0;
+    }
+    size_t p = 0;
+    while (p < parts.size()) {
+        size_t n = file_.readv(parts.data() + p, parts.size() - p);
+        if (n == 0) {
+            break;
+        }
+        pos_ += static_cast<int64_t>(n);
+        read += n;
+        // Skip past what was read, which may end partway through a buffer
+        while (n > 0) {
+            size_t part = (std::min)(n, parts[p].size);
+            parts[p].data = static_cast<char*>(parts[p].data) + part;
+            parts[p].size -= part;
+            n -= part;
+            if (parts[p].size == 0) {
+                p++;
+            }
+        }
+        while (p < parts.size() && parts[p].size == 0) {
+            p++;
+        }
+    }
+    return read;
+}
+
+size_t file::readv(std::initializer_list<mutable_buffer> buffers) {
+    return readv(buffers.begin(), buffers.size());
+}
+
+size_t file::read_at(int64_t offset, void* buffer, size_t count) const {
+    if (closed()) {
+        throw std::runtime_error("Can't read from closed file");
+    }
+    if (mode() != mode::read) {
+        throw std::runtime_error("File not opened for reading");
+    }
+    if (decoder_) {
+        throw std::runtime_error("Can't read_at in a compressed file");
+    }
+    return file_.read_at(offset, buffer, count);
+}
+
+size_t file::read_into(std::string& str) {
+    return read_remaining_into(str);
+}
+
+size_t file::read_into(std::vector<uint8_t>& vec) {
+    return read_remaining_into(vec);
+}
+
+template <class Container>
+size_t file::read_remaining_into(Container& c) {
+    if (closed()) {
+        throw std::runtime_error("Can't read from closed file");
+    }
+    if (mode() != mode::read) {
+        throw std::runtime_error("File not opened for reading");
+    }
+
+    if (decoder_) {
+        // The decompressed size isn't known up front, grow by at least a buffer at a time
+        size_t n = 0;
+        detail::resize_uninitialized(c, (std::max)(c.capacity(), buf_cap_));
+        while (true) {
+            if (c.size() - n < buf_cap_) {
+                detail::resize_uninitialized(c, (std::max)(c.size() * 2, n + buf_cap_));
+            }
+            size_t want = c.size() - n;
+            size_t got = read(c.data() + n, want);
+            n += got;
+            if (got < want) {
+                break;
+            }
+        }
+        c.resize(n);
+        return n;
+    }
+
+    int64_t count = size() - tell();
+    if (count < 0) {
+        throw std::runtime_error("File offset beyond end of file");
+    }
+
+    // Size the destination once. Shrinking or growing within capacity doesn't reallocate.
+    detail::resize_uninitialized(c, static_cast<size_t>(count));
+    c.resize(read(c.data(), c.size()));
+    return c.size();
+}
+
+size_t file::read_into_capacity(std::vector<uint8_t>& vec) {
+    if (closed()) {
+        throw std::runtime_error("Can't read from closed file");
+    }
+    if (mode() != mode::read) {
+        throw std::runtime_error("File not opened for reading");
+    }
+
+    size_t read = 0;
+    while (true) {
+        size_t available = buf_size_ - buf_i_;
+        size_t copy_size = (std::min)(vec.capacity() - vec.size(), available);
+
+        vec.insert(vec.end(), buffer_ + buf_i_, buffer_ + buf_i_ + copy_size);
+        FILE_STAT(detail::count(stats_, detail::stat::bytes_copied, copy_size);)
+        buf_i_ += copy_size;
+        read += copy_size;
+
+        if (vec.capacity() == vec.size()) {
+            return read;
+        }
+
+        refill();
+
+        if (buf_size_ == 0) {
+            return read;
+        }
+    }
+}
+
+bool file::read_line(std::string& line) {
+    if (closed()) {
+        throw std::runtime_error("Can't read from closed file");
+    }
+    if (mode() != mode::read) {
+        throw std::runtime_error("File not opened for reading");
+    }
+
+    line.clear();
+
+    while(true) {
+        const char* start = buffer_ + buf_i_;
+        const char* end = buffer_ + buf_size_;
+        const char* nl = detail::find_byte(start, end, '\n');
+        line.append(start, nl - start);
+        FILE_STAT(detail::count(stats_, detail::stat::bytes_copied, static_cast<uint64_t>(nl - start));)
+
+        if (nl != end) {
+            buf_i_ = (nl - buffer_) + 1;
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            FILE_STAT(detail::count(stats_, detail::stat::lines);)
+            return true;
+        }
+
+        refill();
+
+        if (buf_size_ == 0) {
+            FILE_STAT(detail::count(stats_, detail::stat::lines, line.empty() ? 0 : 1);)
+            return !line.empty();
+        }
+    }
+}
+
+bool file::read_line_view(std::string_view& line) {
+    bool found = read_delimited(line, 1, [](const char* begin, const char* end) {
+        return detail::find_byte(begin, end, '\n');
+    });
+    // A line that ended at the end of the file keeps its '\r' like with read_line. Only then is the 
+    // buffer empty, a newline was taken from it otherwise.
+    if (buf_size_ != 0 && !line.empty() && line.back() == '\r') {
+        // Lines that crossed a refill point into line_, the rest into the buffer, neither of which
+        // is read again before the next read so just shorten the view
+        line.remove_suffix(1);
+    }
+    return found;
+}
+
+bool file::read_until(std::string_view& record, std::string_view delim) {
+    if (delim.empty()) {
+        throw std::runtime_error("Can't read until an empty delimiter");
+    }
+    if (delim.size() == 1) {
+        char c = delim[0];
+        return read_delimited(record, 1, [c](const char* begin, const char* end) {
+            return detail::find_byte(begin, end, c);
+        });
+    }
+    return read_delimited(record, delim.size(), [delim](const char* begin, const char* end) {
+        return detail::find_bytes(begin, end, delim);
+    });
+}
+
+template <class Find>
+bool file::read_delimited(std::string_view& record, size_t delim_size, Find find) {
+    if (closed()) {
+        throw std::runtime_error("Can't read from closed file");
+    }
+    if (mode() != mode::read) {
+        throw std::runtime_error("File not opened for reading");
+    }
+
+    // Fast path: the whole record is already buffered, hand out a view of it
+    const char* start = buffer_ + buf_i_;
+    const char* end_p = buffer_ + buf_size_;
+    const char* found = find(start, end_p);
+    if (found != end_p) {
+        record = std::string_view(start, found - start);
+        buf_i_ += (found - start) + delim_size;
+        FILE_STAT(detail::count(stats_, detail::stat::lines);)
+        return true;
+    }
+
+    // Slow path: the record crosses a buffer refill, stitch it together in line_
+    line_.assign(start, end_p - start);
+    buf_i_ = buf_size_;
+    while (true) {
+        refill();
+
+        if (buf_size_ == 0) {
+            record = line_;
+            FILE_STAT(detail::count(stats_, detail::stat::lines, line_.empty() ? 0 : 1);)
+            return !line_.empty();
+        }
+
+        start = buffer_ + buf_i_;
+        end_p = buffer_ + buf_size_;
+        if (delim_size > 1 && !line_.empty()) {
+            // Look for a delimiter that straddles the refill
+            size_t prev = line_.size();
+            size_t tail = (std::min)(prev, delim_size - 1);
+            size_t head = (std::min)(static_cast<size_t>(end_p - start), delim_size - 1);
+            line_.append(start, head);
+            const char* joint = line_.data() + prev - tail;
+            const char* in_joint = find(joint, line_.data() + line_.size());
+            if (in_joint != line_.data() + line_.size() && in_joint < line_.data() + prev) {
+                size_t at = in_joint - line_.data();
+                buf_i_ += at + delim_size - prev;
+                line_.resize(at);
+                record = line_;
+                FILE_STAT(detail::count(stats_, detail::stat::lines);)
+                return true;
+            }
+            line_.resize(prev);
+        }
+
+        found = find(start, end_p);
+        if (found == end_p) {
+            line_.append(start, end_p - start);
+            buf_i_ = buf_size_;
+            continue;
+        }
+
+        line_.append(start, found - start);
+        buf_i_ = (found - buffer_) + delim_size;
+        record = line_;
+        FILE_STAT(detail::count(stats_, detail::stat::lines);)
+        return true;
+    }
+}
+
+bool file::read_fixed(std::string_view& record, size_t count) {
+    if (closed()) {
+        throw std::runtime_error("Can't read from closed file");
+    }
+    if (mode() != mode::read) {
+        throw std::runtime_error("File not opened for reading");
+    }
+
+    const char* start = buffer_ + buf_i_;
+    size_t available = buf_size_ - buf_i_;
+    if (available >= count) {
+        record = std::string_view(start, count);
+        buf_i_ += count;
+        FILE_STAT(detail::count(stats_, detail::stat::lines, count > 0 ? 1 : 0);)
+        return count > 0;
+    }
+
+    line_.assign(start, available);
+    buf_i_ = buf_size_;
+    while (line_.size() < count) {
+        refill();
+        if (buf_size_ == 0) {
+            break;
+        }
+        size_t n = (std::min)(count - line_.size(), buf_size_ - buf_i_);
+        line_.append(buffer_ + buf_i_, n);
+        buf_i_ += n;
+    }
+    record = line_;
+    FILE_STAT(detail::count(stats_, detail::stat::lines, line_.empty() ? 0 : 1);)
+    return !line_.empty();
+}
+
+bool file::read_record(std::vector<std::string_view>& fields, char delim, quoting q) {
+    if (closed()) {
+        throw std::runtime_error("Can't read from closed file");
+    }
+    if (mode() != mode::read) {
+        throw std::runtime_error("File not opened for reading");
+    }
+
+    char* start = buffer_ + buf_i_;
+    char* end_p = buffer_ + buf_size_;
+    bool in_quotes = false;
+    if (q == quoting::none) {
+        // Fast path: find delimiters and the newline in one pass over the buffered bytes
+        fields.clear();
+        char* p = start;
+        while (true) {
+            char* found = const_cast<char*>(detail::find_either_byte(p, end_p, delim, '\n'));
+            if (found == end_p) {
+                break;
+            }
+            if (*found == delim) {
+                fields.emplace_back(p, found - p);
+                p = found + 1;
+                continue;
+            }
+            size_t len = found - p;
+            len -= (len > 0 && p[len - 1] == '\r') ? 1 : 0;
+            fields.emplace_back(p, len);
+            buf_i_ = (found - buffer_) + 1;
+            FILE_STAT(detail::count(stats_, detail::stat::lines);)
+            return true;
+        }
+    } else {
+        char* nl = const_cast<char*>(detail::find_record_end(start, end_p, q, in_quotes));
+        if (nl != end_p) {
+            buf_i_ = (nl - buffer_) + 1;
+            nl -= (nl != start && nl[-1] == '\r') ? 1 : 0;
+            if (detail::find_byte(start, nl, '"') == nl) {
+                // Nothing to unescape, so the fields can point into the buffer
+                detail::split_record(start, nl, delim, q, fields);
+            } else {
+                // Unescaping writes, and the buffer must stay as read for seeks back into it
+                line_.assign(start, nl - start);
+                detail::split_record(&line_[0], &line_[0] + line_.size(), delim, q, fields);
+            }
+            FILE_STAT(detail::count(stats_, detail::stat::lines);)
+            return true;
+        }
+    }
+
+    // Slow path: the record crosses a buffer refill, stitch it together in line_ and split that
+    line_.assign(start, end_p - start);
+    buf_i_ = buf_size_;
+    while (true) {
+        refill();
+
+        if (buf_size_ == 0) {
+            if (line_.empty()) {
+                fields.clear();
+                return false;
+            }
+            break;
+        }
+
+        start = buffer_ + buf_i_;
+        end_p = buffer_ + buf_size_;
+        const char* nl = detail::find_record_end(start, end_p, q, in_quotes);
+        line_.append(start, nl - start);
+        if (nl == end_p) {
+            buf_i_ = buf_size_;
+            continue;
+        }
+        buf_i_ = (nl - buffer_) + 1;
+        // Like lines, only a record ended by a newline loses a '\r' before it
+        if (!line_.empty() && line_.back() == '\r') {
+            line_.pop_back();
+        }
+        break;
+    }
+    detail::split_record(&line_[0], &line_[0] + line_.size(), delim, q, fields);
+    FILE_STAT(detail::count(stats_, detail::stat::lines);)
+    return true;
+}
+
+size_t file::write(const void* buffer, size_t count) {
+    if (closed()) {
+        throw std::runtime_error("Can't write to closed file");
+    }
+    if (mode() != mode::write && mode() != mode::append) {
+        throw std::runtime_error("File not opened for writing");
+    }
+
+    // Fast path: small writes that fit are just copied, most log records take this path
+    if (count < buf_cap_ - buf_i_) {
+        memcpy(buffer_ + buf_i_, buffer, count);
+        buf_i_ += count;
+        return count;
+    }
+
+    // Writes at least as big as the buffer bypass it and go straight to the file
+    if (count >= buf_cap_ && align_ == 1) {
+        flush();
+        write_direct(static_cast<const char*>(buffer), count);
+        return count;
+    }
+
+    size_t written = 0;
+    while (written != count) {
+        size_t cap_remaining = buf_cap_ - buf_i_;
+        size_t copy_size = (std::min)(count - written, cap_remaining);
+        memcpy(buffer_ + buf_i_, static_cast<const char*>(buffer) + written, copy_size);
+        buf_i_ += copy_size;
+        written += copy_size;
+
+        if (buf_i_ == buf_cap_) {
+            flush();
+            if (adaptive_) {
+                grow_buffer();
+            }
+        }
+    }
+    return written;
+}
+
+size_t file::write(std::string_view sv) {
+    return write(sv.data(), sv.size());
+}
+
+size_t file::write(const std::string_view* fragments, size_t count) {
+    if (closed()) {
+        throw std::runtime_error("Can't write to closed file");
+    }
+    if (mode() != mode::write && mode() != mode::append) {
+        throw std::runtime_error("File not opened for writing");
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += fragments[i].size();
+    }
+    // Small writes are cheaper to copy into the buffer. Direct I/O needs the aligned buffer.
+    if (total <= buf_cap_ - buf_i_ || align_ > 1) {
+        for (size_t i = 0; i < count; i++) {
+            write(fragments[i].data(), fragments[i].size());
+        }
+        return total;
+    }
+
+    std::vector<std::string_view> parts;
+    parts.reserve(count + 1);
+    if (buf_i_ > 0) {
+        parts.emplace_back(buffer_, buf_i_);
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!fragments[i].empty()) {
+            parts.push_back(fragments[i]);
+        }
+    }
+
+    size_t i = 0;
+    while (i < parts.size()) {
+        size_t n = file_.writev(parts.data() + i, parts.size() - i);
+        if (n == 0) {
+            throw std::runtime_error("Couldn't write to file");
+        }
+        pos_ += static_cast<int64_t>(n);
+        // Skip past what was written, which may end partway through a fragment
+        while (n > 0) {
+            size_t part = (std::min)(n, parts[i].size());
+            parts[i].remove_prefix(part);
+            n -= part;
+            if (parts[i].empty()) {
+                i++;
+            }
+        }
+    }
+    buf_i_ = 0;
+    return total;
+}
+
+size_t file::write(std::initializer_list<std::string_view> fragments) {
+    return write(fragments.begin(), fragments.size());
+}
+
+void file::flush() {
+    if (closed()) {
+        throw std::runtime_error("Can't flush to closed file");
+    }
+    if (mode() != mode::write && mode() != mode::append) {
+        throw std::runtime_error("File not opened for writing");
+    }
+
+    if (align_ > 1) {
+        flush_direct();
+    } else if (buf_i_ > 0) {
+        write_direct(buffer_, buf_i_);
+        buf_i_ = 0; 
+    }
+}
+
+void file::flush_direct() {
+    if (buf_i_ == 0) {
+        return;
+    }
+
+    if (!aligned(buffer_, pos_)) {
+        // After a seek to an unaligned offset write through the page cache
+        file_.set_direct(false);
+        write_direct(buffer_, buf_i_);
+        file_.set_direct(true);
+        buf_i_ = 0;
+        return;
+    }
+
+    size_t whole = buf_i_ / align_ * align_;
+    size_t tail = buf_i_ - whole;
+    write_direct(buffer_, whole);
+    if (tail == 0) {
+        buf_i_ = 0;
+        return;
+    }
+
+    // Write the unaligned tail through the page cache but keep it buffered and rewind so the next 
+    // flush rewrites its whole block with direct I/O
+    file_.set_direct(false);
+    write_direct(buffer_ + whole, tail);
+    file_.set_direct(true);
+    memmove(buffer_, buffer_ + whole, tail);
+    buf_i_ = tail;
+    pos_ = file_.seek(pos_ - static_cast<int64_t>(tail), seek_mode::set);
+}
+
+void file::write_direct(const char* data, size_t count) {
+    size_t written = 0;
+    while (written != count) {
+        size_t n = file_.write(data + written, count - written);
+        if (n == 0) {
+            throw std::runtime_error("Couldn't write to file");
+        }
+        pos_ += static_cast<int64_t>(n);
+        written += n;
+    }
+}
+
+void file::close() {
+    if (can_write()) {
+        try {
+            flush();
+        } catch (...) {
+            // Don't let an atomic_replace go ahead without the bytes that didn't make it out
+            file_.discard();
+            throw;
+        }
+    }
+    // Stop any background decoding before its file descriptor is closed
+    decoder_.reset();
+    file_.close();
+}
+
+bool file::closed() const {
+    return file_.closed();
+}
+
+int64_t file::seek(int64_t offset, seek_mode mode) {
+    if (closed()) {
+        throw std::runtime_error("Can't seek closed file.");
+    }
+
+    if (can_write()) {
+        flush();
+    } else if (mode == seek_mode::set || mode == seek_mode::cur) {
+        // Seeking within the buffered window just moves the read pointer
+        int64_t target = (mode == seek_mode::set) ? offset : tell() + offset;
+        int64_t window_start = pos_ - static_cast<int64_t>(buf_size_);
+        if (target >= window_start && target <= pos_) {
+            buf_i_ = static_cast<size_t>(target - window_start);
+            return target;
+        }
+        offset = target;
+        mode = seek_mode::set;
+    }
+    if (decoder_) {
+        throw std::runtime_error("Can't seek outside the buffer of a compressed file");
+    }
+
+    pos_ = file_.seek(offset, mode);
+    buf_i_ = 0;
+    buf_size_ = 0;
+    return pos_;
+}
+
+int64_t file::tell() const {
+    if (closed()) {
+        throw std::runtime_error("Can't tell closed file.");
+    }
+    if (mode() == mode::append) {
+        // Appends land wherever the end of the file is, which other writers may have moved
+        return file_.seek(0, seek_mode::end) + static_cast<int64_t>(buf_i_);
+    }
+    // pos_ is just past the buffered window when reading and at the start of it when writing
+    return pos_ - static_cast<int64_t>(buf_size_) + static_cast<int64_t>(buf_i_);
+}
+
+void file::sync() const {
+    file_.sync();
+}
+
+void file::sync_data() const {
+    file_.sync_data();
+}
+
+int64_t file::size() const {
+    return file_.size();
+}
+
+int64_t file::block_size() const {
+    return file_.block_size();
+}
+
+size_t file::buffer_size() const {
+    return buf_cap_;
+}
+
+io_stats file::stats() const {
+    io_stats st = file_.stats();
+#ifdef FILE_STATS
+    st.refills = stats_.get(detail::stat::refills);
+    st.bytes_copied = stats_.get(detail::stat::bytes_copied);
+    st.lines = stats_.get(detail::stat::lines);
+#endif
+    return st;
+}
+
+void file::refill() {
+    FILE_STAT(detail::count(stats_, detail::stat::refills);)
+    // A full buffer that was used up means the file is being read sequentially
+    if (adaptive_ && buf_size_ == buf_cap_) {
+        grow_buffer();
+    }
+    if (decoder_) {
+        buf_size_ = decoder_->decode(buffer_, buf_cap_);
+        buf_i_ = 0;
+        pos_ += static_cast<int64_t>(buf_size_);
+        return;
+    }
+    // Direct reads must start on a block boundary, which after a seek pos_ may not be on
+    size_t skip = static_cast<size_t>(pos_ % static_cast<int64_t>(align_));
+    if (skip) {
+        pos_ = file_.seek(pos_ - static_cast<int64_t>(skip), seek_mode::set);
+    }
+    buf_size_ = file_.read(buffer_, buf_cap_);
+    buf_i_ = skip;
+    pos_ += static_cast<int64_t>(buf_size_);
+    if (skip && buf_size_ <= skip) {
+        // Nothing past the current position so this is end of file. The next refill seeks again.
+        pos_ += static_cast<int64_t>(skip - buf_size_);
+        buf_size_ = 0;
+        buf_i_ = 0;
+    }
+    drop_behind(buf_size_ == 0);
+}
+
+void file::drop_behind(bool eof) {
+    // Batch the advice so small buffers don't double the number of system calls
+    constexpr int64_t drop_chunk = 1024 * 1024;
+    if (dontneed_ && (pos_ - dropped_ >= drop_chunk || (eof && pos_ > dropped_))) {
+        file_.advise(advice::dontneed, dropped_, pos_ - dropped_);
+        dropped_ = pos_;
+    }
+}
+
+void file::grow_buffer() {
+    if (!owns_buffer_ || buf_cap_ >= max_buf_cap_) {
+        return;
+    }
+    size_t new_cap = (std::min)(buf_cap_ * 2, max_buf_cap_) / align_ * align_;
+    if (new_cap <= buf_cap_) {
+        return;
+    }
+    char* new_buffer = alloc_buffer(new_cap);
+    if (!new_buffer) {
+        // Keep going with the current buffer
+        return;
+    }
+    free_buffer();
+    buffer_ = new_buffer;
+    buf_cap_ = new_cap;
+}
+
+char* file::alloc_buffer(size_t size) const {
+    if (pool_) {
+        return pool_->acquire(size, align_);
+    }
+    if (align_ > 1) {
+        return static_cast<char*>(detail::alloc_aligned(size, align_));
+    }
+    return static_cast<char*>(malloc(size));
+}
+
+void file::free_buffer() {
+    if (owns_buffer_ && buffer_) {
+        if (pool_) {
+            pool_->release(buffer_, buf_cap_, align_);
+        } else if (align_ > 1) {
+            detail::free_aligned(buffer_);
+        } else {
+            free(buffer_);
+        }
+    }
+    buffer_ = nullptr;
+}
+
+bool file::aligned(const void* ptr, int64_t offset) const {
+    return reinterpret_cast<uintptr_t>(ptr) % align_ == 0 && static_cast<uint64_t>(offset) % align_ == 0;
+}
+
+file::lines_range file::lines() {
+    return {*this};
+}
+
+lines_iterator file::lines_range::begin() {
+    return lines_iterator(f_);
+}
+
+eof_sentinel file::lines_range::end() {
+    return {};
+}
+
+file::lines_view_range file::lines_view() {
+    return {*this};
+}
+
+lines_view_iterator file::lines_view_range::begin() {
+    return lines_view_iterator(f_);
+}
+
+file::reverse_lines_range file::reverse_lines(size_t chunk_size) {
+    if (closed()) {
+        throw std::runtime_error("Can't read from closed file");
+    }
+    if (mode() != mode::read) {
+        throw std::runtime_error("File not opened for reading");
+    }
+    if (align_ > 1) {
+        throw std::runtime_error("reverse_lines isn't supported in direct mode");
+    }
+    if (decoder_) {
+        throw std::runtime_error("reverse_lines isn't supported on compressed files");
+    }
+    return {*this, (std::max)(chunk_size, static_cast<size_t>(1))};
+}
+
+reverse_lines_iterator file::reverse_lines_range::begin() {
+    return reverse_lines_iterator(f_, chunk_size_);
+}
+
+eof_sentinel file::reverse_lines_range::end() {
+    return {};
+}
+
+std::vector<std::string> file::tail(size_t count) {
+    std::vector<std::string> lines;
+    if (count == 0) {
+        return lines;
+    }
+    for (std::string_view line : reverse_lines()) {
+        lines.emplace_back(line);
+        if (lines.size() == count) {
+            break;
+        }
+    }
+    std::reverse(lines.begin(), lines.end());
+    return lines;
+}
+
+reverse_lines_iterator::reverse_lines_iterator(const file& f, size_t chunk_size) : 
+f_(f),
+chunk_size_(chunk_size) {
+    int64_t size = f_.size();
+    if (size == 0) {
+        eof_ = true;
+        return;
+    }
+    buf_start_ = size;
+    end_ = size;
+    read_back();
+    // Like read_line a final newline ends the last line rather than starting an empty one
+    terminated_ = (buf_.back() == '\n');
+    if (terminated_) {
+        end_--;
+    }
+    eof_ = !next();
+}
+
+bool reverse_lines_iterator::next() {
+    if (done_) {
+        return false;
+    }
+    // Bytes from unscanned up to end_ are known not to hold a newline
+    int64_t unscanned = end_;
+    int64_t start;
+    while (true) {
+        const char* begin = buf_.data();
+        const char* hi = begin + (unscanned - buf_start_);
+        const char* nl = detail::find_last_byte(begin, hi, '\n');
+        if (nl != hi) {
+            start = buf_start_ + (nl - begin) + 1;
+            break;
+        }
+        if (buf_start_ == 0) {
+            start = 0;
+            done_ = true;
+            break;
+        }
+        unscanned = buf_start_;
+        read_back();
+    }
+
+    size_t len = static_cast<size_t>(end_ - start);
+    const char* p = buf_.data() + (start - buf_start_);
+    if (terminated_ && len > 0 && p[len - 1] == '\r') {
+        len--;
+    }
+    line_ = std::string_view(p, len);
+    terminated_ = true;
+    end_ = start - 1;
+    return true;
+}
+
+void reverse_lines_iterator::read_back() {
+    size_t keep = static_cast<size_t>(end_ - buf_start_);
+    // At least as much as is kept so a long line is read in a doubling number of bytes
+    size_t n = (std::min)((std::max)(chunk_size_, keep), static_cast<size_t>(buf_start_));
+    int64_t start = buf_start_ - static_cast<int64_t>(n);
+    detail::resize_uninitialized(spare_, n + keep);
+    size_t read = 0;
+    while (read < n) {
+        size_t got = f_.read_at(start + static_cast<int64_t>(read), &spare_[read], n - read);
+        if (got == 0) {
+            throw std::runtime_error("File shrank while reading backward");
+        }
+        read += got;
+    }
+    if (keep > 0) {
+        memcpy(&spare_[n], buf_.data(), keep);
+    }
+    buf_.swap(spare_);
+    buf_start_ = start;
+}
+
+file::records_range file::records(char delim, quoting q) {
+    return {*this, delim, q};
+}
+
+file::records_until_range file::records_until(std::string_view delim) {
+    if (delim.empty()) {
+        throw std::runtime_error("Can't read until an empty delimiter");
+    }
+    return {*this, std::string(delim)};
+}
+
+records_until_iterator file::records_until_range::begin() {
+    return records_until_iterator(f_, delim_);
+}
+
+eof_sentinel file::records_until_range::end() {
+    return {};
+}
+
+file::records_fixed_range file::records_fixed(size_t count) {
+    if (count == 0) {
+        throw std::runtime_error("Can't read records of 0 bytes");
+    }
+    return {*this, count};
+}
+
+records_fixed_iterator file::records_fixed_range::begin() {
+    return records_fixed_iterator(f_, count_);
+}
+
+eof_sentinel file::records_fixed_range::end() {
+    return {};
+}
+
+records_iterator file::records_range::begin() {
+    return records_iterator(f_, delim_, quoting_);
+}
+
+eof_sentinel file::records_range::end() {
+    return {};
+}
+
+eof_sentinel file::lines_view_range::end() {
+    return {};
+}
+
+std::string_view file::read_lines_at(int64_t begin, int64_t end, std::string& out) const {
+    // Start one byte early so a line starting exactly at begin can be told apart from one 
+    // that started in an earlier chunk
+    int64_t from = (begin > 0) ? begin - 1 : 0;
+    out.resize(static_cast<size_t>(end - from));
+    size_t n = 0;
+    while (n < out.size()) {
+        size_t r = file_.read_at(from + static_cast<int64_t>(n), &out[n], out.size() - n);
+        if (r == 0) {
+            break;
+        }
+        n += r;
+    }
+    out.resize(n);
+
+    size_t skip = 0;
+    if (begin > 0) {
+        const char* nl = detail::find_byte(out.data(), out.data() + out.size(), '\n');
+        skip = (nl == out.data() + out.size()) ? out.size() : (nl - out.data()) + 1;
+    }
+    if (skip == out.size()) {
+        // No line starts in this chunk
+        return {};
+    }
+
+    // The last line that starts in this chunk can run past its end
+    char block[4096];
+    int64_t pos = from + static_cast<int64_t>(out.size());
+    while (out.back() != '\n') {
+        size_t r = file_.read_at(pos, block, sizeof(block));
+        if (r == 0) {
+            break;
+        }
+        const char* nl = detail::find_byte(block, block + r, '\n');
+        size_t keep = (nl == block + r) ? r : (nl - block) + 1;
+        out.append(block, keep);
+        pos += static_cast<int64_t>(keep);
+    }
+    return std::string_view(out).substr(skip);
+}
+
+template <class T>
+T file::read(byte_order order) {
+    static_assert(std::is_trivially_copyable<T>::value, "read<T> needs a trivially copyable T");
+    detail::check_byte_order<T>(order);
+    T value;
+    if (read(&value, sizeof(T)) != sizeof(T)) {
+        throw std::runtime_error("Unexpected end of file");
+    }
+    if (detail::needs_swap(order)) {
+        char* p = reinterpret_cast<char*>(&value);
+        detail::byte_swap(p, p, 1, sizeof(T));
+    }
+    return value;
+}
+
+template <class T>
+size_t file::read_array(T* data, size_t count, byte_order order) {
+    static_assert(std::is_trivially_copyable<T>::value, "read_array<T> needs a trivially copyable T");
+    detail::check_byte_order<T>(order);
+    size_t n = read(data, count * sizeof(T)) / sizeof(T);
+    if (detail::needs_swap(order)) {
+        char* p = reinterpret_cast<char*>(data);
+        detail::byte_swap(p, p, n, sizeof(T));
+    }
+    return n;
+}
+
+template <class T, class>
+size_t file::write(const T& value, byte_order order) {
+    return write_array(&value, 1, order);
+}
+
+template <class T>
+size_t file::write_array(const T* data, size_t count, byte_order order) {
+    static_assert(std::is_trivially_copyable<T>::value, "write_array<T> needs a trivially copyable T");
+    detail::check_byte_order<T>(order);
+    if (!detail::needs_swap(order)) {
+        return write(static_cast<const void*>(data), count * sizeof(T));
+    }
+    if (closed()) {
+        throw std::runtime_error("Can't write to closed file");
+    }
+    if (mode() != mode::write && mode() != mode::append) {
+        throw std::runtime_error("File not opened for writing");
+    }
+
+    const char* in = reinterpret_cast<const char*>(data);
+    size_t written = 0;
+    while (written != count) {
+        size_t fits = (buf_cap_ - buf_i_) / sizeof(T);
+        if (fits == 0 && buf_i_ == 0) {
+            // The buffer is smaller than one value
+            T value;
+            detail::byte_swap(reinterpret_cast<char*>(&value), in + written * sizeof(T), 1, sizeof(T));
+            write_direct(reinterpret_cast<const char*>(&value), sizeof(T));
+            written++;
+            continue;
+        }
+        size_t n = (std::min)(count - written, fits);
+        detail::byte_swap(buffer_ + buf_i_, in + written * sizeof(T), n, sizeof(T));
+        buf_i_ += n * sizeof(T);
+        written += n;
+
+        if (buf_cap_ - buf_i_ < sizeof(T)) {
+            flush();
+            if (adaptive_) {
+                grow_buffer();
+            }
+        }
+    }
+    return count * sizeof(T);
+}
+
+template <class Fn>
+void file::parallel_lines(size_t nthreads, Fn fn, line_order order, size_t chunk_size) const {
+    if (closed()) {
+        throw std::runtime_error("Can't read from closed file");
+    }
+    if (mode() != mode::read) {
+        throw std::runtime_error("File not opened for reading");
+    }
+    if (align_ > 1) {
+        throw std::runtime_error("parallel_lines isn't supported in direct mode");
+    }
+    if (decoder_) {
+        throw std::runtime_error("parallel_lines isn't supported on compressed files");
+    }
+
+    const int64_t total = size();
+    const int64_t chunk = static_cast<int64_t>((std::max)(chunk_size, static_cast<size_t>(1)));
+    const size_t nchunks = static_cast<size_t>((total + chunk - 1) / chunk);
+    if (nthreads == 0) {
+        nthreads = (std::max)(std::thread::hardware_concurrency(), 1u);
+    }
+    nthreads = (std::min)(nthreads, (std::max)(nchunks, static_cast<size_t>(1)));
+
+    auto chunk_end = [&](size_t i) { return (std::min)(total, static_cast<int64_t>(i + 1) * chunk); };
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::exception_ptr error;
+    std::atomic<bool> stop{false};
+    std::atomic<size_t> next{0};
+    auto fail = [&] {
+        std::lock_guard<std::mutex> lock(m);
+        if (!error) {
+            error = std::current_exception();
+        }
+        stop = true;
+        cv.notify_all();
+    };
+
+    // In ordered mode workers read ahead into a window of slots which this thread drains in file order
+    const size_t window = (order == line_order::ordered) ? 2 * nthreads : 0;
+    std::vector<std::string> bufs(window);
+    std::vector<std::string_view> views(window);
+    std::vector<bool> ready(window, false);
+    size_t consumed = 0;
+
+    std::vector<std::thread> threads;
+    if (order == line_order::unordered) {
+        for (size_t t = 0; t < nthreads; t++) {
+            threads.emplace_back([&] {
+                try {
+                    std::string buf;
+                    for (size_t i = next++; i < nchunks && !stop; i = next++) {
+                        detail::for_each_line(read_lines_at(static_cast<int64_t>(i) * chunk, chunk_end(i), buf), fn);
+                    }
+                } catch (...) {
+                    fail();
+                }
+            });
+        }
+    } else {
+        for (size_t t = 0; t < nthreads; t++) {
+            threads.emplace_back([&] {
+                try {
+                    for (size_t i = next++; i < nchunks; i = next++) {
+                        {
+                            std::unique_lock<std::mutex> lock(m);
+                            cv.wait(lock, [&] { return stop || i < consumed + window; });
+                            if (stop) {
+                                return;
+                            }
+                        }
+                        size_t slot = i % window;
+                        views[slot] = read_lines_at(static_cast<int64_t>(i) * chunk, chunk_end(i), bufs[slot]);
+                        {
+                            std::lock_guard<std::mutex> lock(m);
+                            ready[slot] = true;
+                        }
+                        cv.notify_all();
+                    }
+                } catch (...) {
+                    fail();
+                }
+            });
+        }
+
+        for (size_t i = 0; i < nchunks; i++) {
+            size_t slot = i % window;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                cv.wait(lock, [&] { return stop || ready[slot]; });
+                if (stop) {
+                    break;
+                }
+            }
+            try {
+                detail::for_each_line(views[slot], fn);
+            } catch (...) {
+                fail();
+                break;
+            }
+            {
+                std::lock_guard<std::mutex> lock(m);
+                ready[slot] = false;
+                consumed = i + 1;
+            }
+            cv.notify_all();
+        }
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+mapped::mapped(const std::string& path, enum mode mode, const options& opts) :
+// Check the mode before opening so a write mode can't truncate the file
+file_(path, (mode == mode::read) ? mode : throw std::runtime_error("Mapped files can only be opened for reading"), opts) {
+    if (file_.size() == 0) {
+        return;
+    }
+
+#ifdef _WIN32
+    HANDLE h = (HANDLE)_get_osfhandle(file_.fd());
+    mapping_ = CreateFileMappingA(h, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping_) {
+        throw std::runtime_error("Couldn't create file mapping");
+    }
+    data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+    if (!data_) {
+        CloseHandle(mapping_);
+        mapping_ = nullptr;
+        throw std::runtime_error("Couldn't map view of file");
+    }
+#else
+    void* ret = ::mmap(nullptr, static_cast<size_t>(file_.size()), PROT_READ, MAP_PRIVATE, file_.fd(), 0);
+    if (ret == MAP_FAILED) {
+        throw_errno_exception(errno);
+    }
+    data_ = static_cast<const char*>(ret);
+
+    int adv = MADV_NORMAL;
+    if (opts.access == advice::sequential) {
+        adv = MADV_SEQUENTIAL;
+    } else if (opts.access == advice::random) {
+        adv = MADV_RANDOM;
+    }
+    // Only hints, so failures are ignored like when opening
+    if (adv != MADV_NORMAL) {
+        ::madvise(ret, static_cast<size_t>(file_.size()), adv);
+    }
+    if (opts.willneed) {
+        ::madvise(ret, static_cast<size_t>(file_.size()), MADV_WILLNEED);
+    }
+#endif
+}
+
+mapped::mapped(mapped&& other) :
+file_(std::move(other.file_)),
+data_(other.data_) {
+    other.data_ = nullptr;
+#ifdef _WIN32
+    mapping_ = other.mapping_;
+    other.mapping_ = nullptr;
+#endif
+}
+
+mapped& mapped::operator=(mapped&& other) {
+    if (this != &other) {
+        this->close();
+
+        file_ = std::move(other.file_);
+        data_ = other.data_;
+        other.data_ = nullptr;
+#ifdef _WIN32
+        mapping_ = other.mapping_;
+        other.mapping_ = nullptr;
+#endif
+    }
+    return *this;
+}
+
+mapped::~mapped() {
+    close();
+}
+
+bool mapped::can_read() const {
+    return file_.can_read();
+}
+
+bool mapped::can_write() const {
+    return file_.can_write();
+}
+
+mode mapped::mode() const {
+    return file_.mode();
+}
+
+const char* mapped::data() const {
+    return data_;
+}
+
+std::string_view mapped::view() const {
+    return std::string_view(data_, static_cast<size_t>(size()));
+}
+
+std::string_view mapped::view(int64_t offset, int64_t count) const {
+    if (offset < 0 || offset > size()) {
+        throw std::runtime_error("View offset beyond end of file");
+    }
+    int64_t available = size() - offset;
+    if (count < 0 || count > available) {
+        count = available;
+    }
+    return std::string_view(data_ + offset, static_cast<size_t>(count));
+}
+
+void mapped::unmap() {
+    if (data_) {
+#ifdef _WIN32
+        UnmapViewOfFile(data_);
+        CloseHandle(mapping_);
+        mapping_ = nullptr;
+#else
+        ::munmap(const_cast<char*>(data_), static_cast<size_t>(file_.size()));
+#endif
+    }
+    data_ = nullptr;
+}
+
+void mapped::close() {
+    unmap();
+    file_.close();
+}
+
+bool mapped::closed() const {
+    return file_.closed();
+}
+
+int64_t mapped::size() const {
+    return file_.size();
+}
+
+int64_t mapped::block_size() const {
+    return file_.block_size();
+}
+
+mapped::lines_range mapped::lines() const {
+    return {*this};
+}
+
+mapped_lines_iterator mapped::lines_range::begin() {
+    return mapped_lines_iterator(m_.view());
+}
+
+eof_sentinel mapped::lines_range::end() {
+    return {};
+}
+
+namespace detail {
+
+// Starts a saved line_index. The offsets follow.
+struct line_index_header {
+    uint64_t magic;
+    uint64_t file_size;
+    int64_t modified;
+    uint64_t sample;
+    uint64_t lines;
+};
+
+// "FILEIDX1" in this machine's byte order, so an index saved on another one is rebuilt
+constexpr uint64_t line_index_magic = 0x31584449454c4946ull;
+
+// Returns the last modification time of the file at path in ns
+inline int64_t modified_ns(const std::string& path) {
+#ifdef _WIN32
+    struct _stat st;
+    if (::_stat(path.c_str(), &st) < 0) {
+        throw_errno_exception(errno);
+    }
+    return static_cast<int64_t>(st.st_mtime) * 1000000000;
+#else
+    struct ::stat st;
+    if (::stat(path.c_str(), &st) < 0) {
+        throw_errno_exception(errno);
+    }
+#ifdef __APPLE__
+    return static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+}
+
+} // namespace detail
+
+line_index::line_index(const std::string& path, size_t sample, size_t nthreads) : line_index(path, unbuilt{}) {
+    build(sample, nthreads);
+}
+
+line_index::line_index(const std::string& path, unbuilt) : 
+file_(path, mode::read),
+modified_(detail::modified_ns(path)) {}
+
+line_index line_index::load(const std::string& path, const std::string& index_path, size_t sample, size_t nthreads) {
+    line_index index(path, unbuilt{});
+    if (!index.map_index(index_path)) {
+        index.build(sample, nthreads);
+        index.save(index_path);
+    }
+    return index;
+}
+
+void line_index::build(size_t sample, size_t nthreads) {
+    sample_ = (std::max)(sample, static_cast<size_t>(1));
+    const char* begin = file_.data();
+    const size_t size = static_cast<size_t>(file_.size());
+    if (size == 0) {
+        return;
+    }
+
+    // Every line but the first starts after a newline that isn't the last byte
+    const char* last = begin + size - 1;
+    if (nthreads == 0) {
+        nthreads = (std::max)(std::thread::hardware_concurrency(), 1u);
+    }
+    const size_t min_chunk = 1024 * 1024;
+    nthreads = (std::min)(nthreads, (size + min_chunk - 1) / min_chunk);
+
+    if (nthreads <= 1) {
+        samples_.push_back(0);
+        uint64_t line = 1;
+        size_t until_sample = sample_;
+        for (const char* p = begin; (p = detail::find_byte(p, last, '\n')) != last; p++, line++) {
+            if (--until_sample == 0) {
+                samples_.push_back(static_cast<uint64_t>(p + 1 - begin));
+                until_sample = sample_;
+            }
+        }
+        lines_ = line;
+    } else {
+        // Count the lines starting in each chunk, then record the samples knowing each chunk's first line
+        const size_t chunk = (size - 1 + nthreads - 1) / nthreads;
+        auto chunk_begin = [&](size_t t) { return begin + (std::min)(t * chunk, size - 1); };
+        std::vector<uint64_t> counts(nthreads, 0);
+        auto run = [&](auto fn) {
+            std::vector<std::thread> threads;
+            for (size_t t = 1; t < nthreads; t++) {
+                threads.emplace_back(fn, t);
+            }
+            fn(0);
+            for (auto& t : threads) {
+                t.join();
+            }
+        };
+        run([&](size_t t) {
+            uint64_t n = 0;
+            for (const char* p = chunk_begin(t), *end = chunk_begin(t + 1); (p = detail::find_byte(p, end, '\n')) != end; p++) {
+                n++;
+            }
+            counts[t] = n;
+        });
+        std::vector<uint64_t> first_line(nthreads, 1);
+        for (size_t t = 1; t < nthreads; t++) {
+            first_line[t] = first_line[t - 1] + counts[t - 1];
+        }
+        lines_ = first_line.back() + counts.back();
+        samples_.resize(static_cast<size_t>((lines_ + sample_ - 1) / sample_));
+        samples_[0] = 0;
+        run([&](size_t t) {
+            uint64_t line = first_line[t];
+            for (const char* p = chunk_begin(t), *end = chunk_begin(t + 1); (p = detail::find_byte(p, end, '\n')) != end; p++, line++) {
+                if (line % sample_ == 0) {
+                    samples_[static_cast<size_t>(line / sample_)] = static_cast<uint64_t>(p + 1 - begin);
+                }
+            }
+        });
+    }
+    offsets_ = samples_.data();
+}
+
+bool line_index::map_index(const std::string& index_path) {
+    std::unique_ptr<mapped> index;
+    try {
+        index = std::make_unique<mapped>(index_path, mode::read);
+    } catch (const std::exception&) {
+        return false;
+    }
+    detail::line_index_header h;
+    if (index->size() < static_cast<int64_t>(sizeof(h))) {
+        return false;
+    }
+    memcpy(&h, index->data(), sizeof(h));
+    if (h.magic != detail::line_index_magic || h.file_size != static_cast<uint64_t>(file_.size()) || 
+        h.modified != modified_ || h.sample == 0) {
+        return false;
+    }
+    uint64_t count = (h.lines + h.sample - 1) / h.sample;
+    if (static_cast<uint64_t>(index->size()) != sizeof(h) + count * sizeof(uint64_t)) {
+        return false;
+    }
+    sample_ = static_cast<size_t>(h.sample);
+    lines_ = h.lines;
+    // The mapping is page aligned and the header a multiple of 8 bytes so the offsets are aligned
+    offsets_ = reinterpret_cast<const uint64_t*>(index->data() + sizeof(h));
+    index_ = std::move(index);
+    return true;
+}
+
+void line_index::save(const std::string& index_path) const {
+    detail::line_index_header h = {detail::line_index_magic, static_cast<uint64_t>(file_.size()), modified_, 
+                                   sample_, lines_};
+    // Replaced rather than truncated so a mapping of the old index stays intact
+    options opts;
+    opts.atomic_replace = true;
+    auto f = file(index_path, mode::write, opts);
+    f.write(&h, sizeof(h));
+    f.write_array(offsets_, static_cast<size_t>((lines_ + sample_ - 1) / sample_));
+    f.close();
+}
+
+size_t line_index::size() const {
+    return static_cast<size_t>(lines_);
+}
+
+size_t line_index::sample() const {
+    return sample_;
+}
+
+const mapped& line_index::mapping() const {
+    return file_;
+}
+
+const char* line_index::start_of(size_t n) const {
+    const char* p = file_.data() + offsets_[n / sample_];
+    const char* end = file_.data() + file_.size();
+    for (size_t i = n % sample_; i > 0; i--) {
+        p = detail::find_byte(p, end, '\n') + 1;
+    }
+    return p;
+}
+
+std::string_view line_index::line_from(const char* p, const char** next) const {
+    const char* end = file_.data() + file_.size();
+    const char* nl = detail::find_byte(p, end, '\n');
+    if (next) {
+        *next = (nl == end) ? end : nl + 1;
+    }
+    size_t len = static_cast<size_t>(nl - p);
+    if (nl != end && len > 0 && p[len - 1] == '\r') {
+        len--;
+    }
+    return std::string_view(p, len);
+}
+
+std::string_view line_index::line_at(size_t n) const {
+    if (n >= lines_) {
+        throw std::out_of_range("No such line");
+    }
+    return line_from(start_of(n));
+}
+
+int64_t line_index::offset_of(size_t n) const {
+    if (n >= lines_) {
+        throw std::out_of_range("No such line");
+    }
+    return start_of(n) - file_.data();
+}
+
+template <class Compare>
+size_t line_index::lower_bound(std::string_view value, Compare less) const {
+    // Binary search the kept lines for the first not less than value...
+    size_t lo = 0;
+    size_t hi = static_cast<size_t>((lines_ + sample_ - 1) / sample_);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (less(line_from(file_.data() + offsets_[mid]), value)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return 0;
+    }
+    // ...then scan the lines before it
+    size_t n = (lo - 1) * sample_;
+    size_t last = (std::min)(static_cast<size_t>(lines_), lo * sample_);
+    const char* p = file_.data() + offsets_[lo - 1];
+    for (; n < last; n++) {
+        if (!less(line_from(p, &p), value)) {
+            return n;
+        }
+    }
+    return last;
+}
+
+async_writer::async_writer(const std::string& path, enum mode mode, const options& opts) :
+// Check the mode before opening so reads fail without touching the file
+file_(path, (mode == mode::read) ? throw std::runtime_error("async_writer can only be opened for writing") :
+            opts.direct ? throw std::runtime_error("async_writer can't use direct I/O") : mode, opts),
+on_full_(opts.on_full) {
+    int64_t block_s = file_.block_size();
+    buf_cap_ = (opts.buffer_size > 0) ? opts.buffer_size : (block_s > 0) ? block_s : 4096;
+    size_t count = (std::max)(opts.write_buffers, static_cast<size_t>(2));
+    for (size_t i = 0; i < count; i++) {
+        char* buf = static_cast<char*>(malloc(buf_cap_));
+        if (!buf) {
+            for (char* b : buffers_) {
+                free(b);
+            }
+            throw std::bad_alloc();
+        }
+        buffers_.push_back(buf);
+        if (i > 0) {
+            free_.push_back(i);
+        }
+    }
+    thread_ = std::thread([this] { run_writer(); });
+}
+
+async_writer::~async_writer() {
+    try {
+        close();
+    } catch (const std::exception&) {
+        // Errors writing out are only rethrown to callers of write, flush and close
+    }
+    for (char* b : buffers_) {
+        free(b);
+    }
+}
+
+bool async_writer::can_write() const {
+    return file_.can_write();
+}
+
+mode async_writer::mode() const {
+    return file_.mode();
+}
+
+size_t async_writer::write(const void* buffer, size_t count) {
+    if (closed()) {
+        throw std::runtime_error("Can't write to closed file");
+    }
+    rethrow_error();
+
+    std::unique_lock<std::mutex> lock(m_);
+    if (on_full_ == backpressure::drop && count > (buf_cap_ - cur_size_) + free_.size() * buf_cap_) {
+        dropped_ += count;
+        return 0;
+    }
+    lock.unlock();
+
+    const char* in = static_cast<const char*>(buffer);
+    size_t written = 0;
+    while (written != count) {
+        size_t copy_size = (std::min)(count - written, buf_cap_ - cur_size_);
+        memcpy(buffers_[current_] + cur_size_, in + written, copy_size);
+        cur_size_ += copy_size;
+        written += copy_size;
+
+        if (cur_size_ == buf_cap_) {
+            lock.lock();
+            hand_off(lock);
+            lock.unlock();
+        }
+    }
+    return written;
 }
 
-raw& raw::operator=(raw&& other) {
-    if (this != &other) {
-        this->close();
-        fd_ = other.fd_;
-        mode_ = other.mode_;
-        size_ = other.size_;
-        block_size_ = other.block_size_;
-        other.fd_ = -1;
+size_t async_writer::write(std::string_view sv) {
+    return write(sv.data(), sv.size());
+}
+
+void async_writer::flush() {
+    if (closed()) {
+        throw std::runtime_error("Can't flush to closed file");
     }
-    return *this;
+
+    std::unique_lock<std::mutex> lock(m_);
+    if (cur_size_ > 0) {
+        hand_off(lock);
+    }
+    cv_.wait(lock, [&] { return (queue_.empty() && !busy_) || error_; });
+    lock.unlock();
+    rethrow_error();
 }
 
-raw::~raw() {
-    close();
+void async_writer::sync() {
+    flush();
+    file_.sync();
 }
 
-bool raw::can_read() const {
-    return !closed() && mode_ == mode::read;
+void async_writer::close() {
+    if (closed()) {
+        return;
+    }
+    std::exception_ptr error;
+    try {
+        flush();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+    if (error) {
+        // Some writes never made it out, so don't let an atomic_replace go ahead without them
+        file_.discard();
+        std::rethrow_exception(error);
+    }
+    file_.close();
 }
 
-bool raw::can_write() const {
-    return !closed() && (mode_ == mode::write || mode_ == mode::append);
+bool async_writer::closed() const {
+    return file_.closed();
 }
 
-mode raw::mode() const {
-    return mode_;
+uint64_t async_writer::dropped() const {
+    std::lock_guard<std::mutex> lock(m_);
+    return dropped_;
 }
 
-size_t raw::read(void* buffer, size_t count) const {
-#ifdef _WIN32
-    int bytes_read = ::_read(fd_, buffer, static_cast<unsigned int>(count));
-#else
-    ssize_t bytes_read = ::read(fd_, buffer, count);
-#endif
-    if (bytes_read < 0) {
-        throw_errno_exception(errno);
+void async_writer::hand_off(std::unique_lock<std::mutex>& lock) {
+    queue_.emplace_back(current_, cur_size_);
+    cv_.notify_all();
+    // Only blocks when every buffer is waiting to be written out
+    cv_.wait(lock, [&] { return !free_.empty() || error_; });
+    if (error_) {
+        // Nothing more will be written out so start over in the current buffer. It's still queued,
+        // or was freed if writing it out is what failed.
+        auto queued = std::find_if(queue_.begin(), queue_.end(), [&](const std::pair<size_t, size_t>& item) {
+            return item.first == current_;
+        });
+        if (queued != queue_.end()) {
+            queue_.erase(queued);
+        }
+        auto freed = std::find(free_.begin(), free_.end(), current_);
+        if (freed != free_.end()) {
+            free_.erase(freed);
+        }
+        cur_size_ = 0;
+        lock.unlock();
+        rethrow_error();
     }
+    current_ = free_.front();
+    free_.pop_front();
+    cur_size_ = 0;
+}
 
-    return static_cast<size_t>(bytes_read);
+void async_writer::rethrow_error() {
+    std::lock_guard<std::mutex> lock(m_);
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
 }
 
-size_t raw::write(const void* buffer, size_t count) const {
-#ifdef _WIN32
-    int bytes_written = ::_write(fd_, buffer, static_cast<unsigned int>(count));
-#else
-    ssize_t bytes_written = ::write(fd_, buffer, count);
-#endif
-    if (bytes_written < 0) {
-        throw_errno_exception(errno);
+void async_writer::run_writer() {
+    std::unique_lock<std::mutex> lock(m_);
+    while (true) {
+        cv_.wait(lock, [&] { return stop_ || (!queue_.empty() && !error_); });
+        if (queue_.empty() || error_) {
+            return;
+        }
+        auto item = queue_.front();
+        queue_.pop_front();
+        busy_ = true;
+        lock.unlock();
+
+        try {
+            size_t written = 0;
+            while (written != item.second) {
+                size_t n = file_.write(buffers_[item.first] + written, item.second - written);
+                if (n == 0) {
+                    throw std::runtime_error("Couldn't write to file");
+                }
+                written += n;
+            }
+        } catch (...) {
+            lock.lock();
+            error_ = std::current_exception();
+            busy_ = false;
+            free_.push_back(item.first);
+            cv_.notify_all();
+            continue;
+        }
+
+        lock.lock();
+        busy_ = false;
+        free_.push_back(item.first);
+        cv_.notify_all();
+    }
+}
+
+group_sync::group_sync(const raw& file, bool data_only) : 
+file_(file),
+data_only_(data_only) {}
+
+void group_sync::sync() {
+    std::unique_lock<std::mutex> lock(m_);
+    // A sync starting from here on covers this call's writes
+    uint64_t ticket = ++requested_;
+    while (true) {
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        if (synced_ >= ticket) {
+            return;
+        }
+        if (running_) {
+            cv_.wait(lock);
+            continue;
+        }
+        // Lead a sync covering every call so far
+        running_ = true;
+        uint64_t covers = requested_;
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+            if (data_only_) {
+                file_.sync_data();
+            } else {
+                file_.sync();
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+        running_ = false;
+        syncs_++;
+        if (error) {
+            error_ = error;
+        } else {
+            synced_ = covers;
+        }
+        cv_.notify_all();
     }
+}
 
-    return static_cast<size_t>(bytes_written);
+uint64_t group_sync::syncs() const {
+    std::lock_guard<std::mutex> lock(m_);
+    return syncs_;
 }
 
-void raw::close() {
-    if (fd_ >= 0) {
-#ifdef _WIN32
-        ::_close(fd_);
-#else
-        ::close(fd_);
-#endif
+shared_appender::shared_appender(const std::string& path, enum mode mode, const options& opts) :
+// Check the mode before opening so reads fail without touching the file
+file_(path, (mode != mode::read) ? mode : throw std::runtime_error("shared_appender can only be opened for writing"), opts),
+syncer_(file_) {
+    static std::atomic<uint64_t> next_id{0};
+    id_ = ++next_id;
+    int64_t block_s = file_.block_size();
+    buf_cap_ = (opts.buffer_size > 0) ? opts.buffer_size : (block_s > 0) ? block_s : 4096;
+}
+
+shared_appender::~shared_appender() {
+    try {
+        close();
+    } catch (const std::exception&) {
+        // Write errors are only thrown to callers of write, flush and close
     }
-    fd_ = -1; 
-    size_ = 0;
-    block_size_ = 0;
 }
 
-bool raw::closed() const {
-    return fd_ == -1;
+bool shared_appender::can_write() const {
+    return file_.can_write();
 }
 
-int64_t raw::tell() const {
-    return seek(0, seek_mode::cur);
+mode shared_appender::mode() const {
+    return file_.mode();
 }
 
-int64_t raw::seek(int64_t offset, seek_mode mode) const {
+size_t shared_appender::write(const void* buffer, size_t count) {
     if (closed()) {
-        throw std::runtime_error("Can't seek closed file.");
+        throw std::runtime_error("Can't write to closed file");
     }
 
-    int whence = 0;
-    switch (mode) {
-        case seek_mode::set:
-            whence = SEEK_SET;
-            break;
-        case seek_mode::cur:
-            whence = SEEK_CUR;
-            break;
-        case seek_mode::end:
-            whence = SEEK_END;
-            break;
+    slot& s = local_slot();
+    std::lock_guard<std::mutex> lock(s.m);
+    if (s.size + count > buf_cap_) {
+        flush_slot(s);
     }
-#ifdef _WIN32
-    int64_t ret = ::_lseeki64(fd_, offset, whence);
-#else
-    int64_t ret = ::lseek(fd_, offset, whence);
-#endif
-
-    if (ret == -1) {
-        throw_errno_exception(errno);
+    if (count > buf_cap_) {
+        // Too big to buffer, write it alone
+        std::lock_guard<std::mutex> io_lock(io_m_);
+        write_all(static_cast<const char*>(buffer), count);
+        return count;
     }
-    return ret;
-} 
+    memcpy(s.data + s.size, buffer, count);
+    s.size += count;
+    return count;
+}
 
-void raw::sync() const {
+size_t shared_appender::write(std::string_view sv) {
+    return write(sv.data(), sv.size());
+}
+
+void shared_appender::flush() {
     if (closed()) {
-        throw std::runtime_error("Can't sync closed file.");
+        throw std::runtime_error("Can't flush to closed file");
     }
 
-    if (!can_write()) {
-        throw std::runtime_error("File not opened for writing cannot be synced.");
+    std::vector<std::shared_ptr<slot>> slots;
+    {
+        std::lock_guard<std::mutex> lock(slots_m_);
+        slots = slots_;
     }
+    for (auto& s : slots) {
+        std::lock_guard<std::mutex> lock(s->m);
+        flush_slot(*s);
+    }
+}
 
-#ifdef _WIN32
-    bool ret = FlushFileBuffers((HANDLE)_get_osfhandle(fd_));
-    if (!ret) {
-        throw std::runtime_error("Couldn't sync file");
+void shared_appender::sync() {
+    flush();
+    syncer_.sync();
+}
+
+void shared_appender::close() {
+    if (closed()) {
+        return;
     }
-#else
-    int ret = ::fsync(fd_);
-    if (ret < 0) {
-        throw_errno_exception(errno);
+    std::exception_ptr error;
+    try {
+        flush();
+    } catch (...) {
+        error = std::current_exception();
     }
-#endif
+    {
+        std::lock_guard<std::mutex> lock(slots_m_);
+        slots_.clear();
+    }
+    if (error) {
+        // Some records never made it out, so don't let an atomic_replace go ahead without them
+        file_.discard();
+        std::rethrow_exception(error);
+    }
+    file_.close();
 }
 
-int64_t raw::size() const {
-    return size_;
+bool shared_appender::closed() const {
+    return file_.closed();
 }
 
-int64_t raw::block_size() const {
-    return block_size_;
+shared_appender::slot& shared_appender::local_slot() {
+    // Thread exits free their map, appenders being destroyed free their slots.
+    // Expired slots of destroyed appenders are pruned as new ones are made.
+    thread_local std::unordered_map<uint64_t, std::weak_ptr<slot>> slots;
+    auto it = slots.find(id_);
+    if (it != slots.end()) {
+        if (auto s = it->second.lock()) {
+            // The appender holds the slot too, so it stays alive after s goes away
+            return *s;
+        }
+    }
+
+    auto s = std::make_shared<slot>();
+    s->data = static_cast<char*>(malloc(buf_cap_));
+    if (!s->data) {
+        throw std::bad_alloc();
+    }
+    for (auto i = slots.begin(); i != slots.end();) {
+        i = i->second.expired() ? slots.erase(i) : std::next(i);
+    }
+    slots[id_] = s;
+    std::lock_guard<std::mutex> lock(slots_m_);
+    slots_.push_back(s);
+    return *s;
 }
 
-void raw::run_stat() {
-    if (fd_ < 0) {
-        throw std::runtime_error("Can't stat closed file.");
+void shared_appender::flush_slot(slot& s) {
+    if (s.size == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> io_lock(io_m_);
+    write_all(s.data, s.size);
+    s.size = 0;
+}
+
+void shared_appender::write_all(const char* data, size_t count) {
+    size_t written = 0;
+    while (written != count) {
+        size_t n = file_.write(data + written, count - written);
+        if (n == 0) {
+            throw std::runtime_error("Couldn't write to file");
+        }
+        written += n;
     }
+}
 
-#ifdef _WIN32 
-    struct _stat st;
-    int ret = ::_fstat(fd_, &st);
+follower::follower(const std::string& path, bool from_end, const options& opts) :
+path_(path),
+opts_(opts),
+file_(path, mode::read, opts),
+chunk_size_((opts.buffer_size > 0) ? opts.buffer_size : 64 * 1024) {
+    // The directory is watched too so a file created in place of a rotated one is noticed
+    size_t slash = path_.find_last_of("/\\");
+    std::string dir = (slash == std::string::npos) ? "." : (slash == 0) ? path_.substr(0, 1) : path_.substr(0, slash);
+    try {
+#ifdef _WIN32
+        stop_event_ = ::CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        if (!stop_event_) {
+            throw std::runtime_error("Couldn't create an event");
+        }
+        change_ = ::FindFirstChangeNotificationA(dir.c_str(), FALSE, 
+            FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE);
+        if (change_ == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Couldn't watch " + dir);
+        }
 #else
-    struct stat st;
-    int ret = ::fstat(fd_, &st);
+        if (::pipe(stop_pipe_) < 0) {
+            throw_errno_exception(errno);
+        }
+#if defined(__linux__)
+        inotify_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_ < 0 || ::inotify_add_watch(inotify_, dir.c_str(), IN_CREATE | IN_MOVED_TO) < 0) {
+            throw_errno_exception(errno);
+        }
+#elif defined(FILE_KQUEUE)
+        kqueue_ = ::kqueue();
+#ifdef O_EVTONLY
+        dir_fd_ = ::open(dir.c_str(), O_EVTONLY);
+#else
+        dir_fd_ = ::open(dir.c_str(), O_RDONLY);
 #endif
-    if (ret < 0) {
-        throw_errno_exception(errno);
+        if (kqueue_ < 0 || dir_fd_ < 0) {
+            throw_errno_exception(errno);
+        }
+        struct kevent ev[2];
+        EV_SET(&ev[0], stop_pipe_[0], EVFILT_READ, EV_ADD, 0, 0, nullptr);
+        EV_SET(&ev[1], dir_fd_, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, nullptr);
+        if (::kevent(kqueue_, ev, 2, nullptr, 0, nullptr) < 0) {
+            throw_errno_exception(errno);
+        }
+#endif
+#endif
+        // Watch before reading so no change after the first read is missed
+        watch();
+    } catch (...) {
+        close_watches();
+        throw;
+    }
+    if (from_end) {
+        pos_ = file_.seek(0, seek_mode::end);
     }
+}
+
+follower::~follower() {
+    close_watches();
+}
 
-    size_ = st.st_size;
+void follower::close_watches() {
 #ifdef _WIN32
-    block_size_ = 4096;
+    if (change_ != INVALID_HANDLE_VALUE) {
+        ::FindCloseChangeNotification(change_);
+        change_ = INVALID_HANDLE_VALUE;
+    }
+    if (stop_event_) {
+        ::CloseHandle(stop_event_);
+        stop_event_ = nullptr;
+    }
 #else
-    block_size_ = st.st_blksize;
+    for (int& fd : stop_pipe_) {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+#if defined(__linux__)
+    if (inotify_ >= 0) {
+        ::close(inotify_);
+        inotify_ = -1;
+    }
+#elif defined(FILE_KQUEUE)
+    if (kqueue_ >= 0) {
+        ::close(kqueue_);
+        kqueue_ = -1;
+    }
+    if (dir_fd_ >= 0) {
+        ::close(dir_fd_);
+        dir_fd_ = -1;
+    }
+#endif
 #endif
 }
 
-file::file(const std::string& path, enum mode mode) : file_(path, mode) {
-    int64_t block_s = file_.block_size();
-    buf_cap_ = (block_s > 0) ? block_s : 4096;
-    buffer_ = static_cast<char*>(malloc(buf_cap_));
-    if (!buffer_) {
-        throw std::bad_alloc();
+void follower::watch() {
+#if defined(__linux__)
+    if (file_watch_ >= 0) {
+        // Fails if the old file is gone, which is fine
+        ::inotify_rm_watch(inotify_, file_watch_);
     }
+    file_watch_ = ::inotify_add_watch(inotify_, path_.c_str(), IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (file_watch_ < 0) {
+        throw_errno_exception(errno);
+    }
+#elif defined(FILE_KQUEUE)
+    // Closing the old file already dropped its event
+    struct kevent ev;
+    EV_SET(&ev, file_.fd(), EVFILT_VNODE, EV_ADD | EV_CLEAR, 
+           NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME, 0, nullptr);
+    if (::kevent(kqueue_, &ev, 1, nullptr, 0, nullptr) < 0) {
+        throw_errno_exception(errno);
+    }
+#endif
 }
 
-file::file(file&& other) : 
-file_(std::move(other.file_)),
-buffer_(other.buffer_),
-buf_cap_(other.buf_cap_),
-buf_i_(other.buf_i_)  {
-    other.buffer_ = nullptr;
-    other.buf_cap_ = 0;
-    other.buf_size_ = 0;
-    other.buf_i_ = 0;
+bool follower::read_line(std::string& line, std::chrono::milliseconds timeout) {
+    std::string_view view;
+    if (!read_line_view(view, timeout)) {
+        return false;
+    }
+    line.assign(view.data(), view.size());
+    return true;
 }
 
-file& file::operator=(file&& other) {
-    if (this != &other) {
-        this->close();
-        free(buffer_);
+bool follower::read_line_view(std::string_view& line, std::chrono::milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!stopped_.load(std::memory_order_acquire)) {
+        if (next_line(line)) {
+            return true;
+        }
+        if (fill() || check_file()) {
+            continue;
+        }
+        auto wait_for = std::chrono::milliseconds(-1);
+        if (timeout.count() >= 0) {
+            auto left = deadline - std::chrono::steady_clock::now();
+            if (left <= std::chrono::steady_clock::duration::zero()) {
+                return false;
+            }
+            // Round up so the last wait doesn't spin at 0 ms
+            wait_for = std::chrono::duration_cast<std::chrono::milliseconds>(left) + std::chrono::milliseconds(1);
+        }
+        wait(wait_for);
+    }
+    return false;
+}
 
-        file_ = std::move(other.file_);
-        buffer_ = other.buffer_;
-        buf_cap_ = other.buf_cap_;
-        buf_size_ = other.buf_size_;
-        buf_i_ = other.buf_i_;
+bool follower::next_line(std::string_view& line) {
+    const char* begin = pending_.data() + pending_i_;
+    const char* end = pending_.data() + pending_.size();
+    const char* nl = detail::find_byte(begin + scanned_, end, '\n');
+    if (nl == end) {
+        scanned_ = static_cast<size_t>(end - begin);
+        if (last_line_) {
+            // What's left of a rotated file is its last line, like read_line at end of file
+            last_line_ = false;
+            if (begin != end) {
+                line = std::string_view(begin, static_cast<size_t>(end - begin));
+                pending_i_ = pending_.size();
+                scanned_ = 0;
+                return true;
+            }
+        }
+        return false;
+    }
+    size_t len = static_cast<size_t>(nl - begin);
+    pending_i_ += len + 1;
+    scanned_ = 0;
+    if (len > 0 && begin[len - 1] == '\r') {
+        len--;
+    }
+    line = std::string_view(begin, len);
+    return true;
+}
 
-        other.buffer_ = nullptr;
-        other.buf_cap_ = 0;
-        other.buf_size_ = 0;
-        other.buf_i_ = 0;
+bool follower::fill() {
+    // Move the held back partial line to the front so pending_ only grows with long lines
+    if (pending_i_ > 0) {
+        pending_.erase(0, pending_i_);
+        pending_i_ = 0;
+    }
+    size_t old_size = pending_.size();
+    detail::resize_uninitialized(pending_, old_size + chunk_size_);
+    size_t n = file_.read(&pending_[old_size], chunk_size_);
+    pending_.resize(old_size + n);
+    pos_ += static_cast<int64_t>(n);
+    return n > 0;
+}
+
+bool follower::check_file() {
+#ifdef _WIN32
+    struct _stat fd_st;
+    if (::_fstat(file_.fd(), &fd_st) < 0) {
+        throw_errno_exception(errno);
+    }
+#else
+    struct stat fd_st;
+    if (::fstat(file_.fd(), &fd_st) < 0) {
+        throw_errno_exception(errno);
+    }
+#endif
+    if (fd_st.st_size < pos_) {
+        file_.seek(0, seek_mode::set);
+        pos_ = 0;
+        pending_.clear();
+        pending_i_ = 0;
+        scanned_ = 0;
+        truncations_++;
+        return true;
+    }
+
+#ifdef _WIN32
+    // Files opened here can't be renamed or removed, so they can't be rotated
+    return false;
+#else
+    struct stat path_st;
+    if (::stat(path_.c_str(), &path_st) < 0) {
+        // Renamed or removed and nothing in its place yet, the writer may still be appending to it
+        return false;
+    }
+    if (path_st.st_ino == fd_st.st_ino && path_st.st_dev == fd_st.st_dev) {
+        return false;
+    }
+    if (pending_i_ < pending_.size()) {
+        last_line_ = true;
+        return true;
+    }
+    try {
+        file_ = raw(path_, mode::read, opts_);
+    } catch (const std::exception&) {
+        // Gone again, wait for the next one
+        return false;
     }
-    return *this;
+    pos_ = 0;
+    pending_.clear();
+    pending_i_ = 0;
+    scanned_ = 0;
+    rotations_++;
+    watch();
+    return true;
+#endif
 }
 
-file::~file() {
-    close();
-    free(buffer_);
+void follower::wait(std::chrono::milliseconds timeout) {
+#ifdef _WIN32
+    HANDLE handles[2] = {change_, stop_event_};
+    DWORD ms = (timeout.count() < 0) ? INFINITE : static_cast<DWORD>((std::min)(timeout.count(), static_cast<decltype(timeout.count())>(INFINITE - 1)));
+    if (::WaitForMultipleObjects(2, handles, FALSE, ms) == WAIT_OBJECT_0) {
+        ::FindNextChangeNotification(change_);
+    }
+#else
+    int ms = (timeout.count() < 0) ? -1 : static_cast<int>((std::min)(timeout.count(), static_cast<decltype(timeout.count())>(INT32_MAX)));
+#if defined(__linux__)
+    struct pollfd fds[2] = {{inotify_, POLLIN, 0}, {stop_pipe_[0], POLLIN, 0}};
+    if (::poll(fds, 2, ms) < 0 && errno != EINTR) {
+        throw_errno_exception(errno);
+    }
+    if (fds[0].revents & POLLIN) {
+        // Only that something changed matters, the events themselves are dropped
+        alignas(struct inotify_event) char events[4096];
+        while (::read(inotify_, events, sizeof(events)) > 0) {
+        }
+    }
+#elif defined(FILE_KQUEUE)
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    struct kevent events[4];
+    if (::kevent(kqueue_, nullptr, 0, events, 4, (ms < 0) ? nullptr : &ts) < 0 && errno != EINTR) {
+        throw_errno_exception(errno);
+    }
+#else
+    // No change notifications here, check again every 100 ms
+    struct pollfd fd = {stop_pipe_[0], POLLIN, 0};
+    ::poll(&fd, 1, (ms < 0) ? 100 : (std::min)(ms, 100));
+#endif
+#endif
 }
 
-bool file::can_read() const {
-    return file_.can_read();
+void follower::stop() {
+    stopped_.store(true, std::memory_order_release);
+#ifdef _WIN32
+    ::SetEvent(stop_event_);
+#else
+    char c = 0;
+    // The pipe is never drained so it stays readable once stopped
+    if (::write(stop_pipe_[1], &c, 1) < 0) {
+        // Full means readable already
+    }
+#endif
 }
 
-bool file::can_write() const {
-    return file_.can_write();
+uint64_t follower::truncations() const {
+    return truncations_;
 }
 
-mode file::mode() const {
-    return file_.mode();
+uint64_t follower::rotations() const {
+    return rotations_;
 }
 
-size_t file::read(void* buffer, size_t count) {
-    if (closed()) {
-        throw std::runtime_error("Can't read from closed file");
+async::async(unsigned queue_depth, size_t nthreads) : depth_((std::max)(queue_depth, 1u)) {
+#ifdef FILE_IO_URING
+    if (uring_setup(depth_)) {
+        threads_.emplace_back([this] { run_reaper(); });
+        return;
     }
-    if (mode() != mode::read) {
-        throw std::runtime_error("File not opened for reading");
+#endif
+    if (nthreads == 0) {
+        nthreads = (std::max)(std::thread::hardware_concurrency(), 1u);
     }
-
-    size_t read = 0;
-    while (true) {
-        size_t available = buf_size_ - buf_i_;
-        size_t copy_size = (std::min)(count - read, available);
-
-        memcpy(buffer, buffer_ + buf_i_, copy_size);
-        buf_i_ += copy_size;
-        read += copy_size;
-
-        if (read == count) {
-            return read;
-        }
-
-        buf_size_ = file_.read(buffer_, buf_cap_);
-        buf_i_ = 0;
-
-        if (buf_size_ == 0) {
-            return read;
-        }
+    for (size_t t = 0; t < nthreads; t++) {
+        threads_.emplace_back([this] { run_worker(); });
     }
 }
 
-std::string file::read(int64_t count) {
-    if (closed()) {
-        throw std::runtime_error("Can't read from closed file");
-    }
-    if (mode() != mode::read) {
-        throw std::runtime_error("File not opened for reading");
+async::~async() {
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        stop_ = true;
     }
-
-    if (count < 0) {
-        size_t available = buf_size_ - buf_i_;
-        count = size() - tell() + available;
-        if (count < 0) {
-            throw std::runtime_error("File offset beyond end of file");
+    cv_.notify_all();
+#ifdef FILE_IO_URING
+    if (uring()) {
+        // Wake the reaper to stop
+        uint64_t one = 1;
+        if (::write(event_fd_, &one, sizeof(one)) < 0) {
+            // Only fails if the count would overflow, which leaves it readable anyway
         }
     }
+#endif
+    for (auto& t : threads_) {
+        t.join();
+    }
+#ifdef FILE_IO_URING
+    uring_teardown();
+#endif
+}
 
-    std::string ret;
-    ret.reserve(static_cast<size_t>(count));
+std::future<size_t> async::read_at(const raw& f, int64_t offset, void* buffer, size_t count) {
+    op* o = new op{&f, offset, static_cast<char*>(buffer), count, false, {}, {}};
+    auto ret = o->promise.get_future();
+    queue(o);
+    return ret;
+}
 
-    size_t read = 0;
-    while (true) {
-        size_t available = buf_size_ - buf_i_;
-        size_t copy_size = (std::min)(static_cast<size_t>(count) - read, available);
-        ret.append(buffer_ + buf_i_, copy_size);
-    
-        buf_i_ += copy_size;
-        read += copy_size;
+std::future<size_t> async::write_at(const raw& f, int64_t offset, const void* buffer, size_t count) {
+    op* o = new op{&f, offset, static_cast<char*>(const_cast<void*>(buffer)), count, true, {}, {}};
+    auto ret = o->promise.get_future();
+    queue(o);
+    return ret;
+}
 
-        if (read == static_cast<size_t>(count)) {
-            return ret;
-        }
+void async::read_at(const raw& f, int64_t offset, void* buffer, size_t count, callback done) {
+    queue(new op{&f, offset, static_cast<char*>(buffer), count, false, {}, std::move(done)});
+}
 
-        buf_size_ = file_.read(buffer_, buf_cap_);
-        buf_i_ = 0;
+void async::write_at(const raw& f, int64_t offset, const void* buffer, size_t count, callback done) {
+    queue(new op{&f, offset, static_cast<char*>(const_cast<void*>(buffer)), count, true, {}, std::move(done)});
+}
 
-        if (buf_size_ == 0) {
-            return ret;
-        }
+void async::queue(op* o) {
+    std::exception_ptr error;
+    if (o->f->closed()) {
+        error = std::make_exception_ptr(std::runtime_error("Can't queue operation on closed file"));
+    } else if (o->offset < 0) {
+        error = std::make_exception_ptr(std::runtime_error("Can't read or write at a negative offset"));
+    } else if (o->write && o->f->mode() == mode::append) {
+        error = std::make_exception_ptr(std::runtime_error("Can't write at an offset in append mode"));
+    }
+    if (error) {
+        complete(o, 0, error);
+        return;
     }
-}
 
-std::vector<uint8_t> file::read_bytes(int64_t count) {
-    if (closed()) {
-        throw std::runtime_error("Can't read from closed file");
+    bool full = false;
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        pending_.push_back(o);
+        full = pending_.size() >= depth_;
     }
-    if (mode() != mode::read) {
-        throw std::runtime_error("File not opened for reading");
+    if (full) {
+        submit();
     }
+}
 
-    if (count < 0) {
-        size_t available = buf_size_ - buf_i_;
-        count = size() - tell() + available;
-        if (count < 0) {
-            throw std::runtime_error("File offset beyond end of file");
+void async::submit() {
+    std::unique_lock<std::mutex> lock(m_);
+#ifdef FILE_IO_URING
+    if (uring()) {
+        std::vector<op*> failed;
+        std::exception_ptr error = uring_submit(lock, failed);
+        lock.unlock();
+        for (op* o : failed) {
+            complete(o, 0, error);
         }
+        return;
     }
+#endif
+    inflight_ += pending_.size();
+    work_.insert(work_.end(), pending_.begin(), pending_.end());
+    pending_.clear();
+    lock.unlock();
+    cv_.notify_all();
+}
 
-    std::vector<uint8_t> ret;
-    ret.reserve(static_cast<size_t>(count));
-
-    size_t read = 0;
-    while (true) {
-        size_t available = buf_size_ - buf_i_;
-        size_t copy_size = (std::min)(static_cast<size_t>(count) - read, available);
-        ret.insert(ret.end(), buffer_ + buf_i_, buffer_ + buf_i_ + copy_size);
-    
-        buf_i_ += copy_size;
-        read += copy_size;
-
-        if (read == static_cast<size_t>(count)) {
-            return ret;
-        }
+void async::wait() {
+    submit();
+    std::unique_lock<std::mutex> lock(m_);
+    cv_.wait(lock, [&] { return inflight_ == 0; });
+}
 
-        buf_size_ = file_.read(buffer_, buf_cap_);
-        buf_i_ = 0;
+bool async::uring() const {
+#ifdef FILE_IO_URING
+    return ring_fd_ >= 0;
+#else
+    return false;
+#endif
+}
 
-        if (buf_size_ == 0) {
-            return ret;
-        }
+void async::complete(op* o, size_t bytes, std::exception_ptr error) {
+    if (o->done) {
+        o->done(bytes, error);
+    } else if (error) {
+        o->promise.set_exception(error);
+    } else {
+        o->promise.set_value(bytes);
     }
+    delete o;
 }
 
-size_t file::read_into_capacity(std::vector<uint8_t>& vec) {
-    if (closed()) {
-        throw std::runtime_error("Can't read from closed file");
-    }
-    if (mode() != mode::read) {
-        throw std::runtime_error("File not opened for reading");
+std::exception_ptr async::errno_error(int err) {
+    try {
+        throw_errno_exception(err);
+    } catch (...) {
+        return std::current_exception();
     }
+    return nullptr;
+}
 
-    size_t read = 0;
+void async::run_worker() {
     while (true) {
-        size_t available = buf_size_ - buf_i_;
-        size_t copy_size = (std::min)(vec.capacity() - vec.size(), available);
-
-        vec.insert(vec.end(), buffer_ + buf_i_, buffer_ + buf_i_ + copy_size);
-        buf_i_ += copy_size;
-        read += copy_size;
-
-        if (vec.capacity() == vec.size()) {
-            return read;
+        op* o = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(m_);
+            cv_.wait(lock, [&] { return stop_ || !work_.empty(); });
+            if (work_.empty()) {
+                return;
+            }
+            o = work_.front();
+            work_.pop_front();
         }
 
-        buf_size_ = file_.read(buffer_, buf_cap_);
-        buf_i_ = 0;
+        size_t bytes = 0;
+        std::exception_ptr error;
+        try {
+            bytes = o->write ? o->f->write_at(o->offset, o->buffer, o->count) 
+                             : o->f->read_at(o->offset, o->buffer, o->count);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        complete(o, bytes, error);
 
-        if (buf_size_ == 0) {
-            return read;
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            inflight_--;
         }
+        cv_.notify_all();
     }
 }
 
-bool file::read_line(std::string& line) {
-    if (closed()) {
-        throw std::runtime_error("Can't read from closed file");
-    }
-    if (mode() != mode::read) {
-        throw std::runtime_error("File not opened for reading");
+#ifdef FILE_IO_URING
+bool async::uring_setup(unsigned entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &p));
+    if (fd < 0) {
+        // Not supported by this kernel or not allowed here
+        return false;
     }
+    ring_fd_ = fd;
+    sq_entries_ = p.sq_entries;
+    cq_entries_ = p.cq_entries;
 
-    size_t start = buf_i_;
-    line.clear();
-
-    while(true) {
-        if (buf_i_ == buf_size_) {
-            line.append(buffer_ + start, buf_i_ - start);
-            buf_size_ = file_.read(buffer_, buf_cap_);
-
-            buf_i_ = 0;
-            start = 0;
+    sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        sq_ring_size_ = cq_ring_size_ = (std::max)(sq_ring_size_, cq_ring_size_);
+    }
 
-            if (buf_size_ == 0) {
-                return !line.empty();
-            }
+    sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 
+                      IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+        sq_ring_ = nullptr;
+        uring_teardown();
+        return false;
+    }
+    if (single_mmap) {
+        cq_ring_ = sq_ring_;
+    } else {
+        cq_ring_ = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 
+                          IORING_OFF_CQ_RING);
+        if (cq_ring_ == MAP_FAILED) {
+            cq_ring_ = nullptr;
+            uring_teardown();
+            return false;
         }
+    }
+    sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 
+                        IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        uring_teardown();
+        return false;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
 
-        if (buffer_[buf_i_] == '\n') {
-            size_t end = buf_i_ - start;
-            end -= (buf_i_ > 0 && buffer_[buf_i_ - 1] == '\r') ? 1 : 0;
-            line.append(buffer_ + start, end);
-            buf_i_++;
-            break;
-        }
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
 
-        buf_i_++;
+    // IORING_OP_READ and IORING_OP_WRITE came with probing in 5.6, older kernels use the thread pool
+    const unsigned probe_ops = 256;
+    std::vector<char> probe_buf(sizeof(io_uring_probe) + probe_ops * sizeof(io_uring_probe_op));
+    auto* probe = reinterpret_cast<io_uring_probe*>(probe_buf.data());
+    if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, probe_ops) < 0 ||
+        probe->last_op < IORING_OP_WRITE ||
+        !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ||
+        !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)) {
+        uring_teardown();
+        return false;
     }
 
+    // The reaper waits on an eventfd rather than in io_uring_enter, so stopping it doesn't need the ring
+    event_fd_ = ::eventfd(0, EFD_CLOEXEC);
+    if (event_fd_ < 0 || ::syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &event_fd_, 1) < 0) {
+        uring_teardown();
+        return false;
+    }
     return true;
 }
 
-size_t file::write(const void* buffer, size_t count) {
-    if (closed()) {
-        throw std::runtime_error("Can't write to closed file");
+void async::uring_teardown() {
+    if (sqes_) {
+        ::munmap(sqes_, sqes_size_);
     }
-    if (mode() != mode::write || mode() != mode::append) {
-        throw std::runtime_error("File not opened for writing");
+    if (cq_ring_ && cq_ring_ != sq_ring_) {
+        ::munmap(cq_ring_, cq_ring_size_);
     }
-
-    size_t written = 0;
-    while (written != count) {
-        size_t cap_remaining = buf_cap_ - buf_i_;
-        size_t copy_size = (std::min)(count - written, cap_remaining);
-        memcpy(buffer_ + buf_i_, static_cast<const char*>(buffer) + written, copy_size);
-        buf_i_ += copy_size;
-        written += copy_size;
-
-        if (buf_i_ == buf_cap_) {
-            flush();
-        }
+    if (sq_ring_) {
+        ::munmap(sq_ring_, sq_ring_size_);
     }
-    return written;
-}
-
-size_t file::write(std::string_view sv) {
-    return write(sv.data(), sv.size());
-}
-
-void file::flush() {
-    if (closed()) {
-        throw std::runtime_error("Can't flush to closed file");
+    if (ring_fd_ >= 0) {
+        ::close(ring_fd_);
     }
-    if (mode() != mode::write || mode() != mode::append) {
-        throw std::runtime_error("File not opened for writing");
+    if (event_fd_ >= 0) {
+        ::close(event_fd_);
     }
-
-    file_.write(buffer_, buf_i_);
-    buf_i_ = 0; 
+    sqes_ = nullptr;
+    cq_ring_ = nullptr;
+    sq_ring_ = nullptr;
+    ring_fd_ = -1;
+    event_fd_ = -1;
 }
 
-void file::close() {
-    if (can_write()) {
-        flush();
+std::exception_ptr async::uring_submit(std::unique_lock<std::mutex>& lock, std::vector<op*>& failed) {
+    // Completions are only made room for by the reaper, so it can't wait for them itself
+    bool on_reaper = std::this_thread::get_id() == threads_.front().get_id();
+    std::exception_ptr error;
+    // Sent operations come off the front, pending_ may change while waiting
+    while (!pending_.empty() && !uring_error_) {
+        if (inflight_ >= cq_entries_) {
+            // Never have more in flight than the completion queue holds
+            if (on_reaper) {
+                break;
+            }
+            cv_.wait(lock, [&] { return inflight_ < cq_entries_ || uring_error_; });
+            continue;
+        }
+        unsigned n = static_cast<unsigned>((std::min)({pending_.size(), 
+                                                       static_cast<size_t>(cq_entries_ - inflight_), 
+                                                       static_cast<size_t>(sq_entries_)}));
+        for (unsigned j = 0; j < n; j++) {
+            uring_push(pending_[j]);
+        }
+        unsigned unsent = n;
+        int err = uring_enter(unsent);
+        if (err != 0) {
+            // Nothing reads the ring outside io_uring_enter, so the entries it didn't take can be taken back
+            __atomic_store_n(sq_tail_, *sq_tail_ - unsent, __ATOMIC_RELEASE);
+        }
+        unsigned sent = n - unsent;
+        submitted_.insert(pending_.begin(), pending_.begin() + sent);
+        inflight_ += sent;
+        pending_.erase(pending_.begin(), pending_.begin() + sent);
+        if (err != 0) {
+            error = errno_error(err);
+            break;
+        }
     }
-    file_.close();
+    if (uring_error_ && !error) {
+        error = uring_error_;
+    }
+    if (error) {
+        failed.insert(failed.end(), pending_.begin(), pending_.end());
+        pending_.clear();
+    }
+    deferred_ = !pending_.empty() && on_reaper;
+    return error;
 }
 
-bool file::closed() const {
-    return file_.closed();
-}
+void async::uring_push(op* o) {
+    // Only called with m_ held and a free entry, which uring_submit() makes sure of
+    unsigned tail = *sq_tail_;
+    unsigned index = tail & *sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
 
-int64_t file::seek(int64_t offset, seek_mode mode) {
-    int64_t ret = file_.seek(offset, mode);
-    buf_i_ = 0;
-    buf_size_ = 0;
-    return ret;
-}
+    int fd = o->f->fd();
+    auto fixed = fixed_files_.find(fd);
+    if (fixed != fixed_files_.end()) {
+        sqe->fd = static_cast<int>(fixed->second);
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = fd;
+    }
 
-int64_t file::tell() const {
-    return file_.tell();
-}
+    sqe->opcode = o->write ? IORING_OP_WRITE : IORING_OP_READ;
+    for (size_t i = 0; i < fixed_buffers_.size(); i++) {
+        char* base = static_cast<char*>(fixed_buffers_[i].first);
+        if (o->buffer >= base && o->buffer + o->count <= base + fixed_buffers_[i].second) {
+            sqe->opcode = o->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->buf_index = static_cast<uint16_t>(i);
+            break;
+        }
+    }
+    sqe->off = static_cast<uint64_t>(o->offset);
+    sqe->addr = reinterpret_cast<uint64_t>(o->buffer);
+    // Like read(2) a single operation moves at most this many bytes
+    sqe->len = static_cast<uint32_t>((std::min)(o->count, static_cast<size_t>(0x7ffff000)));
+    sqe->user_data = reinterpret_cast<uint64_t>(o);
 
-void file::sync() const {
-    file_.sync();
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
 }
 
-int64_t file::size() const {
-    return file_.size();
+int async::uring_enter(unsigned& to_submit) {
+    while (to_submit > 0) {
+        long ret = ::syscall(__NR_io_uring_enter, ring_fd_, to_submit, 0, 0, nullptr, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            return errno;
+        }
+        to_submit -= static_cast<unsigned>(ret);
+    }
+    return 0;
 }
 
-int64_t file::block_size() const {
-    return file_.block_size();
-}
+void async::run_reaper() {
+    std::vector<std::pair<op*, int>> done;
+    while (true) {
+        uint64_t events = 0;
+        // Blocks until the kernel has posted completions or the destructor wakes it to stop
+        if (::read(event_fd_, &events, sizeof(events)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Nothing would see completions anymore, so fail everything in flight and any later 
+            // operations. The kernel may still finish the operations that were already sent.
+            std::exception_ptr error = errno_error(errno);
+            std::vector<op*> lost;
+            size_t lost_inflight = 0;
+            {
+                std::lock_guard<std::mutex> lock(m_);
+                uring_error_ = error;
+                lost_inflight = submitted_.size();
+                lost.assign(submitted_.begin(), submitted_.end());
+                submitted_.clear();
+                lost.insert(lost.end(), pending_.begin(), pending_.end());
+                pending_.clear();
+            }
+            for (op* o : lost) {
+                complete(o, 0, error);
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_);
+                inflight_ -= lost_inflight;
+            }
+            cv_.notify_all();
+            return;
+        }
 
-file::lines_range file::lines() {
-    return {*this};
+        done.clear();
+        {
+            // Operations were pushed with m_ held, taking it here makes them visible to this thread
+            std::lock_guard<std::mutex> lock(m_);
+            unsigned head = *cq_head_;
+            while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+                io_uring_cqe* cqe = &cqes_[head & *cq_mask_];
+                op* o = reinterpret_cast<op*>(cqe->user_data);
+                submitted_.erase(o);
+                done.emplace_back(o, cqe->res);
+                head++;
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            if (done.empty() && stop_) {
+                return;
+            }
+        }
+
+        for (auto& d : done) {
+            std::exception_ptr error = (d.second < 0) ? errno_error(-d.second) : nullptr;
+            complete(d.first, (d.second < 0) ? 0 : static_cast<size_t>(d.second), error);
+        }
+        std::vector<op*> failed;
+        std::exception_ptr error;
+        {
+            std::unique_lock<std::mutex> lock(m_);
+            inflight_ -= done.size();
+            if (deferred_) {
+                // Callbacks queued more than fit, send the rest now there's room
+                error = uring_submit(lock, failed);
+            }
+        }
+        cv_.notify_all();
+        for (op* o : failed) {
+            complete(o, 0, error);
+        }
+    }
 }
+#endif
 
-lines_iterator file::lines_range::begin() {
-    return lines_iterator(f_);
+void async::register_files(const std::vector<const raw*>& files) {
+#ifdef FILE_IO_URING
+    if (!uring()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_);
+    if (!fixed_files_.empty()) {
+        ::syscall(__NR_io_uring_register, ring_fd_, IORING_UNREGISTER_FILES, nullptr, 0);
+        fixed_files_.clear();
+    }
+    if (files.empty()) {
+        return;
+    }
+    std::vector<int> fds;
+    for (const raw* f : files) {
+        fds.push_back(f->fd());
+    }
+    if (::syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES, fds.data(), fds.size()) < 0) {
+        throw_errno_exception(errno);
+    }
+    for (size_t i = 0; i < fds.size(); i++) {
+        fixed_files_[fds[i]] = static_cast<unsigned>(i);
+    }
+#else
+    (void)files;
+#endif
 }
 
-eof_sentinel file::lines_range::end() {
-    return {};
+void async::register_buffers(const std::vector<std::pair<void*, size_t>>& buffers) {
+#ifdef FILE_IO_URING
+    if (!uring()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_);
+    if (!fixed_buffers_.empty()) {
+        ::syscall(__NR_io_uring_register, ring_fd_, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+        fixed_buffers_.clear();
+    }
+    if (buffers.empty()) {
+        return;
+    }
+    std::vector<iovec> iovs;
+    for (auto& b : buffers) {
+        iovs.push_back({b.first, b.second});
+    }
+    if (::syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS, iovs.data(), iovs.size()) < 0) {
+        throw_errno_exception(errno);
+    }
+    fixed_buffers_ = buffers;
+#else
+    (void)buffers;
+#endif
 }
 
 } // namespace file
-
@@ -1,16 +1,46 @@
 
 #include <catch.hpp>
 
+#include <atomic>
 #include <fstream>
+#include <iostream>
+#include <thread>
 #include <sstream>
 #include "../file.h"
 
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
 #ifdef _WIN32
 static const char* test_txt = "this is a line\r\nthis is line 2\r\nend\r\n";
 #else
 static const char* test_txt = "this is a line\nthis is line 2\nend\n";
 #endif
 
+// Returns a counter from /proc/self/io, or -1 where there isn't one
+static int64_t io_counter(const std::string& name) {
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    int64_t value = 0;
+    while (io >> key >> value) {
+        if (key == name) {
+            return value;
+        }
+    }
+    return -1;
+}
+
+// Returns the number of read syscalls made by this process so far, or -1 if unknown
+static int64_t read_syscalls() {
+    return io_counter("syscr:");
+}
+
+// Returns the number of write syscalls made by this process so far, or -1 if unknown
+static int64_t write_syscalls() {
+    return io_counter("syscw:");
+}
+
 TEST_CASE("Read a file", "[unit]") {
 
     auto f = file::open("test.txt");
@@ -57,6 +87,17 @@ TEST_CASE("Read a file", "[unit]") {
         REQUIRE(count == 3);
     }
 
+    SECTION("Can read line views as iterator") {
+        std::vector<std::string> lines;
+        for (std::string_view line : f.lines_view()) {
+            lines.emplace_back(line);
+        }
+        REQUIRE(lines.size() == 3);
+        REQUIRE(lines[0] == "this is a line");
+        REQUIRE(lines[1] == "this is line 2");
+        REQUIRE(lines[2] == "end");
+    }
+
     SECTION("Can read bytes as a vector") {
         std::vector<uint8_t> v = f.read_bytes(5);
         REQUIRE(v.size() == 5);
@@ -67,6 +108,21 @@ TEST_CASE("Read a file", "[unit]") {
         REQUIRE(v[0] == 'i');
     }
 
+    SECTION("Can read whole file into an existing string") {
+        std::string s(1000, 'x');
+        const char* data = s.data();
+        REQUIRE(f.read_into(s) == static_cast<size_t>(f.size()));
+        REQUIRE(s == test_txt);
+        REQUIRE(s.data() == data);
+    }
+
+    SECTION("Can read rest of file into an existing vector") {
+        f.read(5);
+        std::vector<uint8_t> v;
+        REQUIRE(f.read_into(v) == static_cast<size_t>(f.size()) - 5);
+        REQUIRE(std::string(v.begin(), v.end()) == test_txt + 5);
+    }
+
     SECTION("Can read bytes into an existing vector's capacity") {
         std::vector<uint8_t> v;
         v.reserve(5);
@@ -102,6 +158,43 @@ TEST_CASE("Read a file", "[unit]") {
         REQUIRE(f.read(2) == "is");
     }
 
+    SECTION("Tell accounts for buffered data") {
+        f.read(5);
+        REQUIRE(f.tell() == 5);
+        std::string line;
+        f.read_line(line);
+        REQUIRE(f.tell() == 15);
+        REQUIRE(f.size() - f.tell() == static_cast<int64_t>(strlen(test_txt)) - 15);
+    }
+
+    SECTION("Can seek within the buffer") {
+        REQUIRE(f.read(10) == "this is a ");
+        REQUIRE(f.seek(-5, file::seek_mode::cur) == 5);
+        REQUIRE(f.read(2) == "is");
+        REQUIRE(f.seek(0, file::seek_mode::set) == 0);
+        REQUIRE(f.read(4) == "this");
+        REQUIRE(f.seek(-4, file::seek_mode::end) == f.size() - 4);
+        REQUIRE(f.read().substr(0, 3) == "end");
+        REQUIRE_THROWS(f.seek(-100, file::seek_mode::cur));
+    }
+
+    SECTION("Can seek after reads that bypass the buffer") {
+        std::string expected = file::open("words").read();
+        file::options opts;
+        opts.buffer_size = 1000;
+        auto words = file::open("words", file::mode::read, opts);
+        std::string big(5000, '\0');
+        REQUIRE(words.read(10) == expected.substr(0, 10));
+        REQUIRE(words.read(&big[0], big.size()) == big.size());
+        REQUIRE(words.seek(-5, file::seek_mode::cur) == 5005);
+        REQUIRE(words.read(5) == expected.substr(5005, 5));
+
+        std::string a(3000, '\0'), b(3000, '\0');
+        REQUIRE(words.readv({{&a[0], a.size()}, {&b[0], b.size()}}) == 6000);
+        REQUIRE(words.seek(-5, file::seek_mode::cur) == 11005);
+        REQUIRE(words.read(5) == expected.substr(11005, 5));
+    }
+
     SECTION("Move construct") {
         file::file f2(std::move(f));
 
@@ -121,52 +214,2221 @@ TEST_CASE("Read a file", "[unit]") {
     }
 }
 
-TEST_CASE("Benchmark words", "[bench]") {
-    BENCHMARK("file wc") {
-        auto f = file::open("words");
-        uint64_t count = 0;
+TEST_CASE("Every line reader splits lines the same", "[unit]") {
+    using lines = std::vector<std::string>;
+    for (std::string contents : {"a\r\nb\r", "a\r", "\r", "a\r\n", "x\ny\r\r", "a,b\r\nc,d\r"}) {
+        file::open("write_test.txt", file::mode::write).write(contents);
+        for (size_t buffer_size : {1, 2, 1000}) {
+            file::options opts;
+            opts.buffer_size = buffer_size;
+            lines expected;
+            {
+                auto f = file::open("write_test.txt", file::mode::read, opts);
+                std::string line;
+                while (f.read_line(line)) {
+                    expected.push_back(line);
+                }
+            }
+
+            lines got;
+            auto f = file::open("write_test.txt", file::mode::read, opts);
+            for (std::string_view line : f.lines_view()) {
+                got.emplace_back(line);
+            }
+            REQUIRE(got == expected);
+
+            got.clear();
+            f = file::open("write_test.txt", file::mode::read, opts);
+            for (const auto& record : f.records('\t')) {
+                got.emplace_back(record[0]);
+            }
+            REQUIRE(got == expected);
+
+            got.clear();
+            f = file::open("write_test.txt", file::mode::read, opts);
+            for (std::string_view line : f.reverse_lines(buffer_size)) {
+                got.emplace(got.begin(), line);
+            }
+            REQUIRE(got == expected);
+
+            got.clear();
+            f.parallel_lines(2, [&](std::string_view line) { got.emplace_back(line); }, 
+                             file::line_order::ordered, buffer_size);
+            REQUIRE(got == expected);
+        }
+
+        lines got;
+        auto m = file::open<file::mapped>("write_test.txt");
+        for (std::string_view line : m.lines()) {
+            got.emplace_back(line);
+        }
+        file::line_index index("write_test.txt");
+        REQUIRE(index.size() == got.size());
+        for (size_t i = 0; i < index.size(); i++) {
+            REQUIRE(index.line_at(i) == got[i]);
+        }
+        auto f = file::open("write_test.txt");
+        std::string line;
+        for (const std::string& l : got) {
+            REQUIRE(f.read_line(line));
+            REQUIRE(line == l);
+        }
+        REQUIRE_FALSE(f.read_line(line));
+    }
+}
+
+TEST_CASE("find_byte matches memchr", "[unit]") {
+    std::string haystack(100, 'a');
+    for (size_t len = 0; len <= haystack.size(); len++) {
+        for (size_t pos = 0; pos < len; pos++) {
+            haystack[pos] = '\n';
+            const char* begin = haystack.data();
+            REQUIRE(file::detail::find_byte(begin, begin + len, '\n') == begin + pos);
+            haystack[pos] = 'a';
+        }
+        const char* begin = haystack.data();
+        REQUIRE(file::detail::find_byte(begin, begin + len, '\n') == begin + len);
+    }
+}
+
+TEST_CASE("find_either_byte finds the first of two bytes", "[unit]") {
+    std::string haystack(100, 'a');
+    for (size_t len = 0; len <= haystack.size(); len++) {
+        const char* begin = haystack.data();
+        for (size_t pos = 0; pos < len; pos++) {
+            haystack[pos] = ',';
+            REQUIRE(file::detail::find_either_byte(begin, begin + len, ',', '\n') == begin + pos);
+            if (pos + 1 < len) {
+                haystack[pos + 1] = '\n';
+                REQUIRE(file::detail::find_either_byte(begin, begin + len, '\n', ',') == begin + pos);
+                haystack[pos + 1] = 'a';
+            }
+            haystack[pos] = 'a';
+        }
+        REQUIRE(file::detail::find_either_byte(begin, begin + len, ',', '\n') == begin + len);
+    }
+}
+
+TEST_CASE("find_last_byte matches memrchr", "[unit]") {
+    std::string haystack(100, 'a');
+    for (size_t len = 0; len <= haystack.size(); len++) {
+        const char* begin = haystack.data();
+        for (size_t pos = 0; pos < len; pos++) {
+            haystack[pos] = '\n';
+            REQUIRE(file::detail::find_last_byte(begin, begin + len, '\n') == begin + pos);
+            if (pos > 0) {
+                haystack[0] = '\n';
+                REQUIRE(file::detail::find_last_byte(begin, begin + len, '\n') == begin + pos);
+                haystack[0] = 'a';
+            }
+            haystack[pos] = 'a';
+        }
+        REQUIRE(file::detail::find_last_byte(begin, begin + len, '\n') == begin + len);
+    }
+}
+
+TEST_CASE("Line views match lines across buffer refills", "[unit]") {
+    auto f = file::open("words");
+    auto f2 = file::open("words");
+
+    size_t count = 0;
+    std::string line;
+    for (std::string_view view : f.lines_view()) {
+        REQUIRE(f2.read_line(line));
+        REQUIRE(view == line);
+        count++;
+    }
+    REQUIRE(!f2.read_line(line));
+    REQUIRE(count > 0);
+}
+
+TEST_CASE("Reverse lines", "[unit]") {
+    auto forward = [](const std::string& path) {
+        std::vector<std::string> lines;
+        auto f = file::open(path);
         for (auto& line : f.lines()) {
-            (void)line;
-            count++;
+            lines.push_back(line);
         }
-        return count;
+        std::reverse(lines.begin(), lines.end());
+        return lines;
     };
-    
-    BENCHMARK("iostream wc") {
-        std::ifstream f("words", std::ios::in | std::ios::binary);
-        uint64_t count = 0;
-        for (std::string line; std::getline(f, line);) {
-            (void)line;
-            count++;
+    auto backward = [](const std::string& path, size_t chunk_size) {
+        std::vector<std::string> lines;
+        auto f = file::open(path);
+        for (std::string_view line : f.reverse_lines(chunk_size)) {
+            lines.emplace_back(line);
         }
-        return count;
+        return lines;
     };
 
-    BENCHMARK("file read as string") {
+    SECTION("Matches lines read forward") {
+        for (std::string contents : {"", "\n", "\n\n", "a", "a\n", "a\nb", "a\n\nb\n", "a\r\nb\r\n", 
+                                     "a\r\nb\r", "\r\n", "long line here\nx\n\nlonger line than the chunk\n"}) {
+            file::open("write_test.txt", file::mode::write).write(contents);
+            for (size_t chunk_size : {1, 2, 3, 7, 64 * 1024}) {
+                REQUIRE(backward("write_test.txt", chunk_size) == forward("write_test.txt"));
+            }
+        }
+        REQUIRE(backward("words", 1000) == forward("words"));
+    }
+
+    SECTION("Tail reads only the end") {
+        std::vector<std::string> lines = forward("words");
+        std::reverse(lines.begin(), lines.end());
+
         auto f = file::open("words");
-        return f.read(); 
-    };
+        std::vector<std::string> last = f.tail(5);
+        REQUIRE(last == std::vector<std::string>(lines.end() - 5, lines.end()));
+        REQUIRE(f.tell() == 0);
+#ifdef FILE_STATS
+        REQUIRE(f.stats().bytes_read <= 64 * 1024);
+#endif
+        REQUIRE(f.tail(0).empty());
+        REQUIRE(f.tail(lines.size() + 10) == lines);
+    }
 
-    BENCHMARK("iostream read as string (stringstream)") {
-        std::ifstream f("words", std::ios::in | std::ios::binary);
-        std::stringstream buffer;
-        buffer << f.rdbuf();
-        return buffer.str();
-    };
+    SECTION("Needs a readable, uncompressed file") {
+        auto f = file::open("write_test.txt", file::mode::write);
+        REQUIRE_THROWS(f.reverse_lines());
+    }
+}
 
-    BENCHMARK("iostream read as string (istreambuf_iterator)") {
-        std::ifstream f("words", std::ios::in | std::ios::binary);
-        return std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
-    };
+TEST_CASE("Buffer options", "[unit]") {
+    std::string expected = file::open("words").read();
 
-    BENCHMARK("iostream read as string (low level)") {
-        std::ifstream f("words", std::ios::in | std::ios::binary);
-        f.seekg(0, std::ios::end);
-        size_t size = f.tellg();
-        std::string buffer(size, ' ');
-        f.seekg(0);
-        f.read(&buffer[0], size);
-        return buffer;
+    SECTION("Can set the buffer size") {
+        file::options opts;
+        opts.buffer_size = 1000;
+        auto f = file::open("words", file::mode::read, opts);
+        REQUIRE(f.buffer_size() == 1000);
+        REQUIRE(f.read() == expected);
+    }
+
+    SECTION("Can use a caller owned buffer") {
+        char buf[7];
+        file::options opts;
+        opts.buffer = buf;
+        opts.buffer_size = sizeof(buf);
+        auto f = file::open("words", file::mode::read, opts);
+        REQUIRE(f.buffer_size() == sizeof(buf));
+
+        std::string contents;
+        for (std::string_view line : f.lines_view()) {
+            contents += line;
+            contents += '\n';
+        }
+        REQUIRE(contents == expected);
+    }
+
+    SECTION("Caller owned buffer needs a size") {
+        char buf[7];
+        file::options opts;
+        opts.buffer = buf;
+        REQUIRE_THROWS(file::open("words", file::mode::read, opts));
+    }
+
+    SECTION("Adaptive buffer grows on sequential reads") {
+        file::options opts;
+        opts.buffer_size = 4096;
+        opts.adaptive_buffer = true;
+        opts.max_buffer_size = 64 * 1024;
+        auto f = file::open("words", file::mode::read, opts);
+        size_t count = 0;
+        for (std::string_view line : f.lines_view()) {
+            count += line.size() + 1;
+        }
+        REQUIRE(count == expected.size());
+        REQUIRE(f.buffer_size() == 64 * 1024);
+    }
+
+    SECTION("Buffers are recycled through a pool") {
+        file::buffer_pool pool(1);
+        file::options opts;
+        opts.pool = &pool;
+        opts.buffer_size = 1000;
+        {
+            auto f = file::open("words", file::mode::read, opts);
+            REQUIRE(f.read() == expected);
+        }
+        REQUIRE(pool.free_buffers() == 1);
+        {
+            auto f = file::open("words", file::mode::read, opts);
+            REQUIRE(pool.free_buffers() == 0);
+            auto g = file::open("words", file::mode::read, opts);
+            REQUIRE(f.read() == expected);
+            REQUIRE(g.read() == expected);
+        }
+        // Only max_buffers are kept
+        REQUIRE(pool.free_buffers() == 1);
+
+        // Other sizes get their own buffers
+        opts.buffer_size = 500;
+        {
+            auto f = file::open("words", file::mode::read, opts);
+            REQUIRE(pool.free_buffers() == 1);
+        }
+        pool.clear();
+        REQUIRE(pool.free_buffers() == 0);
+    }
+
+    SECTION("Can reopen another file keeping the buffer") {
+        file::options opts;
+        opts.buffer_size = 64;
+        opts.pool = &file::buffer_pool::local();
+        auto f = file::open("test.txt", file::mode::read, opts);
+        std::string test = f.read();
+
+        f.reopen("words");
+        REQUIRE(f.buffer_size() == 64);
+        REQUIRE(f.tell() == 0);
+        REQUIRE(f.size() == static_cast<int64_t>(expected.size()));
+        std::string contents;
+        for (std::string_view line : f.lines_view()) {
+            contents += line;
+            contents += '\n';
+        }
+        REQUIRE(contents == expected);
+
+        f.reopen("write_test.txt", file::mode::write);
+        f.write("reopened\n");
+        f.reopen("write_test.txt", file::mode::append);
+        REQUIRE(f.tell() == 9);
+        f.write("again\n");
+        f.reopen("write_test.txt");
+        REQUIRE(f.read() == "reopened\nagain\n");
+
+        REQUIRE_THROWS(f.reopen("does_not_exist"));
+        REQUIRE(f.closed());
+        f.reopen("test.txt");
+        REQUIRE(f.read() == test);
+    }
+}
+
+TEST_CASE("Write a file", "[unit]") {
+    const char* path = "write_test.txt";
+
+    SECTION("Can write a string") {
+        {
+            auto f = file::open(path, file::mode::write);
+            REQUIRE(f.write("hello ") == 6);
+            REQUIRE(f.write("file::\n") == 7);
+        }
+        REQUIRE(file::open(path).read() == "hello file::\n");
+    }
+
+    SECTION("Can write more than the buffer holds") {
+        std::string big(100000, 'x');
+        for (size_t i = 0; i < big.size(); i += 7) {
+            big[i] = static_cast<char>('a' + i % 26);
+        }
+        {
+            file::options opts;
+            opts.buffer_size = 1000;
+            auto f = file::open(path, file::mode::write, opts);
+            f.write("small");
+            f.write(big);
+            f.write(std::string_view(big).substr(0, 999));
+            f.write("end");
+        }
+        REQUIRE(file::open(path).read() == "small" + big + big.substr(0, 999) + "end");
+    }
+
+    SECTION("Can seek while writing") {
+        {
+            auto f = file::open(path, file::mode::write);
+            f.write("hello");
+            REQUIRE(f.tell() == 5);
+            REQUIRE(f.seek(0, file::seek_mode::set) == 0);
+            f.write("J");
+            REQUIRE(f.tell() == 1);
+        }
+        REQUIRE(file::open(path).read() == "Jello");
+    }
+
+    SECTION("Can append") {
+        file::open(path, file::mode::write).write("one\n");
+        file::open(path, file::mode::append).write("two\n");
+        REQUIRE(file::open(path).read() == "one\ntwo\n");
+    }
+
+    SECTION("Tell follows appends to the end of the file") {
+        file::open(path, file::mode::write).write("one\n");
+        auto f = file::open(path, file::mode::append);
+        REQUIRE(f.tell() == 4);
+        f.seek(0, file::seek_mode::set);
+        f.write("two\n");
+        f.flush();
+        REQUIRE(f.tell() == 8);
+
+        // Another writer moves the end too
+        file::open(path, file::mode::append).write("three\n");
+        f.write("four\n");
+        REQUIRE(f.tell() == 19);
+        f.close();
+        REQUIRE(file::open(path).read() == "one\ntwo\nthree\nfour\n");
+    }
+
+    SECTION("Can't read from a file opened for writing") {
+        auto f = file::open(path, file::mode::write);
+        REQUIRE_THROWS(f.read());
+    }
+}
+
+TEST_CASE("Large reads bypass the buffer", "[unit]") {
+    std::string expected = file::open("words").read();
+    file::options opts;
+    opts.buffer_size = 1000;
+    auto f = file::open("words", file::mode::read, opts);
+
+    std::string head = f.read(10);
+    std::string middle(5000, '\0');
+    REQUIRE(f.read(&middle[0], middle.size()) == middle.size());
+    std::string tail = f.read();
+
+    REQUIRE(head + middle + tail == expected);
+}
+
+TEST_CASE("Positional reads and writes", "[unit]") {
+    SECTION("Can read at an offset without moving the file offset") {
+        auto r = file::open<file::raw>("test.txt");
+        char buf[2];
+        REQUIRE(r.read_at(5, buf, 2) == 2);
+        REQUIRE(std::string(buf, 2) == "is");
+        REQUIRE(r.tell() == 0);
+        REQUIRE(r.read_at(r.size(), buf, 2) == 0);
+    }
+
+    SECTION("Reads at offsets don't disturb buffered reads") {
+        std::string expected = file::open("words").read();
+        file::options opts;
+        opts.buffer_size = 1000;
+        auto f = file::open("words", file::mode::read, opts);
+        REQUIRE(f.read(10) == expected.substr(0, 10));
+        char buf[5000];
+        REQUIRE(f.read_at(3000, buf, sizeof(buf)) == sizeof(buf));
+        REQUIRE(std::string(buf, 10) == expected.substr(3000, 10));
+        REQUIRE(f.read(2000) == expected.substr(10, 2000));
+        REQUIRE(f.tell() == 2010);
+    }
+
+    SECTION("Can read at offsets from many threads") {
+        std::string expected = file::open("words").read();
+        auto f = file::open("words");
+
+        std::vector<std::thread> threads;
+        std::vector<int> ok(8, 0);
+        for (size_t t = 0; t < ok.size(); t++) {
+            threads.emplace_back([&, t] {
+                int good = 1;
+                std::string chunk(4096, '\0');
+                for (size_t offset = t * 512; offset < expected.size(); offset += ok.size() * 512) {
+                    size_t n = f.read_at(static_cast<int64_t>(offset), &chunk[0], chunk.size());
+                    good &= expected.compare(offset, n, chunk, 0, n) == 0;
+                }
+                ok[t] = good;
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        REQUIRE(ok == std::vector<int>(ok.size(), 1));
+    }
+
+    SECTION("Can write at an offset") {
+        {
+            auto r = file::open<file::raw>("write_test.txt", file::mode::write);
+            REQUIRE(r.write_at(4, "world", 5) == 5);
+            REQUIRE(r.write_at(0, "hey ", 4) == 4);
+            REQUIRE(r.tell() == 0);
+        }
+        REQUIRE(file::open("write_test.txt").read() == "hey world");
+
+        auto r = file::open<file::raw>("write_test.txt", file::mode::append);
+        REQUIRE_THROWS(r.write_at(0, "x", 1));
+    }
+}
+
+TEST_CASE("Parallel lines", "[unit]") {
+    auto sequential = [](const char* path) {
+        std::vector<std::string> lines;
+        auto f = file::open(path);
+        for (auto& line : f.lines()) {
+            lines.push_back(line);
+        }
+        return lines;
     };
+
+    SECTION("Lines split like read_line") {
+        file::open("write_test.txt", file::mode::write).write("a\r\n\nbb\r\nccc\n\r\nlast");
+        auto expected = sequential("write_test.txt");
+        auto f = file::open("write_test.txt");
+        for (size_t chunk = 1; chunk < 20; chunk++) {
+            std::vector<std::string> lines;
+            f.parallel_lines(3, [&](std::string_view line) { lines.emplace_back(line); }, 
+                             file::line_order::ordered, chunk);
+            REQUIRE(lines == expected);
+        }
+    }
+
+    SECTION("Ordered mode hands out lines in order") {
+        auto expected = sequential("words");
+        auto f = file::open("words");
+        std::vector<std::string> lines;
+        f.parallel_lines(4, [&](std::string_view line) { lines.emplace_back(line); }, 
+                         file::line_order::ordered, 10000);
+        REQUIRE(lines == expected);
+    }
+
+    SECTION("Unordered mode hands out every line") {
+        auto expected = sequential("words");
+        auto f = file::open("words");
+        std::mutex m;
+        std::vector<std::string> lines;
+        f.parallel_lines(4, [&](std::string_view line) {
+            std::lock_guard<std::mutex> lock(m);
+            lines.emplace_back(line);
+        }, file::line_order::unordered, 10000);
+        std::sort(lines.begin(), lines.end());
+        std::sort(expected.begin(), expected.end());
+        REQUIRE(lines == expected);
+    }
+
+    SECTION("Exceptions are rethrown") {
+        auto f = file::open("words");
+        REQUIRE_THROWS(f.parallel_lines(4, [](std::string_view) { throw std::runtime_error("stop"); }, 
+                                        file::line_order::unordered, 10000));
+        REQUIRE_THROWS(f.parallel_lines(4, [](std::string_view) { throw std::runtime_error("stop"); }, 
+                                        file::line_order::ordered, 10000));
+    }
+}
+
+TEST_CASE("Access hints", "[unit]") {
+    std::string expected = file::open("words").read();
+
+    SECTION("Hinted files read the same") {
+        for (auto access : {file::advice::normal, file::advice::sequential, file::advice::random}) {
+            file::options opts;
+            opts.access = access;
+            opts.willneed = true;
+            opts.dontneed_after_read = true;
+            REQUIRE(file::open("words", file::mode::read, opts).read() == expected);
+
+            std::string lines;
+            auto f = file::open("words", file::mode::read, opts);
+            for (std::string_view line : f.lines_view()) {
+                lines += line;
+                lines += '\n';
+            }
+            REQUIRE(lines == expected);
+
+            REQUIRE(file::open<file::mapped>("words", file::mode::read, opts).view() == expected);
+        }
+    }
+
+    SECTION("Can advise a range") {
+        auto r = file::open<file::raw>("words");
+        r.advise(file::advice::willneed, 0, 4096);
+        r.advise(file::advice::dontneed);
+        r.close();
+        REQUIRE_THROWS(r.advise(file::advice::normal));
+    }
+
+#ifdef __linux__
+    SECTION("Files that can't take hints still open") {
+        int fds[2];
+        REQUIRE(::pipe(fds) == 0);
+        REQUIRE(::write(fds[1], "piped", 5) == 5);
+        ::close(fds[1]);
+        file::options opts;
+        opts.access = file::advice::sequential;
+        opts.willneed = true;
+        auto f = file::open<file::raw>("/proc/self/fd/" + std::to_string(fds[0]), file::mode::read, opts);
+        ::close(fds[0]);
+        char buf[8];
+        REQUIRE(f.read(buf, sizeof(buf)) == 5);
+        REQUIRE(std::string(buf, 5) == "piped");
+    }
+#endif
+}
+
+TEST_CASE("Direct I/O", "[unit]") {
+    file::options opts;
+    opts.direct = true;
+    try {
+        file::open<file::raw>("words", file::mode::read, opts);
+    } catch (const std::exception&) {
+        // Some filesystems, like tmpfs, don't support direct I/O
+        return;
+    }
+    std::string expected = file::open("words").read();
+
+    SECTION("Can read") {
+        auto f = file::open("words", file::mode::read, opts);
+        REQUIRE(f.buffer_size() % f.block_size() == 0);
+        REQUIRE(f.read(3) == expected.substr(0, 3));
+        REQUIRE(f.read() == expected.substr(3));
+    }
+
+    SECTION("Can read lines") {
+        auto f = file::open("words", file::mode::read, opts);
+        std::string lines;
+        for (std::string_view line : f.lines_view()) {
+            lines += line;
+            lines += '\n';
+        }
+        REQUIRE(lines == expected);
+    }
+
+    SECTION("Can seek to unaligned offsets") {
+        auto f = file::open("words", file::mode::read, opts);
+        REQUIRE(f.seek(100001, file::seek_mode::set) == 100001);
+        REQUIRE(f.read(10) == expected.substr(100001, 10));
+        REQUIRE(f.tell() == 100011);
+    }
+
+    SECTION("Can write an unaligned tail") {
+        std::string big = expected.substr(0, 100003);
+        {
+            auto f = file::open("write_test.txt", file::mode::write, opts);
+            f.write(big.substr(0, 5001));
+            f.flush();
+            f.write(big.substr(5001));
+            REQUIRE(f.tell() == static_cast<int64_t>(big.size()));
+        }
+        REQUIRE(file::open("write_test.txt").read() == big);
+    }
+
+    SECTION("Can write after seeking to an unaligned offset") {
+        {
+            auto f = file::open("write_test.txt", file::mode::write, opts);
+            f.write(std::string(10000, 'a'));
+            f.seek(3, file::seek_mode::set);
+            f.write("bbb");
+        }
+        REQUIRE(file::open("write_test.txt").read() == "aaabbb" + std::string(9994, 'a'));
+    }
+
+    SECTION("Caller owned buffers must be aligned") {
+        std::vector<char> buf(8192 + 1);
+        opts.buffer = buf.data() + (reinterpret_cast<uintptr_t>(buf.data()) % 2 == 0 ? 1 : 0);
+        opts.buffer_size = 8192;
+        REQUIRE_THROWS(file::open("words", file::mode::read, opts));
+    }
+}
+
+TEST_CASE("Async reads and writes", "[unit]") {
+    std::string expected = file::open("words").read();
+    auto f = file::open<file::raw>("words");
+    file::async io(16, 4);
+
+    SECTION("Can read with futures") {
+        const size_t chunk = 65536;
+        std::string contents(expected.size(), '\0');
+        std::vector<std::future<size_t>> reads;
+        for (size_t offset = 0; offset < contents.size(); offset += chunk) {
+            size_t count = (std::min)(chunk, contents.size() - offset);
+            reads.push_back(io.read_at(f, static_cast<int64_t>(offset), &contents[offset], count));
+        }
+        io.submit();
+        size_t total = 0;
+        for (auto& r : reads) {
+            total += r.get();
+        }
+        REQUIRE(total == expected.size());
+        REQUIRE(contents == expected);
+    }
+
+    SECTION("Can read with callbacks") {
+        std::atomic<size_t> total{0};
+        std::vector<std::string> bufs(100, std::string(1000, '\0'));
+        for (size_t i = 0; i < bufs.size(); i++) {
+            io.read_at(f, static_cast<int64_t>(i * 1000), &bufs[i][0], 1000, 
+                       [&](size_t bytes, std::exception_ptr error) {
+                           if (!error) {
+                               total += bytes;
+                           }
+                       });
+        }
+        io.wait();
+        REQUIRE(total == 100 * 1000);
+        for (size_t i = 0; i < bufs.size(); i++) {
+            REQUIRE(bufs[i] == expected.substr(i * 1000, 1000));
+        }
+    }
+
+    SECTION("Can use registered files and buffers") {
+        std::vector<char> buf(8192);
+        io.register_files({&f});
+        io.register_buffers({{buf.data(), buf.size()}});
+        auto first = io.read_at(f, 0, buf.data(), 4096);
+        auto second = io.read_at(f, 4096, buf.data() + 4096, 4096);
+        io.submit();
+        REQUIRE(first.get() == 4096);
+        REQUIRE(second.get() == 4096);
+        REQUIRE(std::string(buf.data(), buf.size()) == expected.substr(0, buf.size()));
+        io.register_files({});
+        io.register_buffers({});
+    }
+
+    SECTION("Can write") {
+        {
+            auto w = file::open<file::raw>("write_test.txt", file::mode::write);
+            auto hello = io.write_at(w, 0, "hello ", 6);
+            auto world = io.write_at(w, 6, "world", 5);
+            io.wait();
+            REQUIRE(hello.get() == 6);
+            REQUIRE(world.get() == 5);
+        }
+        REQUIRE(file::open("write_test.txt").read() == "hello world");
+    }
+
+    SECTION("Errors are reported through the future") {
+        auto w = file::open<file::raw>("write_test.txt", file::mode::write);
+        char buf[10];
+        // Reading a file opened for writing fails in the OS
+        auto r = io.read_at(w, 0, buf, sizeof(buf));
+        io.wait();
+        REQUIRE_THROWS(r.get());
+
+        w.close();
+        auto closed = io.read_at(w, 0, buf, sizeof(buf));
+        io.wait();
+        REQUIRE_THROWS(closed.get());
+    }
+
+    SECTION("Callbacks can queue more than fits in flight") {
+        file::async small(2, 1);
+        const size_t total = 500;
+        std::string bytes(total, '\0');
+        std::atomic<size_t> queued{1};
+        std::atomic<size_t> completed{0};
+        file::async::callback next = [&](size_t, std::exception_ptr) {
+            // Each completion queues two more, so the completion thread finds the ring full
+            for (int k = 0; k < 2; k++) {
+                size_t i = queued++;
+                if (i < total) {
+                    small.read_at(f, static_cast<int64_t>(i), &bytes[i], 1, next);
+                }
+            }
+            completed++;
+        };
+        small.read_at(f, 0, &bytes[0], 1, next);
+        while (completed < total) {
+            small.wait();
+        }
+        REQUIRE(bytes == expected.substr(0, total));
+    }
+}
+
+TEST_CASE("Vectored reads and writes", "[unit]") {
+    std::string expected = file::open("words").read();
+
+    SECTION("Raw can gather and scatter") {
+        {
+            auto r = file::open<file::raw>("write_test.txt", file::mode::write);
+            REQUIRE(r.writev({"key", "=", "", "value\n"}) == 10);
+        }
+        auto r = file::open<file::raw>("write_test.txt");
+        char key[3];
+        char rest[10];
+        REQUIRE(r.readv({{key, sizeof(key)}, {rest, sizeof(rest)}}) == 10);
+        REQUIRE(std::string(key, 3) == "key");
+        REQUIRE(std::string(rest, 7) == "=value\n");
+    }
+
+    SECTION("File writes fragments in order") {
+        std::string big = expected.substr(0, 50000);
+        {
+            file::options opts;
+            opts.buffer_size = 1000;
+            auto f = file::open("write_test.txt", file::mode::write, opts);
+            REQUIRE(f.write({"header ", "key ", "payload", "\n"}) == 19);
+            REQUIRE(f.write({"big ", big, "\n"}) == big.size() + 5);
+            REQUIRE(f.write({std::string_view(big).substr(0, 990), "x", "yz"}) == 993);
+        }
+        REQUIRE(file::open("write_test.txt").read() == 
+                "header key payload\nbig " + big + "\n" + big.substr(0, 990) + "xyz");
+    }
+
+    SECTION("File reads into buffers in order") {
+        file::options opts;
+        opts.buffer_size = 1000;
+        auto f = file::open("words", file::mode::read, opts);
+        std::string a(10, '\0');
+        std::string b(5000, '\0');
+        std::string c(3, '\0');
+        REQUIRE(f.readv({{&a[0], a.size()}, {&b[0], b.size()}, {&c[0], c.size()}}) == 5013);
+        REQUIRE(a + b + c == expected.substr(0, 5013));
+
+        std::string d(5, '\0');
+        std::string e(2, '\0');
+        REQUIRE(f.readv({{&d[0], d.size()}, {&e[0], e.size()}}) == 7);
+        REQUIRE(d + e == expected.substr(5013, 7));
+        REQUIRE(f.tell() == 5020);
+
+        std::string rest(expected.size(), '\0');
+        REQUIRE(f.readv({{&rest[0], rest.size()}}) == expected.size() - 5020);
+    }
 }
 
+TEST_CASE("Async writer", "[unit]") {
+    std::string expected = file::open("words").read();
+
+    SECTION("Writes everything in order") {
+        file::options opts;
+        opts.buffer_size = 1000;
+        opts.write_buffers = 3;
+        {
+            file::async_writer w("write_test.txt", file::mode::write, opts);
+            REQUIRE(w.can_write());
+            auto r = file::open("words");
+            for (std::string_view line : r.lines_view()) {
+                REQUIRE(w.write(line) == line.size());
+                REQUIRE(w.write("\n") == 1);
+            }
+            w.flush();
+            REQUIRE(file::open("write_test.txt").read() == expected);
+            REQUIRE(w.write("tail") == 4);
+        }
+        REQUIRE(file::open("write_test.txt").read() == expected + "tail");
+    }
+
+    SECTION("Appends") {
+        {
+            file::async_writer w("write_test.txt", file::mode::write);
+            w.write("a\n");
+        }
+        {
+            file::async_writer w("write_test.txt", file::mode::append);
+            w.write("b\n");
+        }
+        REQUIRE(file::open("write_test.txt").read() == "a\nb\n");
+    }
+
+    SECTION("Large writes block or drop") {
+        file::options opts;
+        opts.buffer_size = 100;
+        SECTION("Block") {
+            {
+                file::async_writer w("write_test.txt", file::mode::write, opts);
+                REQUIRE(w.write(expected) == expected.size());
+                REQUIRE(w.dropped() == 0);
+            }
+            REQUIRE(file::open("write_test.txt").read() == expected);
+        }
+        SECTION("Drop") {
+            opts.on_full = file::backpressure::drop;
+            {
+                file::async_writer w("write_test.txt", file::mode::write, opts);
+                REQUIRE(w.write("kept") == 4);
+                REQUIRE(w.write(expected) == 0);
+                REQUIRE(w.dropped() == expected.size());
+                w.flush();
+                REQUIRE(w.write(std::string(150, 'x')) == 150);
+            }
+            REQUIRE(file::open("write_test.txt").read() == "kept" + std::string(150, 'x'));
+        }
+    }
+
+    SECTION("Can't read or use direct I/O") {
+        REQUIRE_THROWS(file::async_writer("words", file::mode::read));
+        file::options opts;
+        opts.direct = true;
+        REQUIRE_THROWS(file::async_writer("write_test.txt", file::mode::write, opts));
+    }
+
+#ifdef __linux__
+    SECTION("Write errors are rethrown, but not from the destructor") {
+        file::options opts;
+        opts.buffer_size = 100;
+        file::async_writer w("/dev/full", file::mode::write, opts);
+        auto fill = [&] {
+            for (int i = 0; i < 100; i++) {
+                w.write(std::string(1000, 'x'));
+            }
+        };
+        REQUIRE_THROWS(fill());
+        REQUIRE_THROWS(w.write(std::string(1000, 'x')));
+        REQUIRE_THROWS(w.flush());
+    }
+#endif
+    SECTION("Can't write after close") {
+        file::async_writer w("write_test.txt", file::mode::write);
+        w.close();
+        REQUIRE(w.closed());
+        REQUIRE_THROWS(w.write("x"));
+    }
+}
+
+TEST_CASE("Shared appender", "[unit]") {
+    SECTION("Records from many threads stay whole and in order per thread") {
+        const size_t nthreads = 8;
+        const size_t records = 2000;
+        {
+            file::options opts;
+            opts.buffer_size = 500;
+            file::shared_appender a("write_test.txt", file::mode::write, opts);
+            // Catch assertions aren't thread safe
+            std::atomic<size_t> short_writes{0};
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < nthreads; t++) {
+                threads.emplace_back([&, t] {
+                    for (size_t i = 0; i < records; i++) {
+                        // Some records are bigger than the buffer
+                        std::string record = std::to_string(t) + " " + std::to_string(i) + " " + 
+                            std::string((i % 100 == 0) ? 600 : i % 50, 'x') + "\n";
+                        if (a.write(record) != record.size()) {
+                            short_writes++;
+                        }
+                    }
+                });
+            }
+            for (auto& t : threads) {
+                t.join();
+            }
+            REQUIRE(short_writes == 0);
+        }
+
+        std::vector<size_t> next(nthreads, 0);
+        auto f = file::open("write_test.txt");
+        size_t count = 0;
+        for (std::string_view line : f.lines_view()) {
+            size_t t = std::stoul(std::string(line.substr(0, line.find(' '))));
+            line.remove_prefix(line.find(' ') + 1);
+            size_t i = std::stoul(std::string(line.substr(0, line.find(' '))));
+            line.remove_prefix(line.find(' ') + 1);
+            REQUIRE(t < nthreads);
+            REQUIRE(i == next[t]);
+            REQUIRE(line == std::string((i % 100 == 0) ? 600 : i % 50, 'x'));
+            next[t]++;
+            count++;
+        }
+        REQUIRE(count == nthreads * records);
+    }
+
+    SECTION("Flush writes every thread's records") {
+        file::shared_appender a("write_test.txt", file::mode::write);
+        std::thread([&] { a.write("other\n"); }).join();
+        a.write("main\n");
+        a.flush();
+        std::string contents = file::open("write_test.txt").read();
+        REQUIRE((contents == "other\nmain\n" || contents == "main\nother\n"));
+    }
+
+    SECTION("Appends") {
+        {
+            file::shared_appender a("write_test.txt", file::mode::write);
+            a.write("a\n");
+        }
+        {
+            file::shared_appender a("write_test.txt");
+            a.write("b\n");
+        }
+        REQUIRE(file::open("write_test.txt").read() == "a\nb\n");
+    }
+
+    SECTION("Can't read") {
+        REQUIRE_THROWS(file::shared_appender("words", file::mode::read));
+    }
+
+#ifdef __linux__
+    SECTION("Write errors close the file, but aren't thrown from the destructor") {
+        {
+            file::shared_appender a("/dev/full", file::mode::write);
+            a.write("x");
+            REQUIRE_THROWS(a.close());
+            REQUIRE(a.closed());
+            REQUIRE_THROWS(a.write("x"));
+        }
+        {
+            file::shared_appender a("/dev/full", file::mode::write);
+            std::thread([&] { a.write("x"); }).join();
+        }
+    }
+#endif
+}
+
+TEST_CASE("Follow a file", "[unit]") {
+    using namespace std::chrono_literals;
+    const char* path = "follow_test.txt";
+    file::open(path, file::mode::write).write("a\nb");
+    auto append = [&](std::string_view sv) {
+        file::open<file::raw>(path, file::mode::append).write(sv.data(), sv.size());
+    };
+
+    file::follower f(path);
+    std::string line;
+    REQUIRE(f.read_line(line, 0ms));
+    REQUIRE(line == "a");
+
+    SECTION("Holds back a partial line") {
+        REQUIRE(!f.read_line(line, 10ms));
+        append("c\r\nd\n");
+        REQUIRE(f.read_line(line, 0ms));
+        REQUIRE(line == "bc");
+        REQUIRE(f.read_line(line, 0ms));
+        REQUIRE(line == "d");
+    }
+
+    SECTION("Wakes up on a write") {
+        std::thread writer([&] {
+            std::this_thread::sleep_for(50ms);
+            append("c\n");
+        });
+        auto start = std::chrono::steady_clock::now();
+        bool read = f.read_line(line, 10s);
+        writer.join();
+        REQUIRE(read);
+        REQUIRE(line == "bc");
+        REQUIRE(std::chrono::steady_clock::now() - start < 5s);
+    }
+
+    SECTION("Starts over when truncated") {
+        file::open(path, file::mode::write).write("x\n");
+        REQUIRE(f.read_line(line, 1s));
+        REQUIRE(line == "x");
+        REQUIRE(f.truncations() == 1);
+    }
+
+#ifndef _WIN32
+    SECTION("Reopens a rotated file") {
+        REQUIRE(::rename(path, "follow_test.txt.1") == 0);
+        append("new\n");
+        REQUIRE(f.read_line(line, 1s));
+        REQUIRE(line == "b");
+        REQUIRE(f.read_line(line, 1s));
+        REQUIRE(line == "new");
+        REQUIRE(f.rotations() == 1);
+        ::remove("follow_test.txt.1");
+    }
+#endif
+
+    SECTION("Can start at the end") {
+        file::follower end(path, true);
+        REQUIRE(!end.read_line(line, 0ms));
+        append("\nmore\n");
+        REQUIRE(end.read_line(line, 1s));
+        REQUIRE(line == "");
+        REQUIRE(end.read_line(line, 1s));
+        REQUIRE(line == "more");
+    }
+
+    SECTION("Stop wakes up a waiting read") {
+        std::thread stopper([&] {
+            std::this_thread::sleep_for(50ms);
+            f.stop();
+        });
+        REQUIRE(!f.read_line(line));
+        stopper.join();
+        REQUIRE(!f.read_line(line, 0ms));
+    }
+    ::remove(path);
+}
+
+TEST_CASE("Atomic replace and group sync", "[unit]") {
+    const char* path = "replace_test.txt";
+
+    SECTION("Replaces the whole file on close") {
+        file::replace(path, "one");
+        REQUIRE(file::open(path).read() == "one");
+
+        file::options opts;
+        opts.atomic_replace = true;
+        auto f = file::open(path, file::mode::write, opts);
+        f.write("two");
+        f.flush();
+        REQUIRE(file::open(path).read() == "one");
+        f.close();
+        REQUIRE(file::open(path).read() == "two");
+
+#ifndef _WIN32
+        // Nothing is left behind
+        std::string listing;
+        if (DIR* dir = ::opendir(".")) {
+            while (dirent* entry = ::readdir(dir)) {
+                listing += entry->d_name;
+                listing += '\n';
+            }
+            ::closedir(dir);
+        }
+        REQUIRE(listing.find("replace_test.txt.tmp") == std::string::npos);
+#endif
+    }
+
+    SECTION("Keeps the old file if an exception is thrown") {
+        file::replace(path, "old");
+        try {
+            file::options opts;
+            opts.atomic_replace = true;
+            auto f = file::open(path, file::mode::write, opts);
+            f.write("new");
+            throw std::runtime_error("failed");
+        } catch (const std::runtime_error&) {
+        }
+        REQUIRE(file::open(path).read() == "old");
+    }
+
+#ifndef _WIN32
+    SECTION("A failed replacement throws from close but not the destructor") {
+        ::rmdir("replace_dir");
+        REQUIRE(::mkdir("replace_dir", 0755) == 0);
+        file::options opts;
+        opts.atomic_replace = true;
+        {
+            auto f = file::open("replace_dir", file::mode::write, opts);
+            f.write("x");
+        }
+        auto f = file::open("replace_dir", file::mode::write, opts);
+        f.write("x");
+        REQUIRE_THROWS(f.close());
+        REQUIRE(f.closed());
+        REQUIRE(::rmdir("replace_dir") == 0);
+    }
+
+    SECTION("Keeps the permissions of the replaced file") {
+        file::replace(path, "secret");
+        REQUIRE(::chmod(path, 0600) == 0);
+        file::replace(path, "new secret");
+        struct stat st;
+        REQUIRE(::stat(path, &st) == 0);
+        REQUIRE((st.st_mode & 07777) == 0600);
+        REQUIRE(file::open(path).read() == "new secret");
+    }
+#endif
+
+    SECTION("Only for mode::write") {
+        file::options opts;
+        opts.atomic_replace = true;
+        REQUIRE_THROWS(file::open(path, file::mode::append, opts));
+    }
+
+    SECTION("Group sync combines concurrent syncs") {
+        auto f = file::open<file::raw>(path, file::mode::write);
+        file::group_sync syncer(f);
+        std::atomic<int> done{0};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 8; t++) {
+            threads.emplace_back([&] {
+                for (int i = 0; i < 20; i++) {
+                    f.write("x", 1);
+                    syncer.sync();
+                    done++;
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        REQUIRE(done == 160);
+        REQUIRE(syncer.syncs() >= 1);
+        REQUIRE(syncer.syncs() <= 160);
+        REQUIRE(f.size() == 0); // as of opening
+        REQUIRE(file::open(path).read() == std::string(160, 'x'));
+
+        auto read_only = file::open<file::raw>(path, file::mode::read);
+        file::group_sync failing(read_only);
+        REQUIRE_THROWS(failing.sync());
+        REQUIRE_THROWS(failing.sync());
+    }
+    ::remove(path);
+}
+
+TEST_CASE("Copy and transfer", "[unit]") {
+    std::string expected = file::open("words").read();
+
+    SECTION("Copy a file") {
+        file::open<file::raw>("write_test.txt", file::mode::write).write("old contents", 12);
+        REQUIRE(file::copy("words", "write_test.txt") == static_cast<int64_t>(expected.size()));
+        REQUIRE(file::open("write_test.txt").read() == expected);
+        REQUIRE_THROWS(file::copy("does_not_exist.txt", "write_test.txt"));
+
+        // Copying onto itself mustn't empty it first
+        REQUIRE_THROWS(file::copy("write_test.txt", "./write_test.txt"));
+        REQUIRE(file::open("write_test.txt").read() == expected);
+    }
+
+    SECTION("Transfer a range") {
+        auto src = file::open<file::raw>("words");
+        {
+            auto dst = file::open<file::raw>("write_test.txt", file::mode::write);
+            dst.write("head ", 5);
+            REQUIRE(src.transfer_to(dst, 1000, 5000) == 5000);
+            REQUIRE(dst.tell() == 5005);
+            REQUIRE(src.tell() == 0);
+        }
+        REQUIRE(file::open("write_test.txt").read() == "head " + expected.substr(1000, 5000));
+    }
+
+    SECTION("Transfer stops at the end of the file") {
+        auto src = file::open<file::raw>("words");
+        {
+            auto dst = file::open<file::raw>("write_test.txt", file::mode::write);
+            REQUIRE(src.transfer_to(dst, src.size() - 10, 100) == 10);
+            REQUIRE(src.transfer_to(dst, src.size(), 100) == 0);
+        }
+        REQUIRE(file::open("write_test.txt").read() == expected.substr(expected.size() - 10));
+    }
+
+    SECTION("Transfer to an append mode file") {
+        file::open<file::raw>("write_test.txt", file::mode::write).write("a", 1);
+        auto src = file::open<file::raw>("words");
+        {
+            auto dst = file::open<file::raw>("write_test.txt", file::mode::append);
+            REQUIRE(src.transfer_to(dst, 0, expected.size()) == expected.size());
+        }
+        REQUIRE(file::open("write_test.txt").read() == "a" + expected);
+    }
+
+    SECTION("Can't transfer to a read mode file") {
+        auto src = file::open<file::raw>("words");
+        auto dst = file::open<file::raw>("words");
+        REQUIRE_THROWS(src.transfer_to(dst, 0, 10));
+    }
+}
+
+TEST_CASE("Read many files", "[unit]") {
+    std::string words = file::open("words").read();
+    std::string test = file::open("test.txt").read();
+    file::open("empty_test.txt", file::mode::write);
+
+    std::vector<std::string> paths;
+    for (int i = 0; i < 40; i++) {
+        paths.push_back((i % 2) ? "words" : "test.txt");
+    }
+    paths[7] = "does_not_exist";
+    paths[20] = "empty_test.txt";
+#ifdef __linux__
+    // stat says 0 bytes so it takes more than one read
+    paths[33] = "/proc/self/status";
+#endif
+
+    for (size_t nthreads : {1, 0, 3}) {
+        file::batch b = file::read_all(paths, nthreads);
+        REQUIRE(b.contents.size() == paths.size());
+        REQUIRE(b.errors.size() == paths.size());
+        for (size_t i = 0; i < paths.size(); i++) {
+            if (i == 7) {
+                REQUIRE(!b.ok(7));
+                REQUIRE(b.contents[7].empty());
+            } else if (i == 20) {
+                REQUIRE(b.ok(20));
+                REQUIRE(b.contents[20].empty());
+            } else if (i == 33 && paths[i] != "words") {
+                REQUIRE(b.ok(33));
+                REQUIRE(b.contents[33].rfind("Name:", 0) == 0);
+            } else {
+                REQUIRE(b.ok(i));
+                REQUIRE(b.contents[i] == ((i % 2) ? words : test));
+            }
+        }
+
+        // Views stay valid when the batch moves
+        file::batch moved = std::move(b);
+        REQUIRE(moved.contents[1] == words);
+        REQUIRE(moved.contents[1].data() >= moved.data.data());
+    }
+
+    REQUIRE(file::read_all({}).contents.empty());
+}
+
+TEST_CASE("Preallocation and sparse files", "[unit]") {
+    const char* path = "sparse_test.txt";
+
+    SECTION("Preallocating keeps the size") {
+        {
+            file::options opts;
+            opts.expected_size = 1024 * 1024;
+            auto f = file::open(path, file::mode::write, opts);
+            f.write("hello");
+            auto r = file::open<file::raw>(path, file::mode::append);
+            r.preallocate(2 * 1024 * 1024);
+        }
+        REQUIRE(file::open(path).read() == "hello");
+        REQUIRE_THROWS(file::open<file::raw>(path).preallocate(10));
+    }
+
+#ifndef _WIN32
+    SECTION("Expected sizes are only a hint") {
+        file::options opts;
+        opts.expected_size = 1024 * 1024;
+        for (int i = 0; i < 10; i++) {
+            auto f = file::open<file::raw>("/dev/null", file::mode::write, opts);
+            REQUIRE(f.write("x", 1) == 1);
+        }
+    }
+#endif
+
+    SECTION("Punched holes read back as zeros") {
+        const int64_t block = 64 * 1024;
+        {
+            auto f = file::open<file::raw>(path, file::mode::write);
+            std::string data(3 * block, 'x');
+            f.write(data.data(), data.size());
+            f.punch_hole(block, block);
+            // Past the end does nothing
+            f.punch_hole(3 * block, block);
+        }
+        std::string expected = std::string(block, 'x') + std::string(block, '\0') + std::string(block, 'x');
+        REQUIRE(file::open(path).read() == expected);
+    }
+
+    SECTION("Finds data and holes") {
+        const int64_t gap = 4 * 1024 * 1024;
+        {
+            auto f = file::open<file::raw>(path, file::mode::write);
+            f.write("start", 5);
+            f.write_at(gap, "end", 3);
+            f.resize(2 * gap);
+        }
+        auto f = file::open<file::raw>(path);
+        REQUIRE(f.size() == 2 * gap);
+        REQUIRE(f.seek(0, file::seek_mode::data) == 0);
+        REQUIRE(f.seek(0, file::seek_mode::hole) > 0);
+        REQUIRE(f.seek(gap + 3, file::seek_mode::hole) <= 2 * gap);
+        REQUIRE(f.seek(2 * gap, file::seek_mode::data) == 2 * gap);
+
+        f.seek(1, file::seek_mode::set);
+        std::vector<file::extent> extents = f.data_extents();
+        REQUIRE(f.tell() == 1);
+        REQUIRE(!extents.empty());
+        REQUIRE(extents.front().offset == 0);
+        int64_t covered = 0;
+        int64_t prev_end = 0;
+        for (const file::extent& e : extents) {
+            REQUIRE(e.offset >= prev_end);
+            prev_end = e.offset + e.length;
+            covered += e.length;
+        }
+        REQUIRE(prev_end <= 2 * gap);
+        REQUIRE(covered >= 8);
+
+        // Reading data through the file finds the second write
+        auto buffered = file::open(path);
+        int64_t next = buffered.seek(4096, file::seek_mode::data);
+        REQUIRE(next <= gap);
+        buffered.seek(gap, file::seek_mode::set);
+        REQUIRE(buffered.read(3) == "end");
+
+        // Copies keep the contents and size, holes included
+        REQUIRE(file::copy(path, "sparse_copy.txt") == 2 * gap);
+        REQUIRE(file::open("sparse_copy.txt").read() == file::open(path).read());
+        ::remove("sparse_copy.txt");
+    }
+    ::remove(path);
+}
+
+TEST_CASE("Records", "[unit]") {
+    using fields = std::vector<std::string_view>;
+    auto collect = [](file::file& f, char delim, file::quoting q) {
+        std::vector<std::vector<std::string>> out;
+        for (const auto& record : f.records(delim, q)) {
+            out.emplace_back(record.begin(), record.end());
+        }
+        return out;
+    };
+
+    SECTION("Splits lines on the delimiter") {
+        file::open("write_test.txt", file::mode::write).write("a,b,c\r\n,,\nlast,line");
+        for (size_t buffer_size : {0, 3, 7}) {
+            file::options opts;
+            opts.buffer_size = buffer_size;
+            auto f = file::open("write_test.txt", file::mode::read, opts);
+            auto records = collect(f, ',', file::quoting::none);
+            REQUIRE(records == std::vector<std::vector<std::string>>{{"a", "b", "c"}, {"", "", ""}, {"last", "line"}});
+        }
+    }
+
+    SECTION("Matches splitting lines by hand") {
+        std::string tsv;
+        auto in = file::open("words");
+        for (std::string_view line : in.lines_view()) {
+            tsv.append(line).append("\t").append(std::to_string(line.size())).append("\t\n");
+        }
+        file::open("write_test.txt", file::mode::write).write(tsv);
+
+        file::options opts;
+        opts.buffer_size = 1000;
+        auto words = file::open("words");
+        auto f = file::open("write_test.txt", file::mode::read, opts);
+        fields record;
+        std::string_view word;
+        while (words.read_line_view(word)) {
+            REQUIRE(f.read_record(record, '\t'));
+            REQUIRE(record == fields{word, std::to_string(word.size()), ""});
+        }
+        REQUIRE_FALSE(f.read_record(record, '\t'));
+        REQUIRE(record.empty());
+    }
+
+    SECTION("Unescapes quoted fields") {
+        file::open("write_test.txt", file::mode::write).write(
+            "\"a,b\",\"say \"\"hi\"\"\",plain\n"
+            "\"multi\nline\",\"\"\n"
+            "\"open");
+        for (size_t buffer_size : {0, 2, 5}) {
+            file::options opts;
+            opts.buffer_size = buffer_size;
+            auto f = file::open("write_test.txt", file::mode::read, opts);
+            auto records = collect(f, ',', file::quoting::double_quotes);
+            REQUIRE(records == std::vector<std::vector<std::string>>{
+                {"a,b", "say \"hi\"", "plain"}, {"multi\nline", ""}, {"open"}});
+        }
+    }
+
+    SECTION("Unescaping leaves the buffered bytes alone") {
+        std::string contents = "x,y\n\"a\"\"b\",c\nnext\n";
+        file::open("write_test.txt", file::mode::write).write(contents);
+        auto f = file::open("write_test.txt");
+        fields record;
+        REQUIRE(f.read_record(record, ',', file::quoting::double_quotes));
+        REQUIRE(f.read_record(record, ',', file::quoting::double_quotes));
+        REQUIRE(record == fields{"a\"b", "c"});
+        f.seek(0, file::seek_mode::set);
+        REQUIRE(f.read() == contents);
+
+        f.seek(0, file::seek_mode::set);
+        auto records = f.records(',', file::quoting::double_quotes);
+        auto r = records.begin();
+        REQUIRE(*r++ == fields{"x", "y"});
+        REQUIRE(*r == fields{"a\"b", "c"});
+    }
+
+    SECTION("Quotes are plain bytes without quoting") {
+        file::open("write_test.txt", file::mode::write).write("\"a,b\"\n");
+        auto f = file::open("write_test.txt");
+        fields record;
+        REQUIRE(f.read_record(record));
+        REQUIRE(record == fields{"\"a", "b\""});
+    }
+}
+
+TEST_CASE("Delimited and fixed records", "[unit]") {
+    std::string expected = file::open("words").read();
+
+    SECTION("Single byte delimiters") {
+        std::string nul_separated = expected;
+        std::replace(nul_separated.begin(), nul_separated.end(), '\n', '\0');
+        file::open("write_test.txt", file::mode::write).write(nul_separated);
+
+        file::options opts;
+        opts.buffer_size = 1000;
+        auto words = file::open("words");
+        auto f = file::open("write_test.txt", file::mode::read, opts);
+        std::string_view word;
+        for (std::string_view record : f.records_until({"\0", 1})) {
+            REQUIRE(words.read_line_view(word));
+            REQUIRE(record == word);
+        }
+        REQUIRE_FALSE(words.read_line_view(word));
+    }
+
+    SECTION("Multi byte delimiters") {
+        file::open("write_test.txt", file::mode::write).write("one--two---three----");
+        for (size_t buffer_size : {0, 1, 2, 3, 5}) {
+            file::options opts;
+            opts.buffer_size = buffer_size;
+            auto f = file::open("write_test.txt", file::mode::read, opts);
+            std::vector<std::string> records;
+            for (std::string_view record : f.records_until("--")) {
+                records.emplace_back(record);
+            }
+            REQUIRE(records == std::vector<std::string>{"one", "two", "-three", ""});
+        }
+    }
+
+    SECTION("Matches lines with a newline delimiter") {
+        file::options opts;
+        opts.buffer_size = 1000;
+        for (std::string delim : {"\n", "e\n"}) {
+            auto f = file::open("words", file::mode::read, opts);
+            std::string joined;
+            for (std::string_view record : f.records_until(delim)) {
+                joined.append(record).append(delim);
+            }
+            REQUIRE(joined.substr(0, expected.size()) == expected);
+        }
+    }
+
+    SECTION("Fixed length records") {
+        for (size_t buffer_size : {0, 7, 1000}) {
+            file::options opts;
+            opts.buffer_size = buffer_size;
+            auto f = file::open("words", file::mode::read, opts);
+            size_t offset = 0;
+            for (std::string_view record : f.records_fixed(24)) {
+                REQUIRE(record == std::string_view(expected).substr(offset, 24));
+                offset += record.size();
+            }
+            REQUIRE(offset == expected.size());
+        }
+        auto f = file::open("words");
+        REQUIRE_THROWS(f.records_fixed(0));
+        REQUIRE_THROWS(f.records_until(""));
+    }
+}
+
+TEST_CASE("Binary values", "[unit]") {
+    struct header {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t flags;
+    };
+
+    SECTION("Round trips values in every byte order") {
+        for (auto order : {file::byte_order::native, file::byte_order::little, file::byte_order::big}) {
+            {
+                auto f = file::open("write_test.txt", file::mode::write);
+                REQUIRE(f.write(uint32_t(0x01020304), order) == 4);
+                REQUIRE(f.write(int16_t(-2), order) == 2);
+                REQUIRE(f.write(1.5, order) == 8);
+                REQUIRE(f.write(header{7, 1, 2}) == sizeof(header));
+            }
+            auto f = file::open("write_test.txt");
+            REQUIRE(f.read<uint32_t>(order) == 0x01020304);
+            REQUIRE(f.read<int16_t>(order) == -2);
+            REQUIRE(f.read<double>(order) == 1.5);
+            header h = f.read<header>();
+            REQUIRE((h.magic == 7 && h.version == 1 && h.flags == 2));
+            REQUIRE_THROWS(f.read<uint8_t>());
+        }
+    }
+
+    SECTION("Writes the requested byte order") {
+        {
+            auto f = file::open("write_test.txt", file::mode::write);
+            f.write(uint32_t(0x01020304), file::byte_order::big);
+            f.write(uint16_t(0x0506), file::byte_order::little);
+        }
+        REQUIRE(file::open("write_test.txt").read() == "\x01\x02\x03\x04\x06\x05");
+    }
+
+    SECTION("Round trips arrays through and around the buffer") {
+        std::vector<uint64_t> values(10000);
+        for (size_t i = 0; i < values.size(); i++) {
+            values[i] = i * 0x0102030405060708ull;
+        }
+        for (auto order : {file::byte_order::native, file::byte_order::little, file::byte_order::big}) {
+            for (size_t buffer_size : {0, 5, 100000}) {
+                file::options opts;
+                opts.buffer_size = buffer_size;
+                {
+                    auto f = file::open("write_test.txt", file::mode::write, opts);
+                    REQUIRE(f.write_array(values.data(), 3, order) == 24);
+                    REQUIRE(f.write_array(values.data() + 3, values.size() - 3, order) == (values.size() - 3) * 8);
+                }
+                auto f = file::open("write_test.txt", file::mode::read, opts);
+                std::vector<uint64_t> read(values.size() + 1);
+                REQUIRE(f.read_array(read.data(), 1, order) == 1);
+                REQUIRE(f.read_array(read.data() + 1, read.size() - 1, order) == values.size() - 1);
+                read.pop_back();
+                REQUIRE(read == values);
+            }
+        }
+    }
+
+    SECTION("Byte swaps every value size") {
+        std::string bytes;
+        for (int i = 0; i < 256; i++) {
+            bytes.push_back(static_cast<char>(i));
+        }
+        for (size_t size : {1, 2, 4, 8}) {
+            for (size_t count = 0; count <= 256 / size; count++) {
+                std::string swapped(bytes.size(), '\0');
+                file::detail::byte_swap(&swapped[0], bytes.data(), count, size);
+                for (size_t i = 0; i < count * size; i++) {
+                    REQUIRE(swapped[i] == bytes[(i / size) * size + size - 1 - i % size]);
+                }
+            }
+        }
+    }
+
+    SECTION("Can't swap structs") {
+        auto f = file::open("write_test.txt", file::mode::write);
+        auto swapped = file::detail::native_little_endian ? file::byte_order::big : file::byte_order::little;
+        REQUIRE_THROWS(f.write(header{}, swapped));
+    }
+}
+
+TEST_CASE("Decompress while reading", "[unit]") {
+    std::string expected = file::open("words").read();
+
+#ifdef FILE_ZLIB
+    // Two gzip members, which gunzip reads as one stream
+    {
+        gzFile gz = gzopen("write_test.txt", "wb");
+        REQUIRE(gz);
+        size_t half = expected.size() / 2;
+        REQUIRE(gzwrite(gz, expected.data(), static_cast<unsigned>(half)) == static_cast<int>(half));
+        gzclose(gz);
+        gz = gzopen("write_test.txt", "ab");
+        REQUIRE(gzwrite(gz, expected.data() + half, static_cast<unsigned>(expected.size() - half)) > 0);
+        gzclose(gz);
+    }
+
+    for (bool ahead : {false, true}) {
+        file::options opts;
+        opts.decompress = file::compression::detect;
+        opts.decompress_ahead = ahead;
+        SECTION(ahead ? "Read ahead on a thread" : "Read on this thread") {
+            SECTION("Read all") {
+                auto f = file::open("write_test.txt", file::mode::read, opts);
+                REQUIRE(f.read() == expected);
+                REQUIRE(f.tell() == static_cast<int64_t>(expected.size()));
+            }
+            SECTION("Read lines") {
+                opts.buffer_size = 1000;
+                auto f = file::open("write_test.txt", file::mode::read, opts);
+                auto words = file::open("words");
+                std::string_view word;
+                for (const std::string& line : f.lines()) {
+                    REQUIRE(words.read_line_view(word));
+                    REQUIRE(line == word);
+                }
+                REQUIRE_FALSE(words.read_line_view(word));
+            }
+            SECTION("Large and small reads") {
+                opts.buffer_size = 1000;
+                auto f = file::open("write_test.txt", file::mode::read, opts);
+                REQUIRE(f.read(10) == expected.substr(0, 10));
+                REQUIRE(f.read(500000) == expected.substr(10, 500000));
+                REQUIRE(f.read() == expected.substr(500010));
+            }
+            SECTION("Can't seek or read at offsets") {
+                auto f = file::open("write_test.txt", file::mode::read, opts);
+                char c;
+                REQUIRE_THROWS(f.read_at(0, &c, 1));
+                REQUIRE_THROWS(f.seek(10000000, file::seek_mode::set));
+            }
+        }
+    }
+
+    SECTION("Truncated data throws") {
+        std::string compressed = file::open("write_test.txt").read();
+        file::open("write_test.txt", file::mode::write).write(compressed.substr(0, compressed.size() / 3));
+        file::options opts;
+        opts.decompress = file::compression::gzip;
+        auto f = file::open("write_test.txt", file::mode::read, opts);
+        REQUIRE_THROWS(f.read());
+    }
+
+    SECTION("Zero padding after the last member is ignored") {
+        file::open("write_test.txt", file::mode::append).write(std::string(1000, '\0'));
+        file::options opts;
+        opts.decompress = file::compression::gzip;
+        REQUIRE(file::open("write_test.txt", file::mode::read, opts).read() == expected);
+    }
+#endif
+
+#if defined(FILE_ZSTD) || defined(FILE_LZ4)
+    // Writes frames as one file and checks it reads back as expected, then that a truncated copy
+    // throws
+    auto check_frames = [&](const std::vector<std::string>& frames, file::compression format) {
+        std::string compressed;
+        for (const std::string& frame : frames) {
+            compressed += frame;
+        }
+        file::open("write_test.txt", file::mode::write).write(compressed);
+        for (bool ahead : {false, true}) {
+            file::options opts;
+            opts.decompress = file::compression::detect;
+            opts.decompress_ahead = ahead;
+            opts.buffer_size = 1000;
+            auto f = file::open("write_test.txt", file::mode::read, opts);
+            REQUIRE(f.read(10) == expected.substr(0, 10));
+            REQUIRE(f.read() == expected.substr(10));
+            REQUIRE(f.read(1).empty());
+        }
+
+        file::options opts;
+        opts.decompress = format;
+        file::open("write_test.txt", file::mode::write).write(compressed.substr(0, compressed.size() - 10));
+        REQUIRE_THROWS(file::open("write_test.txt", file::mode::read, opts).read());
+        file::open("write_test.txt", file::mode::write);
+        REQUIRE(file::open("write_test.txt", file::mode::read, opts).read().empty());
+    };
+    size_t half = expected.size() / 2;
+    std::vector<std::string> halves = {expected.substr(0, half), expected.substr(half)};
+#endif
+
+#ifdef FILE_ZSTD
+    SECTION("Concatenated zstd frames") {
+        std::vector<std::string> frames;
+        for (const std::string& part : halves) {
+            std::string frame(ZSTD_compressBound(part.size()), '\0');
+            size_t n = ZSTD_compress(&frame[0], frame.size(), part.data(), part.size(), 1);
+            REQUIRE_FALSE(ZSTD_isError(n));
+            frame.resize(n);
+            frames.push_back(frame);
+        }
+        check_frames(frames, file::compression::zstd);
+    }
+#endif
+
+#ifdef FILE_LZ4
+    SECTION("Concatenated lz4 frames") {
+        std::vector<std::string> frames;
+        for (const std::string& part : halves) {
+            std::string frame(LZ4F_compressFrameBound(part.size(), nullptr), '\0');
+            size_t n = LZ4F_compressFrame(&frame[0], frame.size(), part.data(), part.size(), nullptr);
+            REQUIRE_FALSE(LZ4F_isError(n));
+            frame.resize(n);
+            frames.push_back(frame);
+        }
+        check_frames(frames, file::compression::lz4);
+    }
+#endif
+
+    SECTION("Detect leaves uncompressed files alone") {
+        file::options opts;
+        opts.decompress = file::compression::detect;
+        REQUIRE(file::open("words", file::mode::read, opts).read() == expected);
+    }
+
+#ifndef FILE_ZSTD
+    SECTION("Formats that weren't built in throw") {
+        file::options opts;
+        opts.decompress = file::compression::zstd;
+        REQUIRE_THROWS(file::open("words", file::mode::read, opts));
+    }
+#endif
+}
+
+TEST_CASE("I/O stats", "[unit]") {
+#ifdef FILE_STATS
+    SECTION("Counts reads, refills and lines") {
+        file::io_stats before = file::global_stats();
+        file::options opts;
+        opts.buffer_size = 1000;
+        auto f = file::open("words", file::mode::read, opts);
+        uint64_t lines = 0;
+        for (std::string_view line : f.lines_view()) {
+            (void)line;
+            lines++;
+        }
+        file::io_stats st = f.stats();
+        REQUIRE(st.lines == lines);
+        REQUIRE(st.bytes_read == static_cast<uint64_t>(f.size()));
+        REQUIRE(st.read_calls == static_cast<uint64_t>(f.size() + 999) / 1000 + 1);
+        REQUIRE(st.refills == st.read_calls);
+        REQUIRE(st.write_calls == 0);
+
+        file::io_stats after = file::global_stats();
+        REQUIRE(after.lines - before.lines >= lines);
+        REQUIRE(after.bytes_read - before.bytes_read >= st.bytes_read);
+    }
+
+    SECTION("Counts writes, syncs and copies") {
+        {
+            auto f = file::open("write_test.txt", file::mode::write);
+            f.write("hello\n");
+            f.flush();
+            f.sync();
+            file::io_stats st = f.stats();
+            REQUIRE(st.write_calls == 1);
+            REQUIRE(st.bytes_written == 6);
+            REQUIRE(st.sync_calls == 1);
+        }
+        auto f = file::open("write_test.txt");
+        char buf[4];
+        f.read(buf, sizeof(buf));
+        REQUIRE(f.stats().bytes_copied == 4);
+        auto moved = std::move(f);
+        REQUIRE(moved.stats().bytes_copied == 4);
+    }
+#else
+    auto f = file::open("words");
+    f.read();
+    REQUIRE(f.stats().read_calls == 0);
+    REQUIRE(file::global_stats().bytes_read == 0);
+#endif
+}
+
+TEST_CASE("Line index", "[unit]") {
+    auto lines_of = [](const std::string& path) {
+        std::vector<std::string> lines;
+        auto f = file::open(path);
+        for (auto& line : f.lines()) {
+            lines.push_back(line);
+        }
+        return lines;
+    };
+
+    SECTION("Finds every line") {
+        for (std::string contents : {"", "\n", "a", "a\n", "a\r\n\nb", "a\nb\n\n"}) {
+            file::open("write_test.txt", file::mode::write).write(contents);
+            std::vector<std::string> lines = lines_of("write_test.txt");
+            for (size_t sample : {1, 2, 64}) {
+                file::line_index index("write_test.txt", sample);
+                REQUIRE(index.size() == lines.size());
+                for (size_t i = 0; i < lines.size(); i++) {
+                    REQUIRE(index.line_at(i) == lines[i]);
+                }
+                REQUIRE_THROWS_AS(index.line_at(lines.size()), std::out_of_range);
+            }
+        }
+
+        std::vector<std::string> words = lines_of("words");
+        for (size_t nthreads : {1, 3}) {
+            file::line_index index("words", 7, nthreads);
+            REQUIRE(index.size() == words.size());
+            REQUIRE(index.offset_of(0) == 0);
+            REQUIRE(index.offset_of(1) == static_cast<int64_t>(words[0].size() + 1));
+            for (size_t i = 0; i < words.size(); i += 997) {
+                REQUIRE(index.line_at(i) == words[i]);
+            }
+            REQUIRE(index.line_at(words.size() - 1) == words.back());
+        }
+    }
+
+    SECTION("Binary searches sorted lines") {
+        std::vector<std::string> words = lines_of("words");
+        std::sort(words.begin(), words.end());
+        {
+            auto f = file::open("write_test.txt", file::mode::write);
+            for (const std::string& w : words) {
+                f.write(w);
+                f.write("\n");
+            }
+        }
+        file::line_index index("write_test.txt", 16);
+        for (const std::string& value : std::vector<std::string>{"", "A", "Zz", "a", "aardvark", "m", "zzzzzz", words[12345], words[16]}) {
+            size_t expected = std::lower_bound(words.begin(), words.end(), value) - words.begin();
+            REQUIRE(index.lower_bound(value) == expected);
+        }
+    }
+
+    SECTION("Saves to and loads from a sidecar") {
+        ::remove("words.idx");
+        std::vector<std::string> words = lines_of("words");
+        {
+            auto built = file::line_index::load("words", "words.idx", 32);
+            REQUIRE(built.size() == words.size());
+        }
+        REQUIRE(file::open("words.idx").size() > 0);
+        auto loaded = file::line_index::load("words", "words.idx", 8);
+        // Loaded rather than rebuilt with the new sample
+        REQUIRE(loaded.sample() == 32);
+        auto moved = std::move(loaded);
+        REQUIRE(moved.size() == words.size());
+        REQUIRE(moved.line_at(100000) == words[100000]);
+
+        // A saved index that doesn't match its file is rebuilt
+        file::open("words.idx", file::mode::write).write("junk");
+        REQUIRE(file::line_index::load("words", "words.idx", 8).sample() == 8);
+        ::remove("words.idx");
+    }
+}
+
+TEST_CASE("Map a file", "[unit]") {
+
+    auto m = file::open<file::mapped>("test.txt");
+
+    SECTION("Can view whole file") {
+        REQUIRE(m.view().size() == static_cast<size_t>(m.size()));
+        REQUIRE(m.view() == test_txt);
+    }
+
+    SECTION("Can view a byte range") {
+        REQUIRE(m.view(5, 2) == "is");
+        REQUIRE(m.view(m.size() - 1, 100).size() == 1);
+        REQUIRE(m.view(m.size()).empty());
+        REQUIRE_THROWS(m.view(m.size() + 1));
+    }
+
+    SECTION("Can read lines as iterator") {
+        std::vector<std::string_view> lines;
+        for (std::string_view line : m.lines()) {
+            lines.push_back(line);
+        }
+        REQUIRE(lines.size() == 3);
+        REQUIRE(lines[0] == "this is a line");
+        REQUIRE(lines[1] == "this is line 2");
+        REQUIRE(lines[2] == "end");
+    }
+
+    SECTION("Can't open for writing") {
+        REQUIRE_THROWS(file::open<file::mapped>("test.txt", file::mode::write));
+        REQUIRE(file::open("test.txt").read() == test_txt);
+    }
+
+    SECTION("Can close") {
+        m.close();
+        REQUIRE(m.closed());
+        REQUIRE(m.view().empty());
+    }
+
+    SECTION("Move construct") {
+        file::mapped m2(std::move(m));
+
+        REQUIRE(m.closed());
+        REQUIRE(!m2.closed());
+        REQUIRE(m2.view() == test_txt);
+    }
+}
+
+TEST_CASE("Benchmark words", "[bench]") {
+    BENCHMARK("file wc") {
+        auto f = file::open("words");
+        uint64_t count = 0;
+        for (auto& line : f.lines()) {
+            (void)line;
+            count++;
+        }
+        return count;
+    };
+    
+    BENCHMARK("file wc (lines_view)") {
+        auto f = file::open("words");
+        uint64_t count = 0;
+        for (auto line : f.lines_view()) {
+            (void)line;
+            count++;
+        }
+        return count;
+    };
+
+    // Many opens of small files where allocating the buffer is a visible part of each open
+    BENCHMARK("file open and read (100 times)") {
+        size_t n = 0;
+        for (int i = 0; i < 100; i++) {
+            auto f = file::open("test.txt");
+            n += f.read().size();
+        }
+        return n;
+    };
+
+    BENCHMARK("file open and read pooled (100 times)") {
+        file::options opts;
+        opts.pool = &file::buffer_pool::local();
+        size_t n = 0;
+        for (int i = 0; i < 100; i++) {
+            auto f = file::open("test.txt", file::mode::read, opts);
+            n += f.read().size();
+        }
+        return n;
+    };
+
+    BENCHMARK("file reopen and read (100 times)") {
+        auto f = file::open("test.txt");
+        size_t n = 0;
+        for (int i = 0; i < 100; i++) {
+            f.reopen("test.txt");
+            n += f.read().size();
+        }
+        return n;
+    };
+
+    std::vector<std::string> small_files(100, "test.txt");
+    BENCHMARK("read_all (100 files)") {
+        return file::read_all(small_files).data.size();
+    };
+
+    BENCHMARK("line_index build") {
+        return file::line_index("words").size();
+    };
+
+    file::line_index index("words");
+    BENCHMARK("line_index line_at (1000 lines)") {
+        size_t n = 0;
+        for (size_t i = 0; i < 1000; i++) {
+            n += index.line_at(i * 227).size();
+        }
+        return n;
+    };
+
+    BENCHMARK("file wc (parallel_lines)") {
+        auto f = file::open("words");
+        std::atomic<uint64_t> count{0};
+        f.parallel_lines(0, [&](std::string_view) { count++; }, file::line_order::unordered, 256 * 1024);
+        return count.load();
+    };
+
+    BENCHMARK("mapped wc") {
+        auto m = file::open<file::mapped>("words");
+        uint64_t count = 0;
+        for (auto line : m.lines()) {
+            (void)line;
+            count++;
+        }
+        return count;
+    };
+
+    BENCHMARK("iostream wc") {
+        std::ifstream f("words", std::ios::in | std::ios::binary);
+        uint64_t count = 0;
+        for (std::string line; std::getline(f, line);) {
+            (void)line;
+            count++;
+        }
+        return count;
+    };
+
+    BENCHMARK("file read as string") {
+        auto f = file::open("words");
+        return f.read(); 
+    };
+
+    BENCHMARK("file read as string (1 MiB buffer)") {
+        file::options opts;
+        opts.buffer_size = 1024 * 1024;
+        auto f = file::open("words", file::mode::read, opts);
+        return f.read(); 
+    };
+
+    BENCHMARK("file read as string (adaptive buffer)") {
+        file::options opts;
+        opts.adaptive_buffer = true;
+        auto f = file::open("words", file::mode::read, opts);
+        return f.read(); 
+    };
+
+    std::string reused;
+    BENCHMARK("file read_into reused string") {
+        auto f = file::open("words");
+        return f.read_into(reused);
+    };
+
+    BENCHMARK("mapped read as string") {
+        auto m = file::open<file::mapped>("words");
+        return std::string(m.view());
+    };
+
+    BENCHMARK("iostream read as string (stringstream)") {
+        std::ifstream f("words", std::ios::in | std::ios::binary);
+        std::stringstream buffer;
+        buffer << f.rdbuf();
+        return buffer.str();
+    };
+
+    BENCHMARK("iostream read as string (istreambuf_iterator)") {
+        std::ifstream f("words", std::ios::in | std::ios::binary);
+        return std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    };
+
+    BENCHMARK("iostream read as string (low level)") {
+        std::ifstream f("words", std::ios::in | std::ios::binary);
+        f.seekg(0, std::ios::end);
+        size_t size = f.tellg();
+        std::string buffer(size, ' ');
+        f.seekg(0);
+        f.read(&buffer[0], size);
+        return buffer;
+    };
+
+    BENCHMARK("copy") {
+        return file::copy("words", "write_test.txt");
+    };
+
+    BENCHMARK("copy (read and write through file)") {
+        auto in = file::open("words");
+        auto out = file::open("write_test.txt", file::mode::write);
+        return out.write(in.read());
+    };
+}
+
+TEST_CASE("Benchmark read syscalls", "[bench]") {
+    if (read_syscalls() < 0) {
+        return;
+    }
+
+    auto read_string = [](file::file& f) { f.read(); };
+    auto wc = [](file::file& f) {
+        for (auto line : f.lines_view()) {
+            (void)line;
+        }
+    };
+    auto count = [](const file::options& opts, auto fn) {
+        int64_t before = read_syscalls();
+        auto f = file::open("words", file::mode::read, opts);
+        fn(f);
+        return read_syscalls() - before;
+    };
+
+    file::options block;
+    file::options large;
+    large.buffer_size = 1024 * 1024;
+    file::options adaptive;
+    adaptive.adaptive_buffer = true;
+
+    std::cout << "read syscalls               block size    1 MiB    adaptive\n"
+              << "  file read as string       " 
+              << count(block, read_string) << "\t\t" << count(large, read_string) << "\t " 
+              << count(adaptive, read_string) << "\n"
+              << "  file wc (lines_view)      " 
+              << count(block, wc) << "\t\t" << count(large, wc) << "\t " << count(adaptive, wc) << "\n";
+
+    // Whole file reads bypass the buffer so the buffer size doesn't matter
+    REQUIRE(count(block, read_string) <= 3);
+    REQUIRE(count(large, wc) < count(block, wc));
+    REQUIRE(count(adaptive, wc) < count(block, wc));
+}
+
+TEST_CASE("Benchmark writes", "[bench]") {
+    // Small log records, like one line per event
+    std::vector<std::string> records;
+    for (size_t i = 0; i < 100000; i++) {
+        records.push_back("event " + std::to_string(i) + " ok\n");
+    }
+    std::string blob = file::open("words").read();
+    blob += blob;
+    blob += blob;
+
+    BENCHMARK("file write records") {
+        auto f = file::open("write_test.txt", file::mode::write);
+        for (const auto& r : records) {
+            f.write(r);
+        }
+    };
+
+    BENCHMARK("file write records (64 KiB buffer)") {
+        file::options opts;
+        opts.buffer_size = 64 * 1024;
+        auto f = file::open("write_test.txt", file::mode::write, opts);
+        for (const auto& r : records) {
+            f.write(r);
+        }
+    };
+
+    BENCHMARK("file write records (adaptive buffer)") {
+        file::options opts;
+        opts.adaptive_buffer = true;
+        auto f = file::open("write_test.txt", file::mode::write, opts);
+        for (const auto& r : records) {
+            f.write(r);
+        }
+    };
+
+    BENCHMARK("ofstream write records") {
+        std::ofstream f("write_test.txt", std::ios::out | std::ios::binary | std::ios::trunc);
+        for (const auto& r : records) {
+            f.write(r.data(), r.size());
+        }
+    };
+
+    BENCHMARK("fwrite records") {
+        FILE* f = fopen("write_test.txt", "wb");
+        for (const auto& r : records) {
+            fwrite(r.data(), 1, r.size(), f);
+        }
+        fclose(f);
+    };
+
+    file::open("write_test.txt", file::mode::write);
+    BENCHMARK("file append records") {
+        auto f = file::open("write_test.txt", file::mode::append);
+        for (size_t i = 0; i < 1000; i++) {
+            f.write(records[i]);
+        }
+    };
+
+    file::open("write_test.txt", file::mode::write);
+    BENCHMARK("ofstream append records") {
+        std::ofstream f("write_test.txt", std::ios::out | std::ios::binary | std::ios::app);
+        for (size_t i = 0; i < 1000; i++) {
+            f.write(records[i].data(), records[i].size());
+        }
+    };
+
+    file::open("write_test.txt", file::mode::write);
+    BENCHMARK("fwrite append records") {
+        FILE* f = fopen("write_test.txt", "ab");
+        for (size_t i = 0; i < 1000; i++) {
+            fwrite(records[i].data(), 1, records[i].size(), f);
+        }
+        fclose(f);
+    };
+
+    BENCHMARK("file write blob") {
+        auto f = file::open("write_test.txt", file::mode::write);
+        return f.write(blob);
+    };
+
+    BENCHMARK("ofstream write blob") {
+        std::ofstream f("write_test.txt", std::ios::out | std::ios::binary | std::ios::trunc);
+        f.write(blob.data(), blob.size());
+    };
+
+    BENCHMARK("fwrite blob") {
+        FILE* f = fopen("write_test.txt", "wb");
+        fwrite(blob.data(), 1, blob.size(), f);
+        fclose(f);
+    };
+}
+
+TEST_CASE("Benchmark write syscalls", "[bench]") {
+    if (write_syscalls() < 0) {
+        return;
+    }
+
+    std::string record = "event 12345 ok\n";
+    const size_t records = 100000;
+    std::string blob = file::open("words").read();
+    auto count = [](const file::options& opts, auto fn) {
+        int64_t before = write_syscalls();
+        {
+            auto f = file::open("write_test.txt", file::mode::write, opts);
+            fn(f);
+        }
+        return write_syscalls() - before;
+    };
+    auto write_records = [&](file::file& f) {
+        for (size_t i = 0; i < records; i++) {
+            f.write(record);
+        }
+    };
+    auto write_blob = [&](file::file& f) { f.write(blob); };
+
+    file::options block;
+    file::options large;
+    large.buffer_size = 1024 * 1024;
+    file::options adaptive;
+    adaptive.adaptive_buffer = true;
+
+    std::cout << "write syscalls              block size    1 MiB    adaptive\n"
+              << "  file write records        " 
+              << count(block, write_records) << "\t\t" << count(large, write_records) << "\t " 
+              << count(adaptive, write_records) << "\n"
+              << "  file write blob           " 
+              << count(block, write_blob) << "\t\t" << count(large, write_blob) << "\t " 
+              << count(adaptive, write_blob) << "\n";
+
+    // Every write fills the buffer before it's flushed, and blobs bypass it
+    size_t total = record.size() * records;
+    REQUIRE(count(large, write_records) <= static_cast<int64_t>(total / large.buffer_size + 1));
+    REQUIRE(count(adaptive, write_records) < count(block, write_records));
+    REQUIRE(count(block, write_blob) <= 3);
+}
+
+TEST_CASE("Benchmark syncs", "[bench]") {
+    // Many writers each waiting for their record to be durable, like a write ahead log
+    auto run = [](bool grouped) {
+        auto f = file::open<file::raw>("write_test.txt", file::mode::write);
+        file::group_sync syncer(f);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 8; t++) {
+            threads.emplace_back([&] {
+                for (int i = 0; i < 50; i++) {
+                    f.write("record\n", 7);
+                    if (grouped) {
+                        syncer.sync();
+                    } else {
+                        f.sync_data();
+                    }
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return std::make_pair(ms, grouped ? syncer.syncs() : 400);
+    };
+
+    auto each = run(false);
+    auto grouped = run(true);
+    std::cout << "400 syncs from 8 threads    ms          syncs\n"
+              << "  sync_data each            " << each.first << "\t" << each.second << "\n"
+              << "  group_sync                " << grouped.first << "\t" << grouped.second << "\n";
+    REQUIRE(grouped.second <= 400);
+}